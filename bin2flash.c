@@ -5,72 +5,814 @@
 #include <assert.h>
 #include <getopt.h>
 #include <sys/stat.h>
-#include "miscutils.h"
 #include "icdi.h"
+#include "miscutils.h"
 #include "tm4c123x.h"
+#include "tm4c123stub.h"
+#include "fwimage.h"
+
+/*
+ * Image bytes handled per erase/write step. icdi_flash_write() splits
+ * it into as few packets as the negotiated packet size allows.
+ */
+#define FLASH_WRITE_CHUNK	(8*FLASH_ERASE_SIZE)
+
+/*
+ * Costs of the flash operations in microseconds, for the erase planner:
+ * one command round trip, erasing one sector of a range erase, a mass
+ * erase and programming one sector. The defaults follow the erase times
+ * of the TM4C123GH6PM data sheet; --erase-cost takes measured ones,
+ * which flash_write() reports after every run.
+ */
+struct flash_cost {
+	unsigned int cmd_us;
+	unsigned int sector_us;
+	unsigned int mass_us;
+	unsigned int write_us;
+};
+#define COST_CMD_US	2000
+#define COST_SECTOR_US	12000
+#define COST_MASS_US	16000
+#define COST_WRITE_US	10000
 
 struct flash_spec {
-	uint32_t addr;
-	uint32_t len;
+	const struct fw_image *img;
+	const struct flash_cost *cost;
 	int erase;
+	uint32_t flashsiz;	/* bytes of flash on the part, 0 if unknown */
+	int diff;
+	int loader;
+	int dryrun;
+	const char *tag;
+	struct job_metrics *jm;	/* erase and read-back times go here */
+	struct job_journal *jn;	/* NULL on a dry run */
+	struct flash_cache *fc;	/* NULL without --cache */
+};
+
+/*
+ * What the last complete flash through an adapter left on the board:
+ * the hash of every sector it knows, kept next to the journals as
+ * "image-<serial>" under a key naming the part. Sectors whose hash
+ * matches the image are skipped without being read back, once one of
+ * them, picked at random, reads back right, showing the board is still
+ * the one the cache describes.
+ */
+struct flash_cache {
+	char path[PATH_MAX];
+	char key[64];
+	uint32_t nsec;		/* 0 when there is nothing to go by */
+	uint64_t *hash;		/* 0 for a sector not known */
+	int used;		/* confirmed, and applied to the plan */
 };
 
-static uint32_t flash_write(const char *binfile, struct icdibuf *buf,
-			const struct flash_spec *fspec)
+/*
+ * Flash sectors the image touches. Only these are erased; bytes of a
+ * touched sector that no segment covers end up erased too. Sectors that
+ * hold nothing but 0xFF are erased and never written.
+ */
+struct sector_plan {
+	uint32_t nsec;		/* sectors from 0 to the end of the image */
+	char *smap;		/* '-' untouched, 'W' to write, 'E' erase only,
+				   '.' unchanged */
+	uint8_t *erased;
+	int mass;		/* one mass erase instead of range erases */
+	int nerase;		/* erase commands */
+	int nerase_sec;		/* sectors erased */
+	int nwrite_sec;		/* sectors written */
+	uint64_t est_us;
+};
+
+static int all_erased(const char *data, int len)
 {
-	uint32_t addr;
-	FILE *fbin;
-	int cklen, len;
-	char *chunk;
+	int i;
+
+	for (i = 0; i < len; i++)
+		if ((uint8_t)data[i] != 0xff)
+			return 0;
+	return 1;
+}
+
+/*
+ * Copy the image bytes in [addr, addr+len) to out, absent bytes read as
+ * erased flash. Returns the length up to the last present byte, rounded
+ * up to a whole word.
+ */
+static int stage_image(const struct fw_image *img, uint32_t addr, int len,
+		char *out)
+{
+	const struct fw_segment *seg;
+	uint32_t start, end, used;
 
-	fbin = fopen(binfile, "rb");
-	if (!fbin) {
-		fprintf(stderr, "Cannot open file: %s\n", binfile);
+	memset(out, 0xff, len);
+	used = 0;
+	for (seg = img->segs; seg < img->segs + img->nsegs; seg++) {
+		if (seg->addr >= addr + len)
+			break;
+		if (seg->addr + seg->len <= addr)
+			continue;
+		start = seg->addr > addr? seg->addr : addr;
+		end = seg->addr + seg->len < addr + len?
+			seg->addr + seg->len : addr + len;
+		memcpy(out + (start - addr), seg->data + (start - seg->addr),
+				end - start);
+		used = end - addr;
+	}
+	return (used + 3) & ~3;
+}
+
+static int plan_sectors(struct sector_plan *plan, const struct fw_image *img)
+{
+	const struct fw_segment *seg;
+	char sector[FLASH_ERASE_SIZE];
+	uint32_t sec;
+
+	memset(plan, 0, sizeof(*plan));
+	plan->nsec = (fw_image_end(img) + FLASH_ERASE_SIZE - 1) /
+			FLASH_ERASE_SIZE;
+	plan->smap = malloc(plan->nsec);
+	plan->erased = malloc(plan->nsec);
+	if (!plan->smap || !plan->erased) {
+		free(plan->smap);
+		free(plan->erased);
 		return 0;
 	}
+	memset(plan->smap, '-', plan->nsec);
+	memset(plan->erased, 0, plan->nsec);
+	for (seg = img->segs; seg < img->segs + img->nsegs; seg++)
+		for (sec = seg->addr / FLASH_ERASE_SIZE;
+			sec <= (seg->addr + seg->len - 1) / FLASH_ERASE_SIZE;
+			sec++)
+			plan->smap[sec] = 'W';
+	for (sec = 0; sec < plan->nsec; sec++) {
+		if (plan->smap[sec] != 'W')
+			continue;
+		stage_image(img, sec * FLASH_ERASE_SIZE, FLASH_ERASE_SIZE,
+				sector);
+		if (all_erased(sector, FLASH_ERASE_SIZE))
+			plan->smap[sec] = 'E';
+	}
+	return 1;
+}
+
+static inline int sector_to_erase(const struct sector_plan *plan, uint32_t sec)
+{
+	return (plan->smap[sec] == 'W' || plan->smap[sec] == 'E') &&
+		!plan->erased[sec];
+}
+
+/*
+ * Merge the sectors to erase into contiguous range erases, and pick a
+ * mass erase instead when it is asked for, or when the image covers the
+ * whole flash and the cost model says it is cheaper. Otherwise a mass
+ * erase would wipe data the image does not hold, so it is never picked.
+ * A mass erase also wipes the unchanged sectors of a differential
+ * flash, so rewriting those is part of its cost.
+ */
+static void plan_erase(struct sector_plan *plan, const struct flash_cost *cost,
+		int mass_erase, uint32_t flashsiz)
+{
+	uint64_t ranges, mass;
+	uint32_t sec;
+	int nkeep, whole;
+
+	plan->nerase = 0;
+	plan->nerase_sec = 0;
+	plan->nwrite_sec = 0;
+	nkeep = 0;
+	/* without a board the flash size is unknown, never covered */
+	whole = flashsiz > 0 &&
+		(uint64_t)plan->nsec * FLASH_ERASE_SIZE >= flashsiz;
+	for (sec = 0; sec < plan->nsec; sec++) {
+		if (plan->smap[sec] == 'W')
+			plan->nwrite_sec++;
+		else if (plan->smap[sec] == '.')
+			nkeep++;
+		else if (plan->smap[sec] == '-')
+			whole = 0;
+		if (!sector_to_erase(plan, sec))
+			continue;
+		plan->nerase_sec++;
+		if (sec == 0 || !sector_to_erase(plan, sec - 1))
+			plan->nerase++;
+	}
+	ranges = (uint64_t)plan->nerase * cost->cmd_us +
+		(uint64_t)plan->nerase_sec * cost->sector_us;
+	mass = cost->cmd_us + cost->mass_us + (uint64_t)nkeep * cost->write_us;
+	plan->mass = mass_erase ||
+		(whole && plan->nerase > 0 && mass < ranges);
+	if (plan->mass) {
+		for (sec = 0; sec < plan->nsec; sec++)
+			if (plan->smap[sec] == '.')
+				plan->smap[sec] = 'W';
+		plan->nwrite_sec += nkeep;
+		plan->nerase = 1;
+		ranges = cost->cmd_us + cost->mass_us;
+	}
+	plan->est_us = ranges + (uint64_t)plan->nwrite_sec * cost->write_us;
+}
 
-	if (fspec->erase && !icdi_flash_erase(buf, 0, 0)) {
-		fprintf(stderr, "Cannot erase flash memory!\n");
+/* carry out the erases of the plan and time them */
+static int run_erase(struct icdibuf *buf, struct sector_plan *plan,
+		const char *tag, uint64_t *usecs)
+{
+	uint32_t sec, run;
+	uint64_t tm0;
+
+	tm0 = icdi_now_us();
+	if (plan->mass) {
+		if (!icdi_flash_erase(buf, 0, 0)) {
+			fprintf(stderr, "%sCannot erase flash memory!\n", tag);
+			return 0;
+		}
+		memset(plan->erased, 1, plan->nsec);
+	}
+	for (sec = 0; sec < plan->nsec; sec += run) {
+		run = 1;
+		if (!sector_to_erase(plan, sec))
+			continue;
+		while (sec + run < plan->nsec && sector_to_erase(plan, sec + run))
+			run++;
+		if (!icdi_flash_erase(buf, sec * FLASH_ERASE_SIZE,
+					run * FLASH_ERASE_SIZE)) {
+			fprintf(stderr, "%sCannot erase flash at %08X\n", tag,
+				sec * FLASH_ERASE_SIZE);
+			return 0;
+		}
+		memset(plan->erased + sec, 1, run);
+	}
+	*usecs = icdi_now_us() - tm0;
+	return 1;
+}
+
+static void plan_free(struct sector_plan *plan)
+{
+	free(plan->smap);
+	free(plan->erased);
+}
+
+/*
+ * Erase, then journal the sectors that needed nothing but erasing. A
+ * mass erase undoes what the journal holds, so it is emptied first.
+ * The image cache stops describing the flash here, and is removed
+ * until the flash completes.
+ */
+static int erase_sectors(struct icdibuf *buf, struct sector_plan *plan,
+		const struct flash_spec *fspec, uint64_t *usecs)
+{
+	uint32_t sec, run;
+
+	if (plan->mass)
+		journal_reset(fspec->jn, fspec->tag);
+	if (fspec->fc && fspec->fc->path[0])
+		unlink(fspec->fc->path);
+	if (!run_erase(buf, plan, fspec->tag, usecs))
 		return 0;
+	for (sec = 0; sec < plan->nsec; sec += run) {
+		for (run = 0; sec + run < plan->nsec &&
+				plan->smap[sec+run] == 'E'; run++)
+			;
+		if (run == 0)
+			run = 1;
+		else
+			journal_commit(fspec->jn, sec * FLASH_ERASE_SIZE,
+					run * FLASH_ERASE_SIZE);
 	}
+	return 1;
+}
 
-	len = 0;
-	chunk = malloc(FLASH_ERASE_SIZE);
-	if (!chunk) {
-		fprintf(stderr, "Out of Memory!\n");
+/*
+ * Read back the sector and compare it with the staged image bytes.
+ * Returns 1 if the sector differs or cannot be read, 0 if identical.
+ */
+static int sector_changed(struct icdibuf *buf, uint32_t addr,
+			const char *chunk, char *sector)
+{
+	if (!tm4c123_debug_ready(buf))
+		return 1;
+	if (icdi_readbin(buf, addr, FLASH_ERASE_SIZE, sector) !=
+			FLASH_ERASE_SIZE)
+		return 1;
+	return memcmp(chunk, sector, FLASH_ERASE_SIZE) != 0;
+}
+
+static void print_sector_map(const char *smap, int nsec, const char *tag)
+{
+	int i;
+
+	printf("%sSector map ('W' written, 'E' erased only, '.' unchanged, " \
+		"'-' not in image):", tag);
+	for (i = 0; i < nsec; i++) {
+		if ((i % 64) == 0)
+			printf("\n%s%08X: ", tag, i * FLASH_ERASE_SIZE);
+		putchar(smap[i]);
+	}
+	printf("\n");
+}
+
+/*
+ * Skip the sectors an earlier run of the same job journaled as done.
+ * The last one committed is read back first; if it no longer matches
+ * the image the flash changed since, and the journal is not trusted.
+ */
+static void resume_plan(struct icdibuf *buf, const struct flash_spec *fspec,
+		struct sector_plan *plan)
+{
+	struct job_journal *jn = fspec->jn;
+	const struct journal_ent *ent;
+	char chunk[FLASH_ERASE_SIZE], sector[FLASH_ERASE_SIZE];
+	uint32_t sec, addr, nskip;
+
+	if (!jn || jn->nents == 0)
+		return;
+	ent = jn->ents + jn->nents - 1;
+	addr = ent->addr + ent->len - FLASH_ERASE_SIZE;
+	stage_image(fspec->img, addr, FLASH_ERASE_SIZE, chunk);
+	if (addr / FLASH_ERASE_SIZE >= plan->nsec ||
+			sector_changed(buf, addr, chunk, sector)) {
+		printf("%sSector at %08X differs from the journal, " \
+			"starting over\n", fspec->tag, addr);
+		journal_reset(jn, fspec->tag);
+		return;
+	}
+	nskip = 0;
+	for (ent = jn->ents; ent < jn->ents + jn->nents; ent++)
+		for (sec = ent->addr / FLASH_ERASE_SIZE;
+			sec < (ent->addr + ent->len) / FLASH_ERASE_SIZE &&
+			sec < plan->nsec; sec++)
+			if (plan->smap[sec] == 'W' || plan->smap[sec] == 'E') {
+				plan->smap[sec] = '.';
+				nskip++;
+			}
+	printf("%sResuming, %u sector(s) done by an earlier run\n",
+		fspec->tag, nskip);
+}
+
+/* load the cache of the adapter if it is of the same part */
+static void cache_open(struct flash_cache *fc, const char *id,
+		const char *key, const char *tag)
+{
+	char line[128];
+	unsigned long long hash;
+	uint32_t sec, size;
+	uint64_t *tab;
+	FILE *fin;
+
+	memset(fc, 0, sizeof(*fc));
+	if (!journal_path(fc->path, sizeof(fc->path), "image", id)) {
+		fprintf(stderr, "%sNo cache directory, flashing without " \
+			"the image cache\n", tag);
+		return;
+	}
+	snprintf(fc->key, sizeof(fc->key), "%s", key);
+	fin = fopen(fc->path, "r");
+	if (!fin)
+		return;
+	size = 0;
+	if (!fgets(line, sizeof(line), fin) || strncmp(line, "key ", 4) ||
+			strcspn(line + 4, "\n") != strlen(fc->key) ||
+			strncmp(line + 4, fc->key, strlen(fc->key))) {
+		printf("%sImage cache is of another part, not using it\n",
+			tag);
 		goto exit_10;
 	}
-	addr = fspec->addr;
-	while ((cklen = fread(chunk, 1, FLASH_ERASE_SIZE, fbin))) {
-		if (fspec->erase == 0 &&
-			!icdi_flash_erase(buf, addr, FLASH_ERASE_SIZE)) {
-			fprintf(stderr, "Cannot erase flash at %08X\n", addr);
+	while (fgets(line, sizeof(line), fin) && strchr(line, '\n') &&
+			sscanf(line, "sector %u %llx", &sec, &hash) == 2) {
+		if (sec >= 1024*1024/FLASH_ERASE_SIZE)
 			break;
+		if (sec >= size) {
+			tab = realloc(fc->hash, (sec + 64) * sizeof(*tab));
+			if (!tab)
+				break;
+			memset(tab + size, 0, (sec + 64 - size) * sizeof(*tab));
+			fc->hash = tab;
+			size = sec + 64;
+		}
+		fc->hash[sec] = hash;
+		if (sec >= fc->nsec)
+			fc->nsec = sec + 1;
+	}
+exit_10:
+	fclose(fin);
+}
+
+static void cache_close(struct flash_cache *fc)
+{
+	free(fc->hash);
+	memset(fc, 0, sizeof(*fc));
+}
+
+/* the cache holds the hash of the image bytes of the sector */
+static int cache_same(const struct flash_cache *fc,
+		const struct fw_image *img, uint32_t sec, char *chunk)
+{
+	if (sec >= fc->nsec || fc->hash[sec] == 0)
+		return 0;
+	stage_image(img, sec * FLASH_ERASE_SIZE, FLASH_ERASE_SIZE, chunk);
+	return fw_data_hash(chunk, FLASH_ERASE_SIZE) == fc->hash[sec];
+}
+
+/* a confirmed cache knows whether the sector changed */
+static inline int cache_known(const struct flash_cache *fc, uint32_t sec)
+{
+	return fc && fc->used && sec < fc->nsec && fc->hash[sec] != 0;
+}
+
+/*
+ * Mark the sectors the cache says are unchanged, after reading one of
+ * them back. The read-back time is added to rtime.
+ */
+static void cache_plan(struct icdibuf *buf, const struct flash_spec *fspec,
+		struct sector_plan *plan, uint64_t *rtime)
+{
+	struct flash_cache *fc = fspec->fc;
+	char chunk[FLASH_ERASE_SIZE], sector[FLASH_ERASE_SIZE];
+	uint32_t sec, nsame, pick;
+	unsigned int seed;
+	uint64_t tm0;
+	int changed;
+
+	if (!fc || fc->nsec == 0)
+		return;
+	seed = (unsigned int)icdi_now_us();
+	nsame = 0;
+	pick = 0;
+	for (sec = 0; sec < plan->nsec; sec++)
+		if ((plan->smap[sec] == 'W' || plan->smap[sec] == 'E') &&
+				cache_same(fc, fspec->img, sec, chunk) &&
+				rand_r(&seed) % ++nsame == 0)
+			pick = sec;
+	if (nsame == 0)
+		return;
+	tm0 = icdi_now_us();
+	cache_same(fc, fspec->img, pick, chunk);
+	changed = sector_changed(buf, pick * FLASH_ERASE_SIZE, chunk, sector);
+	*rtime += icdi_now_us() - tm0;
+	if (changed) {
+		printf("%sSector at %08X is not what the image cache says, " \
+			"not using it\n", fspec->tag, pick * FLASH_ERASE_SIZE);
+		fc->nsec = 0;
+		return;
+	}
+	for (sec = 0; sec < plan->nsec; sec++)
+		if ((plan->smap[sec] == 'W' || plan->smap[sec] == 'E') &&
+				cache_same(fc, fspec->img, sec, chunk))
+			plan->smap[sec] = '.';
+	fc->used = 1;
+	printf("%sImage cache: %u sector(s) unchanged, checked at %08X\n",
+		fspec->tag, nsame, pick * FLASH_ERASE_SIZE);
+}
+
+/*
+ * Save the sector hashes of the flash the plan completed. Untouched
+ * sectors keep what a confirmed cache knew of them, or read erased
+ * after a mass erase.
+ */
+static void cache_save(const struct flash_spec *fspec,
+		const struct sector_plan *plan)
+{
+	struct flash_cache *fc = fspec->fc;
+	char chunk[FLASH_ERASE_SIZE], tmp[PATH_MAX + 16];
+	uint64_t hash, erased;
+	uint32_t sec, nsec;
+	int synced;
+	FILE *fout;
+
+	if (!fc || !fc->path[0])
+		return;
+	nsec = fc->used && fc->nsec > plan->nsec? fc->nsec : plan->nsec;
+	memset(chunk, 0xff, FLASH_ERASE_SIZE);
+	erased = fw_data_hash(chunk, FLASH_ERASE_SIZE);
+	snprintf(tmp, sizeof(tmp), "%s.%d", fc->path, (int)getpid());
+	fout = fopen(tmp, "w");
+	if (!fout)
+		goto exit_10;
+	fprintf(fout, "key %s\n", fc->key);
+	for (sec = 0; sec < nsec; sec++) {
+		if (sec < plan->nsec && plan->smap[sec] != '-') {
+			stage_image(fspec->img, sec * FLASH_ERASE_SIZE,
+				FLASH_ERASE_SIZE, chunk);
+			hash = fw_data_hash(chunk, FLASH_ERASE_SIZE);
+		} else if (plan->mass)
+			hash = erased;
+		else if (cache_known(fc, sec))
+			hash = fc->hash[sec];
+		else
+			continue;
+		fprintf(fout, "sector %u %016llX\n", sec,
+			(unsigned long long)hash);
+	}
+	synced = fflush(fout) == 0 && fdatasync(fileno(fout)) == 0;
+	if (fclose(fout) == 0 && synced && rename(tmp, fc->path) == 0)
+		return;
+exit_10:
+	fprintf(stderr, "%sCannot write image cache %s->%s\n", fspec->tag,
+		fc->path, strerror(errno));
+	unlink(tmp);
+}
+
+static void print_image(const struct fw_image *img, const char *tag)
+{
+	const struct fw_segment *seg;
+
+	printf("%s%s image, %d segment(s), %u bytes\n", tag,
+		fw_format_name(img->format), img->nsegs, fw_image_bytes(img));
+	if (img->nsegs > 1)
+		for (seg = img->segs; seg < img->segs + img->nsegs; seg++)
+			printf("%s  %08X-%08X %u bytes\n", tag, seg->addr,
+				seg->addr + seg->len - 1, seg->len);
+}
+
+static void print_plan(const struct sector_plan *plan, const char *tag)
+{
+	if (plan->mass)
+		printf("%sErase plan: mass erase of the whole flash", tag);
+	else if (plan->nerase)
+		printf("%sErase plan: %d sector(s) in %d range erase(s)", tag,
+			plan->nerase_sec, plan->nerase);
+	else
+		printf("%sErase plan: nothing to erase", tag);
+	printf(", %d sector(s) to write, estimated %lums\n",
+		plan->nwrite_sec, (unsigned long)(plan->est_us/1000));
+}
+
+/*
+ * Build the plan for the image: the touched sectors, minus the ones
+ * journaled as done, the ones the image cache has as unchanged and, in
+ * differential mode, the ones a read-back finds unchanged, then the
+ * erases. The read-back time is added to rtime.
+ */
+static int make_plan(struct icdibuf *buf, const struct flash_spec *fspec,
+		struct sector_plan *plan, uint64_t *rtime)
+{
+	char chunk[FLASH_ERASE_SIZE], sector[FLASH_ERASE_SIZE];
+	uint32_t sec, addr;
+	uint64_t tm0;
+
+	if (!plan_sectors(plan, fspec->img)) {
+		fprintf(stderr, "%sOut of Memory!\n", fspec->tag);
+		return 0;
+	}
+	/* a sector read back in one packet where the adapter allows */
+	if (fspec->diff)
+		icdi_probe_read_max(buf);
+	resume_plan(buf, fspec, plan);
+	cache_plan(buf, fspec, plan, rtime);
+	for (sec = 0; sec < plan->nsec && fspec->diff; sec++) {
+		if (plan->smap[sec] == '-' || plan->smap[sec] == '.' ||
+				cache_known(fspec->fc, sec))
+			continue;
+		tm0 = icdi_now_us();
+		addr = sec * FLASH_ERASE_SIZE;
+		stage_image(fspec->img, addr, FLASH_ERASE_SIZE, chunk);
+		if (!sector_changed(buf, addr, chunk, sector))
+			plan->smap[sec] = '.';
+		*rtime += icdi_now_us() - tm0;
+	}
+	plan_erase(plan, fspec->cost, fspec->erase, fspec->flashsiz);
+	if (fspec->dryrun || fspec->diff || (fspec->fc && fspec->fc->used))
+		print_sector_map(plan->smap, plan->nsec, fspec->tag);
+	print_plan(plan, fspec->tag);
+	return 1;
+}
+
+static uint32_t flash_write(struct icdibuf *buf, const struct flash_spec *fspec)
+{
+	const struct fw_image *img = fspec->img;
+	struct sector_plan plan;
+	uint32_t addr, sec, run, len;
+	int csize, used, nsec, nwrite, failed;
+	char *chunk;
+	uint64_t tm0, rtime, wtime, etime, saved;
+
+	rtime = 0;
+	if (!make_plan(buf, fspec, &plan, &rtime))
+		return 0;
+	if (fspec->dryrun) {
+		plan_free(&plan);
+		return fw_image_bytes(img);
+	}
+
+	len = 0;
+	csize = fspec->diff? FLASH_ERASE_SIZE : FLASH_WRITE_CHUNK;
+	chunk = malloc(csize);
+	if (!chunk) {
+		fprintf(stderr, "%sOut of Memory!\n", fspec->tag);
+		plan_free(&plan);
+		return 0;
+	}
+	wtime = 0;
+	etime = 0;
+	nwrite = 0;
+	nsec = 0;
+	for (sec = 0; sec < plan.nsec; sec++)
+		if (plan.smap[sec] != '-')
+			nsec++;
+	failed = !erase_sectors(buf, &plan, fspec, &etime);
+	for (sec = 0; sec < plan.nsec && !failed; sec += run) {
+		if (plan.smap[sec] != 'W') {
+			run = 1;
+			continue;
 		}
+		/* a run of sectors to write, at most one chunk long */
+		for (run = 1; sec + run < plan.nsec && plan.smap[sec+run] == 'W'
+			&& run * FLASH_ERASE_SIZE < csize; run++)
+			;
+		tm0 = icdi_now_us();
+		addr = sec * FLASH_ERASE_SIZE;
+		used = stage_image(img, addr, run * FLASH_ERASE_SIZE, chunk);
+		/* erased flash already reads 0xFF */
+		while (used > 0 && all_erased(chunk + used - 4, 4))
+			used -= 4;
 		if (!tm4c123_debug_ready(buf)) {
-			fprintf(stderr, "Debugger stuck! Chip Locked!\n");
+			fprintf(stderr, "%sDebugger stuck! Chip Locked!\n",
+				fspec->tag);
+			failed = 1;
 			break;
 		}
-		if (!icdi_flash_write(buf, addr, chunk, cklen)) {
-			fprintf(stderr, "Flash write failed at: %08X\n", addr);
+		if (!icdi_flash_write(buf, addr, chunk, used)) {
+			fprintf(stderr, "%sFlash write failed at: %08X\n",
+				fspec->tag, addr);
+			failed = 1;
 			break;
 		}
-		addr += cklen;
-		len += cklen;
+		journal_commit(fspec->jn, addr, run * FLASH_ERASE_SIZE);
+		wtime += icdi_now_us() - tm0;
+		nwrite += run;
+	}
+	fspec->jm->phase_us[PHASE_ERASE] += etime;
+	fspec->jm->phase_us[PHASE_VERIFY] += rtime;
+	if (failed)
+		fprintf(stderr, "%sFlash operation failed!\n", fspec->tag);
+	else {
+		len = fw_image_bytes(img);
+		cache_save(fspec, &plan);
 	}
-	if (!feof(fbin))
-		fprintf(stderr, "Flash operation failed!\n");
 
+	if (fspec->diff && nsec > 0) {
+		printf("%sSectors written: %d of %d, read-back %lums, " \
+			"programming %lums\n", fspec->tag, nwrite, nsec,
+			(unsigned long)(rtime/1000), (unsigned long)(wtime/1000));
+		if (nwrite > 0) {
+			saved = wtime / nwrite * (nsec - nwrite);
+			if (saved > rtime)
+				printf("%sEstimated time saved: %lums\n",
+					fspec->tag,
+					(unsigned long)((saved - rtime)/1000));
+			else
+				printf("%sNo time saved by differential " \
+					"flashing\n", fspec->tag);
+		}
+	} else
+		printf("%sSectors written: %d, erase requests: %d, " \
+			"erase %lums, programming %lums\n", fspec->tag,
+			nwrite, plan.nerase, (unsigned long)(etime/1000),
+			(unsigned long)(wtime/1000));
+
+	plan_free(&plan);
 	free(chunk);
+	return len;
+}
+
+/*
+ * Erase the sectors the image touches, then program every run of them
+ * through the SRAM flash loader, which keeps the link streaming instead
+ * of waiting on every vFlashWrite packet.
+ */
+static uint32_t loader_write(struct icdibuf *buf, const struct flash_spec *fspec)
+{
+	const struct fw_image *img = fspec->img;
+	struct sector_plan plan;
+	char *image;
+	uint32_t sec, run, addr, len;
+	int used, failed;
+	uint64_t tm0, etime;
+
+	tm0 = 0;
+	if (!make_plan(buf, fspec, &plan, &tm0))
+		return 0;
+	len = 0;
+	if (fspec->dryrun) {
+		len = fw_image_bytes(img);
+		goto exit_10;
+	}
+	image = malloc(plan.nsec * FLASH_ERASE_SIZE);
+	if (!image) {
+		fprintf(stderr, "%sOut of Memory!\n", fspec->tag);
+		goto exit_10;
+	}
+	tm0 = icdi_now_us();
+	etime = 0;
+	failed = !erase_sectors(buf, &plan, fspec, &etime);
+	fspec->jm->phase_us[PHASE_ERASE] += etime;
+	if (failed)
+		goto exit_20;
+	for (sec = 0; sec < plan.nsec; sec += run) {
+		if (plan.smap[sec] != 'W') {
+			run = 1;
+			continue;
+		}
+		for (run = 1; sec + run < plan.nsec &&
+				plan.smap[sec+run] == 'W'; run++)
+			;
+		addr = sec * FLASH_ERASE_SIZE;
+		if (!tm4c123_debug_ready(buf)) {
+			fprintf(stderr, "%sDebugger stuck! Chip Locked!\n",
+				fspec->tag);
+			goto exit_20;
+		}
+		used = stage_image(img, addr, run * FLASH_ERASE_SIZE, image);
+		while (used > 0 && all_erased(image + used - 4, 4))
+			used -= 4;
+		if (!stub_flash(buf, addr, image, used)) {
+			fprintf(stderr, "%sFlash loader failed at %08X!\n",
+				fspec->tag, addr);
+			goto exit_20;
+		}
+		journal_commit(fspec->jn, addr, run * FLASH_ERASE_SIZE);
+	}
+	len = fw_image_bytes(img);
+	cache_save(fspec, &plan);
+	tm0 = icdi_now_us() - tm0;
+	printf("%sLoader programmed %u bytes in %lums, erase %lums\n",
+		fspec->tag, len, (unsigned long)(tm0/1000),
+		(unsigned long)(etime/1000));
+
+exit_20:
+	free(image);
 exit_10:
-	fclose(fbin);
+	plan_free(&plan);
 	return len;
 }
 
+/*
+ * Check every sector the image touches by the CRC-32 the core computes
+ * of it against the image's, which costs the link four bytes a sector
+ * instead of reading it back. Returns the number of sectors that
+ * differ, -1 if the check could not be done.
+ */
+static int verify_image(struct icdibuf *buf, const struct fw_image *img,
+		const char *tag)
+{
+	struct sector_plan plan;
+	struct stub_range *ranges;
+	char chunk[FLASH_ERASE_SIZE];
+	uint32_t sec;
+	int n, i, bad;
+	uint64_t tm0;
+
+	if (!plan_sectors(&plan, img)) {
+		fprintf(stderr, "%sOut of Memory!\n", tag);
+		return -1;
+	}
+	ranges = malloc(plan.nsec * sizeof(*ranges));
+	if (!ranges) {
+		fprintf(stderr, "%sOut of Memory!\n", tag);
+		plan_free(&plan);
+		return -1;
+	}
+	for (n = 0, sec = 0; sec < plan.nsec; sec++)
+		if (plan.smap[sec] != '-') {
+			ranges[n].addr = sec * FLASH_ERASE_SIZE;
+			ranges[n].len = FLASH_ERASE_SIZE;
+			n++;
+		}
+	bad = -1;
+	tm0 = icdi_now_us();
+	if (!tm4c123_debug_ready(buf) || !stub_crc32(buf, ranges, n)) {
+		fprintf(stderr, "%sCannot verify the flash\n", tag);
+		goto exit_10;
+	}
+	tm0 = icdi_now_us() - tm0;
+	for (bad = 0, i = 0; i < n; i++) {
+		stage_image(img, ranges[i].addr, FLASH_ERASE_SIZE, chunk);
+		if (fw_crc32(0, chunk, FLASH_ERASE_SIZE) == ranges[i].crc)
+			continue;
+		if (bad++ < 8)
+			fprintf(stderr, "%sSector at %08X differs: CRC-32 " \
+				"%08X, expected %08X\n", tag, ranges[i].addr,
+				ranges[i].crc,
+				fw_crc32(0, chunk, FLASH_ERASE_SIZE));
+	}
+	printf("%sVerified %d sector(s) by CRC-32 in %lums: %s\n", tag, n,
+		(unsigned long)(tm0/1000), bad? "MISMATCH" : "ok");
+
+exit_10:
+	free(ranges);
+	plan_free(&plan);
+	return bad;
+}
+
 struct cmdargs {
 	uint32_t addr, len;
-	int erase;
-	const char *binfile, *icdi_dev;
+	int erase, diff, loader, dryrun, resume, cache, verify;
+	struct flash_cost cost;
+	uint64_t hash;		/* of the image, keys the journal */
+	int ndevs;
+	const char *binfile;
+	const char *metrics_json;
+	const char *prom_textfile;
+	const char *icdi_devs[MAX_GANG];
+	struct fw_image img;
 };
 
 static int parse_cmdline(struct cmdargs *args, int argc, char *argv[])
@@ -80,12 +822,22 @@ static int parse_cmdline(struct cmdargs *args, int argc, char *argv[])
 		{.name = "icdi", .has_arg = required_argument, .flag = NULL, .val = 'i'},
 		{.name = "addr", .has_arg = required_argument, .flag = NULL, .val = 'a'},
 		{.name = "erase", .has_arg = no_argument, .flag = NULL, .val = 'e'},
+		{.name = "diff", .has_arg = no_argument, .flag = NULL, .val = 'd'},
+		{.name = "loader", .has_arg = no_argument, .flag = NULL, .val = 'l'},
+		{.name = "dry-run", .has_arg = no_argument, .flag = NULL, .val = 'n'},
+		{.name = "erase-cost", .has_arg = required_argument, .flag = NULL, .val = 'c'},
+		{.name = "metrics-json", .has_arg = required_argument, .flag = NULL, .val = 'j'},
+		{.name = "prom-textfile", .has_arg = required_argument, .flag = NULL, .val = 'p'},
+		{.name = "resume", .has_arg = no_argument, .flag = NULL, .val = 'r'},
+		{.name = "cache", .has_arg = no_argument, .flag = NULL, .val = 'k'},
+		{.name = "verify", .has_arg = no_argument, .flag = NULL, .val = 'v'},
 		{.name = NULL, .has_arg = 0, .flag = 0, .val = 0}
 	};
-	static const char *opts = "f:i:a:e";
+	static const char *opts = "f:i:a:edlnc:j:p:rkv";
 	extern char *optarg;
 	extern int optind, opterr, optopt;
-	int fin, lidx, optc, retv, sysret;
+	int fin, lidx, optc, retv, sysret, i;
+	char *dev;
 	struct stat mstat;
 
 	retv = 0;
@@ -94,11 +846,20 @@ static int parse_cmdline(struct cmdargs *args, int argc, char *argv[])
 	fin = 0;
 	args->addr = 0;
 	args->erase = 0;
+	args->diff = 0;
+	args->loader = 0;
+	args->dryrun = 0;
+	args->cost.cmd_us = COST_CMD_US;
+	args->cost.sector_us = COST_SECTOR_US;
+	args->cost.mass_us = COST_MASS_US;
+	args->cost.write_us = COST_WRITE_US;
 	do {
 		optopt = 0;
 		lidx = -1;
 		optc = getopt_long(argc, argv,  opts, lopts, &lidx);
-		if (optarg && *optarg == '-' && optc != 'e') {
+		if (optarg && *optarg == '-' && optc != 'e' && optc != 'd' &&
+				optc != 'l' && optc != 'n' && optc != 'r' &&
+				optc != 'k' && optc != 'v') {
 			fprintf(stderr, "Missing arguments for ");
 			if (lidx == -1)
 				fprintf(stderr, "'%c'\n", optc);
@@ -122,7 +883,16 @@ static int parse_cmdline(struct cmdargs *args, int argc, char *argv[])
 			args->binfile = optarg;
 			break;
 		case 'i':
-			args->icdi_dev = optarg;
+			for (dev = strtok(optarg, ","); dev;
+					dev = strtok(NULL, ",")) {
+				if (args->ndevs == MAX_GANG) {
+					fprintf(stderr, "At most %d ICDI " \
+						"interfaces\n", MAX_GANG);
+					retv = 8;
+					break;
+				}
+				args->icdi_devs[args->ndevs++] = dev;
+			}
 			break;
 		case 'a':
 			args->addr = strtol(optarg, NULL, 0);
@@ -130,28 +900,73 @@ static int parse_cmdline(struct cmdargs *args, int argc, char *argv[])
 		case 'e':
 			args->erase = 1;
 			break;
+		case 'd':
+			args->diff = 1;
+			break;
+		case 'l':
+			args->loader = 1;
+			break;
+		case 'n':
+			args->dryrun = 1;
+			break;
+		case 'c':
+			if (sscanf(optarg, "%u,%u,%u,%u", &args->cost.cmd_us,
+					&args->cost.sector_us,
+					&args->cost.mass_us,
+					&args->cost.write_us) != 4) {
+				fprintf(stderr, "Erase costs must be given as " \
+					"cmd,sector,mass,write in us\n");
+				retv = 2;
+			}
+			break;
+		case 'r':
+			args->resume = 1;
+			break;
+		case 'k':
+			args->cache = 1;
+			break;
+		case 'v':
+			args->verify = 1;
+			break;
+		case 'j':
+			args->metrics_json = optarg;
+			break;
+		case 'p':
+			args->prom_textfile = optarg;
+			break;
 		default:
 			fprintf(stderr, "Parse options logic error\n");
 		}
 	} while (fin == 0);
 
+	if (args->erase && args->diff) {
+		fprintf(stderr, "'erase' and 'diff' are mutually exclusive\n");
+		retv = 2;
+	}
+	if (args->loader && args->diff) {
+		fprintf(stderr, "'loader' and 'diff' are mutually exclusive\n");
+		retv = 2;
+	}
 	if ((args->addr % FLASH_ERASE_SIZE) != 0) {
 		fprintf(stderr, "Address must be divisible by %d\n",
 			FLASH_ERASE_SIZE);
 		retv = 4;
 	}
-	if (args->icdi_dev == NULL) {
+	if (args->ndevs == 0 && !args->dryrun) {
 		fprintf(stderr, "An ICDI inteface must be specified.\n");
 		retv = 8;
-	} else {
-		sysret = stat(args->icdi_dev, &mstat);
+	}
+	for (i = 0; i < args->ndevs; i++) {
+		if (icdi_link_spec(args->icdi_devs[i]))
+			continue;
+		sysret = stat(args->icdi_devs[i], &mstat);
 		if (sysret == -1) {
 			fprintf(stderr, "Cannot open ICDI device: %s->%s\n",
-				args->icdi_dev, strerror(errno));
+				args->icdi_devs[i], strerror(errno));
 			retv = 16;
 		} else if (!S_ISCHR(mstat.st_mode)) {
 			fprintf(stderr, "ICDI device \"%s\" not valid.\n",
-				args->icdi_dev);
+				args->icdi_devs[i]);
 			retv = 20;
 		}
 	}
@@ -180,141 +995,256 @@ static int parse_cmdline(struct cmdargs *args, int argc, char *argv[])
 	return retv;
 }
 
-int main(int argc, char *argv[])
+static void flash_spec_init(struct flash_spec *fspec,
+		const struct cmdargs *args, const char *tag)
 {
-	struct icdibuf *buf;
-	char options[128];
+	fspec->img = &args->img;
+	fspec->cost = &args->cost;
+	fspec->erase = args->erase;
+	fspec->flashsiz = 0;
+	fspec->diff = args->diff;
+	fspec->loader = args->loader;
+	fspec->dryrun = args->dryrun;
+	fspec->tag = tag;
+	fspec->jm = NULL;
+	fspec->jn = NULL;
+	fspec->fc = NULL;
+}
+
+static int flash_board(struct gang_port *gp)
+{
+	const struct cmdargs *args = gp->args;
+	const char *tag = gp->tag;
+	struct job_metrics *jm = &gp->metrics;
+	struct job_journal jn;
+	struct flash_cache fc;
+	struct icdibuf *buf, *old;
+	char options[128], key[64];
 	uint32_t val, did0, did1;
-	int retv;
+	int retv, reset, phase;
 	uint32_t flashsiz;
-	struct cmdargs args;
 	struct flash_spec fspec;
 
-	if (!instance_start(lock)) {
-		fprintf(stderr, "ICDI interface is being locked.\n");
-		return 100;
-	}
-	memset(&args, 0, sizeof(args));
-	if ((retv = parse_cmdline(&args, argc, argv)))
-		return retv;;
-	fspec.addr = args.addr;
-	fspec.len = args.len;
-	fspec.erase = args.erase;
+	flash_spec_init(&fspec, args, tag);
+	fspec.jm = jm;
 
-	buf = icdi_init(args.icdi_dev, FLASH_ERASE_SIZE);
+	buf = icdi_init(gp->dev, FLASH_ERASE_SIZE);
+	job_phase(jm, PHASE_CONNECT);
 	if (buf == NULL)
 		return 1000;
 
 	retv = 0;
+	phase = PHASE_CONNECT;
 	icdi_version(buf, options, 128);
-	printf("ICDI Version: %s", options);
+	printf("%sICDI Version: %s", tag, options);
 	if (icdi_qSupported(buf, options, 128))
-		printf("Supported: %s\n", options);
+		printf("%sSupported: %s\n", tag, options);
+	job_phase(jm, PHASE_CONNECT);
+	phase = PHASE_IDENTIFY;
 
 	if (!debug_clock(buf)) {
-		fprintf(stderr, "Debug Clock is not stable!\n");
+		fprintf(stderr, "%sDebug Clock is not stable!\n", tag);
 		retv = 100;
 		goto exit_10;
 	}
 	if (!icdi_stop_target(buf))
-		fprintf(stderr, "Warning! Target not stopped.\n");
+		fprintf(stderr, "%sWarning! Target not stopped.\n", tag);
 
 	if (!icdi_readu32(buf, SCSP_BASE+RM_CTRL_OFFSET, &val)) {
-		fprintf(stderr, "Cannot read RM_CTRL: %#08x\n",
+		fprintf(stderr, "%sCannot read RM_CTRL: %#08x\n", tag,
 			SCSP_BASE+RM_CTRL_OFFSET);
 		retv = 4;
 		goto exit_10;
 	}
 	if (val & 1) {
-		fprintf(stderr, "Flash memory is not mapped at address 0x0\n");
+		fprintf(stderr, "%sFlash memory is not mapped at address 0x0\n",
+			tag);
 		retv = 8;
 		goto exit_10;
 	}
 	if (!icdi_readu32(buf, SCSP_BASE+DID0_OFFSET, &did0) ||
 		!icdi_readu32(buf, SCSP_BASE+DID1_OFFSET, &did1)) {
-		fprintf(stderr, "Cannot read DID0/DID1.\n");
+		fprintf(stderr, "%sCannot read DID0/DID1.\n", tag);
 		retv = 12;
 		goto exit_10;
 	}
-	
-	if (((did0 >> 16) & 0x0ff) == 0x05)
-		printf("TM4C123x Chip, ");
-	else
-		printf("Unsupported Chip\n");
-	if (((did1 >> 16) & 0x0ff) == 0x0A1)
-		printf("TM4C123GH6PM microcontroller.\n");
-	printf("DID0: %08X, DID1: %08X\n", did0, did1);
+	jm->identified = 1;
+	jm->did0 = did0;
+	jm->did1 = did1;
+
+	printf("%s%s%s\n", tag, ((did0 >> 16) & 0x0ff) == 0x05?
+		"TM4C123x Chip" : "Unsupported Chip",
+		((did1 >> 16) & 0x0ff) == 0x0A1?
+		", TM4C123GH6PM microcontroller." : "");
+	printf("%sDID0: %08X, DID1: %08X\n", tag, did0, did1);
 
 	if (!icdi_readu32(buf, FM_CTRL_BASE+FSIZE_OFFSET, &flashsiz)) {
-		fprintf(stderr, "Cannot get flash memory size.\n");
+		fprintf(stderr, "%sCannot get flash memory size.\n", tag);
 		retv = 16;
 		goto exit_10;
 	}
 	if (flashsiz == 0x7f)
 		flashsiz = 256*1024;
 	else {
-		fprintf(stderr, "Unknown flash size.\n");
+		fprintf(stderr, "%sUnknown flash size.\n", tag);
 		retv = 20;
 		goto exit_10;
 	}
-	printf("Flash Size: %dKiB\n", flashsiz/1024);
-	if ((fspec.addr + fspec.len) > flashsiz) {
-		fprintf(stderr, "File exceeds Flash Size: %u+%u\n",
-			fspec.addr, fspec.len);
+	printf("%sFlash Size: %dKiB\n", tag, flashsiz/1024);
+	fspec.flashsiz = flashsiz;
+	if (fw_image_end(fspec.img) > flashsiz) {
+		fprintf(stderr, "%sImage exceeds Flash Size: %08X\n", tag,
+			fw_image_end(fspec.img));
 		retv = 24;
 		goto exit_10;
 	}
 
 	if (!tm4c123_debug_ready(buf)) {
-		fprintf(stderr, "Micro chip stuck.\n");
+		fprintf(stderr, "%sMicro chip stuck.\n", tag);
 		retv = 28;
 		goto exit_10;
 	}
 
-	flash_write(args.binfile, buf, &fspec);
+	print_image(fspec.img, tag);
+	job_phase(jm, PHASE_IDENTIFY);
+	if (!fspec.dryrun) {
+		snprintf(key, sizeof(key), "flash %08X %08X %016llX", did0,
+			did1, (unsigned long long)args->hash);
+		journal_open(&jn, "flash", buf->serial[0]? buf->serial :
+			gp->dev, key, args->resume, tag);
+		fspec.jn = &jn;
+	}
+	if (args->cache) {
+		snprintf(key, sizeof(key), "image %08X %08X", did0, did1);
+		cache_open(&fc, buf->serial[0]? buf->serial : gp->dev, key,
+			tag);
+		fspec.fc = &fc;
+	}
+	if (fspec.loader)
+		gp->bytes = loader_write(buf, &fspec);
+	else
+		gp->bytes = flash_write(buf, &fspec);
+	if (fspec.jn)
+		journal_close(&jn, gp->bytes == args->len);
+	/* the erase and read-back are timed inside, the rest is writing */
+	job_phase(jm, PHASE_WRITE);
+	jm->phase_us[PHASE_WRITE] -= jm->phase_us[PHASE_ERASE] +
+		jm->phase_us[PHASE_VERIFY];
+	phase = PHASE_RESET;
+	if (gp->bytes != args->len)
+		retv = 32;
+	else if (args->verify) {
+		if (verify_image(buf, fspec.img, tag) != 0) {
+			/* what the cache says of the board is in doubt */
+			if (fspec.fc && fc.path[0])
+				unlink(fc.path);
+			retv = 36;
+		}
+		job_phase(jm, PHASE_VERIFY);
+	}
+	if (fspec.fc)
+		cache_close(&fc);
+	if (fspec.dryrun) {
+		icdi_qRcmd(buf, "debug disable");
+		goto exit_10;
+	}
 
-	printf("Flash finished!\n");
+	printf("%sFlash finished!\n", tag);
+	tm4c123_wait_report(buf, tag);
 	if (!tm4c123_debug_ready(buf)) {
-		fprintf(stderr, "Micro chip stuck.\n");
+		fprintf(stderr, "%sMicro chip stuck.\n", tag);
 		retv = 28;
 	}
-	if (!icdi_chip_reset(buf))
-		fprintf(stderr, "Cannot reset the Chip.\n");
-	printf("Reset done!\n");
-	icdi_exit(buf);
-	sleep(1);
-	buf = icdi_init(args.icdi_dev, FLASH_ERASE_SIZE);
-	if (buf == NULL) {
-		fprintf(stderr, "Cannot reopen port: %s->%s\n", args.icdi_dev,
-				strerror(errno));
-		return 1000;
+	reset = icdi_chip_reset(buf);
+	job_phase(jm, PHASE_RESET);
+	phase = PHASE_RECONNECT;
+	/* the adapter may drop off the bus with the reset, or stay */
+	old = buf;
+	if (!icdi_reconnect(&buf, gp->dev, RECONNECT_MS_DEFAULT)) {
+		fprintf(stderr, "%sCannot reconnect to %s after the reset\n",
+			tag, gp->dev);
+		retv = 1000;
+		goto exit_10;
 	}
-	printf("\nAfter Reset...\n");
+	if (buf != old)
+		printf("%sReset done, adapter reconnected\n", tag);
+	else if (reset)
+		printf("%sReset done!\n", tag);
+	else
+		fprintf(stderr, "%sCannot reset the Chip.\n", tag);
+	printf("\n%sAfter Reset...\n", tag);
 	icdi_version(buf, options, 128);
-	printf("ICDI Version: %s", options);
+	printf("%sICDI Version: %s", tag, options);
 	if (icdi_qSupported(buf, options, 128))
-		printf("Supported: %s\n", options);
+		printf("%sSupported: %s\n", tag, options);
 
 	if (!debug_clock(buf)) {
-		fprintf(stderr, "Debug Clock is not stable!\n");
+		fprintf(stderr, "%sDebug Clock is not stable!\n", tag);
 		retv = 100;
 		goto exit_10;
 	}
-        if (!icdi_stop_target(buf)) {
-                fprintf(stderr, "Cannot stop target.\n");
-                retv = 104;
-                goto exit_10;
-        }
-        if (!icdi_readu32(buf, SCSP_BASE+RM_CTRL_OFFSET, &val)) {
-                fprintf(stderr, "Cannot read RM_CTRL: %#08x\n",
-                        SCSP_BASE+RM_CTRL_OFFSET); 
-                retv = 108;
-                goto exit_10;
-        }
+	if (!icdi_stop_target(buf)) {
+		fprintf(stderr, "%sCannot stop target.\n", tag);
+		retv = 104;
+		goto exit_10;
+	}
+	if (!icdi_readu32(buf, SCSP_BASE+RM_CTRL_OFFSET, &val)) {
+		fprintf(stderr, "%sCannot read RM_CTRL: %#08x\n", tag,
+			SCSP_BASE+RM_CTRL_OFFSET);
+		retv = 108;
+		goto exit_10;
+	}
 
 	icdi_qRcmd(buf, "debug disable");
 exit_10:
+	job_phase(jm, phase);
+	job_collect(jm, buf);
 	icdi_exit(buf);
-	instance_exit(lock);
+	return retv;
+}
+
+int main(int argc, char *argv[])
+{
+	struct cmdargs args;
+	struct gang_port ports[MAX_GANG];
+	struct flash_spec fspec;
+	struct sector_plan plan;
+	uint64_t rtime;
+	int retv, i;
+
+	memset(&args, 0, sizeof(args));
+	if ((retv = parse_cmdline(&args, argc, argv)))
+		return retv;
+	if (!fw_image_load(&args.img, args.binfile, args.addr))
+		return 28;
+	args.len = fw_image_bytes(&args.img);
+	args.hash = fw_image_hash(&args.img);
+	/* without a board a dry run plans from the image alone */
+	if (args.dryrun && args.ndevs == 0) {
+		flash_spec_init(&fspec, &args, "");
+		if (args.diff || args.verify) {
+			fprintf(stderr, "'%s' needs a board to read back\n",
+				args.diff? "diff" : "verify");
+			retv = 2;
+		} else {
+			print_image(&args.img, "");
+			rtime = 0;
+			if (make_plan(NULL, &fspec, &plan, &rtime))
+				plan_free(&plan);
+			else
+				retv = 36;
+		}
+		fw_image_free(&args.img);
+		return retv;
+	}
+
+	memset(ports, 0, sizeof(ports));
+	for (i = 0; i < args.ndevs; i++)
+		ports[i].dev = args.icdi_devs[i];
+	retv = gang_run(ports, args.ndevs, &args, flash_board);
+	if (!job_metrics_write(args.metrics_json, args.prom_textfile,
+				"flashbin", ports, args.ndevs, retv) && retv == 0)
+		retv = 40;
+	fw_image_free(&args.img);
 	return retv;
 }
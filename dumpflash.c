@@ -4,58 +4,193 @@
 #include <unistd.h>
 #include <assert.h>
 #include <getopt.h>
+#include <fcntl.h>
 #include <sys/stat.h>
-#include "miscutils.h"
 #include "icdi.h"
+#include "miscutils.h"
 #include "tm4c123x.h"
+#include "tm4c123stub.h"
 
 struct flash_spec {
 	uint32_t addr;
 	uint32_t len;
+	int chunk;		/* bytes asked for per x read */
+	const char *tag;
+	struct job_journal *jn;	/* NULL when streaming */
 };
 
-static uint32_t flash_dump(const char *binfile, struct icdibuf *buf,
-			const struct flash_spec *fspec)
+/* journal a committed range every so many bytes */
+#define JOURNAL_STEP	(64*1024)
+
+static int write_all(int fd, const char *data, int len)
 {
-	uint32_t len, addr;
-	FILE *fbin;
-	int err, cklen;
+	int retlen, pos;
+
+	for (pos = 0; pos < len; pos += retlen) {
+		retlen = write(fd, data + pos, len - pos);
+		if (retlen == -1) {
+			if (errno == EINTR) {
+				retlen = 0;
+				continue;
+			}
+			return -1;
+		}
+	}
+	return len;
+}
+
+static int all_bytes(const char *chunk, int len, char cc)
+{
+	return chunk[0] == cc && memcmp(chunk, chunk + 1, len - 1) == 0;
+}
+
+/* bytes from the start of the dump the journal holds as written */
+static uint32_t journal_done(const struct job_journal *jn, uint32_t addr)
+{
+	const struct journal_ent *ent;
+	uint32_t end;
+
+	end = addr;
+	for (ent = jn->ents; ent < jn->ents + jn->nents; ent++)
+		if (ent->addr <= end && ent->addr + ent->len > end)
+			end = ent->addr + ent->len;
+	return end - addr;
+}
+
+/* Read the last block before done again and compare it with the file. */
+static int dump_verify(int fd, struct icdibuf *buf,
+		const struct flash_spec *fspec, uint32_t done, char *chunk)
+{
+	char block[FLASH_BLOCK_SIZE];
+	int len;
+
+	len = done < FLASH_BLOCK_SIZE? done : FLASH_BLOCK_SIZE;
+	if (!tm4c123_debug_ready(buf) || icdi_readbin(buf,
+			fspec->addr + done - len, len, chunk) != len ||
+			pread(fd, block, len, done - len) != len)
+		return 0;
+	return memcmp(block, chunk, len) == 0;
+}
+
+/*
+ * Dump flash into binfile, or stream it to stdout when binfile is "-".
+ * A file gets its final size up front; all zero blocks are left as holes,
+ * which read back the same zeros. A file dump continues after what the journal holds as
+ * written, once the last block of that is found unchanged.
+ */
+static uint32_t flash_dump(const char *binfile, int outfd,
+		struct icdibuf *buf, const struct flash_spec *fspec)
+{
+	uint32_t len, addr, done;
+	int fd, err, ask, cklen, sysret;
 	char *chunk;
 
-	fbin = fopen(binfile, "wb");
-	if (!fbin) {
-		fprintf(stderr, "Cannot open file: %s\n", binfile);
+	chunk = malloc(fspec->chunk);
+	if (!chunk) {
+		fprintf(stderr, "%sOut of Memory!\n", fspec->tag);
 		return 0;
 	}
+	len = 0;
+	done = 0;
+	if (strcmp(binfile, "-") == 0)
+		fd = outfd;
+	else {
+		fd = open(binfile, O_RDWR|O_CREAT, 0644);
+		if (fd == -1) {
+			fprintf(stderr, "%sCannot open file: %s->%s\n",
+				fspec->tag, binfile, strerror(errno));
+			goto exit_20;
+		}
+		if (fspec->jn && fspec->jn->nents > 0) {
+			done = journal_done(fspec->jn, fspec->addr);
+			if (done > fspec->len)
+				done = 0;
+			if (done > 0 && !dump_verify(fd, buf, fspec, done,
+						chunk)) {
+				printf("%sFile differs from the flash at " \
+					"%08X, starting over\n", fspec->tag,
+					fspec->addr + done);
+				journal_reset(fspec->jn, fspec->tag);
+				done = 0;
+			} else if (done > 0)
+				printf("%sResuming at %08X\n", fspec->tag,
+					fspec->addr + done);
+		}
+		/* holes are skipped, so nothing of an earlier file may stay */
+		if (done == 0 && ftruncate(fd, 0) == -1) {
+			fprintf(stderr, "%sCannot truncate %s: %s\n",
+				fspec->tag, binfile, strerror(errno));
+			goto exit_10;
+		}
+		sysret = posix_fallocate(fd, 0, fspec->len);
+		if (sysret != 0) {
+			fprintf(stderr, "%sCannot size file %s: %s\n",
+				fspec->tag, binfile,
+				strerror(sysret == -1? errno : sysret));
+			goto exit_10;
+		}
+	}
 
-	chunk = malloc(FLASH_BLOCK_SIZE);
 	err = 0;
-	addr = fspec->addr;
-	len = 0;
+	len = done;
+	addr = fspec->addr + done;
 	do {
 		if (!tm4c123_debug_ready(buf)) {
-			fprintf(stderr, "Micro Chip got stuck!\n");
+			fprintf(stderr, "%sMicro Chip got stuck!\n", fspec->tag);
 			goto exit_10;
 		}
-		cklen = icdi_readbin(buf, addr, FLASH_BLOCK_SIZE, chunk);
-		if (cklen != FLASH_BLOCK_SIZE) {
+		ask = fspec->len - len < fspec->chunk?
+			fspec->len - len : fspec->chunk;
+		cklen = icdi_readbin(buf, addr, ask, chunk);
+		if (cklen != ask) {
+			err = 1;
+			fprintf(stderr, "%sFlash read error!\n", fspec->tag);
+		}
+		if (fd == outfd)
+			sysret = write_all(fd, chunk, cklen);
+		else if (cklen == 0 || all_bytes(chunk, cklen, 0))
+			sysret = 0;
+		else
+			sysret = pwrite(fd, chunk, cklen, len);
+		if (sysret == -1) {
+			fprintf(stderr, "%sCannot write %s: %s\n",
+				fspec->tag, binfile, strerror(errno));
 			err = 1;
-			fprintf(stderr, "Flash read error!\n");
 		}
-		fwrite(chunk, 1, cklen, fbin);
 		len += cklen;
 		addr += cklen;
+		/* the data must be on disk before the journal says so */
+		if (fspec->jn && !err && (len - done >= JOURNAL_STEP ||
+					len == fspec->len) &&
+				fdatasync(fd) == 0) {
+			journal_commit(fspec->jn, fspec->addr + done,
+					len - done);
+			done = len;
+		}
 	} while (len < fspec->len && !err);
 
 exit_10:
+	if (fd != outfd) {
+		if (len < fspec->len && ftruncate(fd, len) == -1)
+			fprintf(stderr, "%sCannot truncate %s: %s\n",
+				fspec->tag, binfile, strerror(errno));
+		close(fd);
+	}
+exit_20:
 	free(chunk);
-	fclose(fbin);
 	return len;
 }
 
 struct cmdargs {
 	uint32_t addr, len;
-	const char *binfile, *icdi_dev;
+	int chunk;
+	int resume;
+	int checksum;
+	int ndevs;
+	const char *binfile;
+	const char *metrics_json;
+	const char *prom_textfile;
+	const char *icdi_devs[MAX_GANG];
 };
 
 static int parse_cmdline(struct cmdargs *args, int argc, char *argv[])
@@ -65,13 +200,18 @@ static int parse_cmdline(struct cmdargs *args, int argc, char *argv[])
 		{.name = "icdi", .has_arg = required_argument, .flag = NULL, .val = 'i'},
 		{.name = "addr", .has_arg = required_argument, .flag = NULL, .val = 'a'},
 		{.name = "length", .has_arg = required_argument, .flag = NULL, .val = 'l'},
+		{.name = "chunk", .has_arg = required_argument, .flag = NULL, .val = 'c'},
+		{.name = "metrics-json", .has_arg = required_argument, .flag = NULL, .val = 'j'},
+		{.name = "prom-textfile", .has_arg = required_argument, .flag = NULL, .val = 'p'},
+		{.name = "resume", .has_arg = no_argument, .flag = NULL, .val = 'r'},
+		{.name = "checksum", .has_arg = no_argument, .flag = NULL, .val = 'k'},
 		{.name = NULL, .has_arg = 0, .flag = 0, .val = 0}
 	};
-	static const char *opts = "o:i:a:l:";
+	static const char *opts = "o:i:a:l:c:j:p:rk";
 	extern char *optarg;
 	extern int optind, opterr, optopt;
-	int fin, lidx, optc, retv, sysret;
-	char *suffix;
+	int fin, lidx, optc, retv, sysret, i;
+	char *suffix, *dev;
 	uint32_t len;
 	struct stat mstat;
 
@@ -86,7 +226,8 @@ static int parse_cmdline(struct cmdargs *args, int argc, char *argv[])
 		lidx = -1;
 		optc = getopt_long(argc, argv,  opts, lopts, &lidx);
 		if (optarg && *optarg == '-' &&
-			(optc == 'o' || optc == 'i')) {
+			((optc == 'o' && optarg[1] != 0) || optc == 'i' ||
+			 optc == 'j' || optc == 'p')) {
 			fprintf(stderr, "Missing arguments for ");
 			if (lidx == -1)
 				fprintf(stderr, "'%c'\n", optc);
@@ -110,7 +251,16 @@ static int parse_cmdline(struct cmdargs *args, int argc, char *argv[])
 			args->binfile = optarg;
 			break;
 		case 'i':
-			args->icdi_dev = optarg;
+			for (dev = strtok(optarg, ","); dev;
+					dev = strtok(NULL, ",")) {
+				if (args->ndevs == MAX_GANG) {
+					fprintf(stderr, "At most %d ICDI " \
+						"interfaces\n", MAX_GANG);
+					retv = 8;
+					break;
+				}
+				args->icdi_devs[args->ndevs++] = dev;
+			}
 			break;
 		case 'a':
 			args->addr = strtol(optarg, NULL, 0);
@@ -126,6 +276,27 @@ static int parse_cmdline(struct cmdargs *args, int argc, char *argv[])
 				len *= 1024;
 			}
 			break;
+		case 'c':
+			args->chunk = strtol(optarg, NULL, 0);
+			if (args->chunk < 64 || args->chunk > PKTSIZE_MAX ||
+					(args->chunk % 4) != 0) {
+				fprintf(stderr, "Chunk must be a multiple of " \
+					"4 from 64 to %d\n", PKTSIZE_MAX);
+				retv = 2;
+			}
+			break;
+		case 'r':
+			args->resume = 1;
+			break;
+		case 'k':
+			args->checksum = 1;
+			break;
+		case 'j':
+			args->metrics_json = optarg;
+			break;
+		case 'p':
+			args->prom_textfile = optarg;
+			break;
 		default:
 			fprintf(stderr, "Parse options logic error\n");
 		}
@@ -138,25 +309,43 @@ static int parse_cmdline(struct cmdargs *args, int argc, char *argv[])
 			FLASH_BLOCK_SIZE);
 		retv = 4;
 	}
-	if (args->icdi_dev == NULL) {
+	if (args->ndevs == 0) {
 		fprintf(stderr, "An ICDI inteface must be specified.\n");
 		retv = 8;
-	} else {
-		sysret = stat(args->icdi_dev, &mstat);
+	}
+	for (i = 0; i < args->ndevs; i++) {
+		if (icdi_link_spec(args->icdi_devs[i]))
+			continue;
+		sysret = stat(args->icdi_devs[i], &mstat);
 		if (sysret == -1) {
 			fprintf(stderr, "Cannot open ICDI device: %s->%s\n",
-				args->icdi_dev, strerror(errno));
+				args->icdi_devs[i], strerror(errno));
 			retv = 16;
 		} else if (!S_ISCHR(mstat.st_mode)) {
 			fprintf(stderr, "ICDI device \"%s\" not valid.\n",
-				args->icdi_dev);
+				args->icdi_devs[i]);
 			retv = 20;
 		}
 	}
+	/* a checksum is all that is printed */
+	if (args->checksum) {
+		if (args->binfile)
+			fprintf(stderr, "Warning! No dump with 'checksum'.\n");
+		args->binfile = "-";
+		return retv;
+	}
 	if (args->binfile == NULL) {
 		args->binfile = "/tmp/tivac.bin";
 		fprintf(stderr, "BIN file set to \"/tmp/tivac.bin\"\n");
 	}
+	if (strcmp(args->binfile, "-") == 0) {
+		if (args->ndevs > 1) {
+			fprintf(stderr, "Cannot stream several boards to " \
+				"stdout\n");
+			retv = 28;
+		}
+		return retv;
+	}
 	sysret = stat(args->binfile, &mstat);
 	if (sysret == 0 && !S_ISREG(mstat.st_mode)) {
 		fprintf(stderr, "File \"%s\" is not a regular file\n",
@@ -167,93 +356,251 @@ static int parse_cmdline(struct cmdargs *args, int argc, char *argv[])
 	return retv;
 }
 
-int main(int argc, char *argv[])
+/*
+ * In gang mode every board gets its own file, the port name inserted
+ * before the extension: /tmp/tivac.bin -> /tmp/tivac-ttyACM0.bin
+ */
+static void board_file(char *fname, int size, const char *binfile,
+		const char *dev, int ndevs)
+{
+	const char *ext, *name;
+	int blen;
+
+	if (ndevs == 1 || strcmp(binfile, "-") == 0) {
+		snprintf(fname, size, "%s", binfile);
+		return;
+	}
+	name = strrchr(dev, '/');
+	name = name? name + 1 : dev;
+	ext = strrchr(binfile, '.');
+	if (!ext || strchr(ext, '/'))
+		ext = binfile + strlen(binfile);
+	blen = ext - binfile;
+	snprintf(fname, size, "%.*s-%s%s", blen, binfile, name, ext);
+}
+
+/*
+ * Print the CRC-32 of the range, computed by the core so that only the
+ * result crosses the link.
+ */
+static uint32_t flash_checksum(struct icdibuf *buf,
+		const struct flash_spec *fspec)
+{
+	struct stub_range range;
+	uint64_t tm0;
+
+	range.addr = fspec->addr;
+	range.len = fspec->len;
+	tm0 = icdi_now_us();
+	if (!stub_crc32(buf, &range, 1)) {
+		fprintf(stderr, "%sCannot compute the CRC-32\n", fspec->tag);
+		return 0;
+	}
+	tm0 = icdi_now_us() - tm0;
+	printf("%sCRC-32 %08X-%08X: %08X, %lums\n", fspec->tag, range.addr,
+		range.addr + range.len - 1, range.crc,
+		(unsigned long)(tm0/1000));
+	return range.len;
+}
+
+struct dump_ctx {
+	const struct cmdargs *args;
+	int outfd;
+};
+
+/* dump the range to the board's file, journaled unless it is stdout */
+static uint32_t dump_file(struct gang_port *gp, struct icdibuf *buf,
+		struct flash_spec *fspec, const char *fname, uint32_t did0,
+		uint32_t did1)
+{
+	const struct dump_ctx *ctx = gp->args;
+	const struct cmdargs *args = ctx->args;
+	const char *tag = gp->tag;
+	struct job_journal jn;
+	char key[PATH_MAX], cwd[PATH_MAX];
+	uint32_t len;
+
+	/* as large as the adapter answers, unless told otherwise */
+	if (args->chunk)
+		icdi_set_read_max(buf, args->chunk);
+	else
+		icdi_probe_read_max(buf);
+	fspec->chunk = icdi_read_max(buf);
+	printf("%sRead size: %d bytes\n", tag, fspec->chunk);
+	job_phase(&gp->metrics, PHASE_IDENTIFY);
+
+	/* a dump streamed to stdout cannot be continued */
+	if (strcmp(fname, "-") != 0) {
+		cwd[0] = 0;
+		if (fname[0] != '/' && getcwd(cwd, sizeof(cwd) - 1))
+			strcat(cwd, "/");
+		/* a cut key could match the journal of another file */
+		if (snprintf(key, sizeof(key), "dump %08X %08X %08X %u %s%s",
+				did0, did1, fspec->addr, fspec->len, cwd,
+				fname) >= sizeof(key))
+			fprintf(stderr, "%sPath of %s too long, cannot " \
+				"resume later\n", tag, fname);
+		else {
+			journal_open(&jn, "dump", buf->serial[0]?
+				buf->serial : gp->dev, key, args->resume, tag);
+			fspec->jn = &jn;
+		}
+	} else if (args->resume)
+		fprintf(stderr, "%sWarning! A dump to stdout cannot be " \
+			"resumed.\n", tag);
+	len = flash_dump(fname, ctx->outfd, buf, fspec);
+	if (fspec->jn)
+		journal_close(&jn, len == fspec->len);
+	fspec->jn = NULL;
+	tm4c123_wait_report(buf, tag);
+	return len;
+}
+
+static int dump_board(struct gang_port *gp)
 {
+	const struct dump_ctx *ctx = gp->args;
+	const struct cmdargs *args = ctx->args;
+	const char *tag = gp->tag;
+	struct job_metrics *jm = &gp->metrics;
 	struct icdibuf *buf;
-	char options[128];
+	char options[128], fname[256];
 	uint32_t val, did0, did1;
-	int retv;
+	int retv, phase;
 	uint32_t flashsiz;
-	struct cmdargs args;
 	struct flash_spec fspec;
 
-	if (!instance_start(lock)) {
-		fprintf(stderr, "ICDI port is being locked.\n");
-		return 100;
-	}	
-	memset(&args, 0, sizeof(args));
-	if ((retv = parse_cmdline(&args, argc, argv)))
-		return retv;;
-	fspec.addr = args.addr;
-	fspec.len = args.len;
+	fspec.addr = args->addr;
+	fspec.len = args->len;
+	fspec.tag = tag;
+	fspec.jn = NULL;
+	board_file(fname, sizeof(fname), args->binfile, gp->dev, args->ndevs);
 
-	buf = icdi_init(args.icdi_dev, FLASH_ERASE_SIZE);
+	buf = icdi_init(gp->dev, FLASH_ERASE_SIZE);
+	job_phase(jm, PHASE_CONNECT);
 	if (buf == NULL)
 		return 1000;
 
 	retv = 0;
+	phase = PHASE_CONNECT;
 	icdi_version(buf, options, 128);
-	printf("ICDI Version: %s", options);
+	printf("%sICDI Version: %s", tag, options);
 	if (icdi_qSupported(buf, options, 128))
-		printf("Supported: %s\n", options);
+		printf("%sSupported: %s\n", tag, options);
+	job_phase(jm, PHASE_CONNECT);
+	phase = PHASE_IDENTIFY;
 
 	if (!debug_clock(buf)) {
-		fprintf(stderr, "Debug Clock is not stable!\n");
+		fprintf(stderr, "%sDebug Clock is not stable!\n", tag);
 		retv = 100;
 		goto exit_10;
 	}
 	if (!icdi_stop_target(buf))
-		fprintf(stderr, "Warning! Target not stopped.\n");
+		fprintf(stderr, "%sWarning! Target not stopped.\n", tag);
 
 	if (!icdi_readu32(buf, SCSP_BASE+RM_CTRL_OFFSET, &val)) {
-		fprintf(stderr, "Cannot read RM_CTRL: %#08x\n",
+		fprintf(stderr, "%sCannot read RM_CTRL: %#08x\n", tag,
 			SCSP_BASE+RM_CTRL_OFFSET);
 		retv = 4;
 		goto exit_10;
 	}
 	if (val & 1) {
-		fprintf(stderr, "Internal ROM is mapped at address 0x0\n");
+		fprintf(stderr, "%sInternal ROM is mapped at address 0x0\n",
+			tag);
 		retv = 8;
 		goto exit_10;
 	}
 	if (!icdi_readu32(buf, SCSP_BASE+DID0_OFFSET, &did0) ||
 		!icdi_readu32(buf, SCSP_BASE+DID1_OFFSET, &did1)) {
-		fprintf(stderr, "Cannot read DID0/DID1.\n");
+		fprintf(stderr, "%sCannot read DID0/DID1.\n", tag);
 		retv = 12;
 		goto exit_10;
 	}
-	
-	if (((did0 >> 16) & 0x0ff) == 0x05)
-		printf("TM4C123x Chip, ");
-	else
-		printf("Unsupported Chip\n");
-	if (((did1 >> 16) & 0x0ff) == 0x0A1)
-		printf("TM4C123GH6PM microcontroller.\n");
-	printf("DID0: %08X, DID1: %08X\n", did0, did1);
+	jm->identified = 1;
+	jm->did0 = did0;
+	jm->did1 = did1;
+
+	printf("%s%s%s\n", tag, ((did0 >> 16) & 0x0ff) == 0x05?
+		"TM4C123x Chip" : "Unsupported Chip",
+		((did1 >> 16) & 0x0ff) == 0x0A1?
+		", TM4C123GH6PM microcontroller." : "");
+	printf("%sDID0: %08X, DID1: %08X\n", tag, did0, did1);
 
 	if (!icdi_readu32(buf, FM_CTRL_BASE+FSIZE_OFFSET, &flashsiz)) {
-		fprintf(stderr, "Cannot get flash memory size.\n");
+		fprintf(stderr, "%sCannot get flash memory size.\n", tag);
 		retv = 16;
 		goto exit_10;
 	}
 	if (flashsiz == 0x7f)
 		flashsiz = 256*1024;
 	else {
-		fprintf(stderr, "Unknown flash size.\n");
+		fprintf(stderr, "%sUnknown flash size.\n", tag);
 		retv = 20;
 		goto exit_10;
 	}
-	printf("Flash Size: %dKiB\n", flashsiz/1024);
+	printf("%sFlash Size: %dKiB\n", tag, flashsiz/1024);
 	if (fspec.len == 0)
 		fspec.len = flashsiz;
+	/* the CRC stub itself lives in SRAM */
+	if (args->checksum && (fspec.addr >= flashsiz ||
+				fspec.len > flashsiz - fspec.addr)) {
+		fprintf(stderr, "%sChecksum range exceeds the flash\n", tag);
+		retv = 32;
+		goto exit_10;
+	}
+	job_phase(jm, PHASE_IDENTIFY);
 
-	flash_dump(args.binfile, buf, &fspec);
+	if (args->checksum) {
+		phase = PHASE_VERIFY;
+		gp->bytes = flash_checksum(buf, &fspec);
+	} else {
+		phase = PHASE_READ;
+		gp->bytes = dump_file(gp, buf, &fspec, fname, did0, did1);
+	}
+	if (gp->bytes != fspec.len)
+		retv = 24;
+	job_phase(jm, phase);
 
+	phase = PHASE_RESET;
 	if (!icdi_chip_reset(buf))
-		fprintf(stderr, "Failed to reset the chip.\n");
+		fprintf(stderr, "%sFailed to reset the chip.\n", tag);
 	icdi_qRcmd(buf, "debug disable");
 exit_10:
+	job_phase(jm, phase);
+	job_collect(jm, buf);
 	icdi_exit(buf);
-	instance_exit(lock);
+	return retv;
+}
+
+int main(int argc, char *argv[])
+{
+	struct cmdargs args;
+	struct dump_ctx ctx;
+	struct gang_port ports[MAX_GANG];
+	int retv, i;
+
+	memset(&args, 0, sizeof(args));
+	if ((retv = parse_cmdline(&args, argc, argv)))
+		return retv;
+
+	/* when streaming, stdout carries the data and messages go to stderr */
+	ctx.args = &args;
+	ctx.outfd = STDOUT_FILENO;
+	if (strcmp(args.binfile, "-") == 0 && !args.checksum) {
+		ctx.outfd = dup(STDOUT_FILENO);
+		if (ctx.outfd == -1 ||
+				dup2(STDERR_FILENO, STDOUT_FILENO) == -1) {
+			fprintf(stderr, "Cannot redirect stdout: %s\n",
+				strerror(errno));
+			return 1000;
+		}
+	}
+
+	memset(ports, 0, sizeof(ports));
+	for (i = 0; i < args.ndevs; i++)
+		ports[i].dev = args.icdi_devs[i];
+	retv = gang_run(ports, args.ndevs, &ctx, dump_board);
+	if (!job_metrics_write(args.metrics_json, args.prom_textfile,
+				"dumpflash", ports, args.ndevs, retv) && retv == 0)
+		retv = 28;
 	return retv;
 }
@@ -0,0 +1,401 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <elf.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "fwimage.h"
+
+static int add_segment(struct fw_image *img, int *room, uint32_t addr,
+		uint32_t len, const uint8_t *data)
+{
+	struct fw_segment *seg;
+
+	if (len == 0)
+		return 1;
+	if (img->nsegs > 0) {
+		seg = img->segs + img->nsegs - 1;
+		if (seg->addr + seg->len == addr && seg->data + seg->len == data) {
+			seg->len += len;
+			return 1;
+		}
+	}
+	if (img->nsegs == *room) {
+		*room = *room? *room * 2 : 16;
+		seg = realloc(img->segs, *room * sizeof(*seg));
+		if (!seg) {
+			fprintf(stderr, "Out of Memory!\n");
+			return 0;
+		}
+		img->segs = seg;
+	}
+	seg = img->segs + img->nsegs++;
+	seg->addr = addr;
+	seg->len = len;
+	seg->data = data;
+	return 1;
+}
+
+static int seg_cmp(const void *a, const void *b)
+{
+	const struct fw_segment *sa = a, *sb = b;
+
+	return sa->addr < sb->addr? -1 : sa->addr > sb->addr;
+}
+
+static int load_elf(struct fw_image *img, const char *path)
+{
+	const Elf32_Ehdr *eh = img->map;
+	const Elf32_Phdr *ph;
+	int i, room;
+
+	if (img->mapsize < sizeof(*eh) ||
+			eh->e_ident[EI_CLASS] != ELFCLASS32 ||
+			eh->e_ident[EI_DATA] != ELFDATA2LSB ||
+			eh->e_machine != EM_ARM) {
+		fprintf(stderr, "%s: not a 32-bit little endian ARM ELF\n",
+			path);
+		return 0;
+	}
+	if (eh->e_phentsize != sizeof(*ph) || eh->e_phoff > img->mapsize ||
+			eh->e_phnum * sizeof(*ph) > img->mapsize - eh->e_phoff) {
+		fprintf(stderr, "%s: bad program header table\n", path);
+		return 0;
+	}
+	room = 0;
+	ph = (const Elf32_Phdr *)((const uint8_t *)img->map + eh->e_phoff);
+	for (i = 0; i < eh->e_phnum; i++, ph++) {
+		if (ph->p_type != PT_LOAD || ph->p_filesz == 0)
+			continue;
+		if (ph->p_offset > img->mapsize ||
+				ph->p_filesz > img->mapsize - ph->p_offset) {
+			fprintf(stderr, "%s: segment %d beyond end of file\n",
+				path, i);
+			return 0;
+		}
+		/* program the load address, .data initializers live there */
+		if (!add_segment(img, &room, ph->p_paddr, ph->p_filesz,
+				(const uint8_t *)img->map + ph->p_offset))
+			return 0;
+	}
+	return 1;
+}
+
+static int hexval(const char *hex, int nbytes, uint32_t *val)
+{
+	int i, nib;
+	char c;
+
+	*val = 0;
+	for (i = 0; i < nbytes * 2; i++) {
+		c = hex[i];
+		if (c >= '0' && c <= '9')
+			nib = c - '0';
+		else if (c >= 'A' && c <= 'F')
+			nib = c - 'A' + 10;
+		else if (c >= 'a' && c <= 'f')
+			nib = c - 'a' + 10;
+		else
+			return 0;
+		*val = (*val << 4) | nib;
+	}
+	return 1;
+}
+
+static int load_ihex(struct fw_image *img, const char *path)
+{
+	const char *pos, *end;
+	uint8_t *data, sum;
+	uint32_t base, cnt, offset, type, val, i;
+	int lineno, room, eof;
+
+	img->hexdata = malloc(img->mapsize / 2 + 1);
+	if (!img->hexdata) {
+		fprintf(stderr, "Out of Memory!\n");
+		return 0;
+	}
+	data = img->hexdata;
+	base = 0;
+	room = 0;
+	eof = 0;
+	pos = img->map;
+	end = pos + img->mapsize;
+	lineno = 1;
+	while (pos < end && !eof) {
+		while (pos < end && (*pos == '\r' || *pos == '\n' ||
+					*pos == ' ' || *pos == '\t'))
+			if (*pos++ == '\n')
+				lineno++;
+		if (pos == end)
+			break;
+		if (*pos != ':' || end - pos < 11 || !hexval(pos + 1, 1, &cnt) ||
+				end - pos < 11 + 2*cnt ||
+				!hexval(pos + 3, 2, &offset) ||
+				!hexval(pos + 7, 1, &type))
+			goto bad;
+		sum = cnt + (offset >> 8) + offset + type;
+		for (i = 0; i <= cnt; i++) {
+			if (!hexval(pos + 9 + 2*i, 1, &val))
+				goto bad;
+			sum += val;
+			if (i < cnt)
+				data[i] = val;
+		}
+		if (sum != 0) {
+			fprintf(stderr, "%s:%d: checksum error\n", path, lineno);
+			return 0;
+		}
+		switch (type) {
+		case 0:
+			if (!add_segment(img, &room, base + offset, cnt, data))
+				return 0;
+			data += cnt;
+			break;
+		case 1:
+			eof = 1;
+			break;
+		case 2:
+			if (cnt != 2)
+				goto bad;
+			base = (((uint32_t)data[0] << 8) | data[1]) << 4;
+			break;
+		case 4:
+			if (cnt != 2)
+				goto bad;
+			base = (((uint32_t)data[0] << 8) | data[1]) << 16;
+			break;
+		case 3:
+		case 5:
+			/* start address, nothing to program */
+			break;
+		default:
+			goto bad;
+		}
+		pos += 11 + 2*cnt;
+	}
+	if (!eof)
+		fprintf(stderr, "%s: Warning! No end of file record.\n", path);
+	return 1;
+
+bad:
+	fprintf(stderr, "%s:%d: malformed record\n", path, lineno);
+	return 0;
+}
+
+/*
+ * Map path and split it into segments. ELF files and Intel HEX files
+ * carry their own addresses, anything else is a raw image placed at
+ * addr. Returns 1 on success, 0 on failure.
+ */
+int fw_image_load(struct fw_image *img, const char *path, uint32_t addr)
+{
+	struct stat mstat;
+	const char *p;
+	int fd, i, room, retv;
+
+	memset(img, 0, sizeof(*img));
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		fprintf(stderr, "Cannot open file: %s->%s\n", path,
+			strerror(errno));
+		return 0;
+	}
+	retv = 0;
+	if (fstat(fd, &mstat) == -1 || mstat.st_size == 0) {
+		fprintf(stderr, "%s: empty or unreadable file\n", path);
+		goto exit_10;
+	}
+	img->mapsize = mstat.st_size;
+	img->map = mmap(NULL, img->mapsize, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (img->map == MAP_FAILED) {
+		fprintf(stderr, "Cannot map file: %s->%s\n", path,
+			strerror(errno));
+		img->map = NULL;
+		goto exit_10;
+	}
+	madvise(img->map, img->mapsize, MADV_SEQUENTIAL);
+
+	p = img->map;
+	if (img->mapsize >= SELFMAG && memcmp(p, ELFMAG, SELFMAG) == 0) {
+		img->format = FW_ELF;
+		retv = load_elf(img, path);
+	} else if (p[0] == ':') {
+		img->format = FW_IHEX;
+		retv = load_ihex(img, path);
+	} else {
+		img->format = FW_RAW;
+		room = 0;
+		retv = add_segment(img, &room, addr, img->mapsize,
+				img->map);
+	}
+	if (!retv)
+		goto exit_10;
+
+	qsort(img->segs, img->nsegs, sizeof(*img->segs), seg_cmp);
+	for (i = 1; i < img->nsegs; i++)
+		if (img->segs[i-1].addr + img->segs[i-1].len >
+				img->segs[i].addr) {
+			fprintf(stderr, "%s: segments overlap at %08X\n", path,
+				img->segs[i].addr);
+			retv = 0;
+			goto exit_10;
+		}
+	if (img->nsegs == 0) {
+		fprintf(stderr, "%s: nothing to program\n", path);
+		retv = 0;
+	}
+
+exit_10:
+	close(fd);
+	if (!retv)
+		fw_image_free(img);
+	return retv;
+}
+
+void fw_image_free(struct fw_image *img)
+{
+	if (img->map)
+		munmap(img->map, img->mapsize);
+	free(img->hexdata);
+	free(img->segs);
+	memset(img, 0, sizeof(*img));
+}
+
+static uint64_t fnv1a(uint64_t hash, const uint8_t *data, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		hash ^= data[i];
+		hash *= 0x100000001b3ull;
+	}
+	return hash;
+}
+
+/* FNV-1a of a block of bytes */
+uint64_t fw_data_hash(const void *data, size_t len)
+{
+	return fnv1a(0xcbf29ce484222325ull, data, len);
+}
+
+/*
+ * CRC-32 of IEEE 802.3, slicing by 8: crc_tab[k][b] is the CRC of byte b
+ * followed by k zero bytes, so eight table lookups fold in eight bytes.
+ */
+static uint32_t crc_tab[8][256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_init(void)
+{
+	uint32_t crc;
+	int i, k;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (k = 0; k < 8; k++)
+			crc = (crc >> 1) ^ ((crc & 1)? 0xedb88320 : 0);
+		crc_tab[0][i] = crc;
+	}
+	for (i = 0; i < 256; i++)
+		for (k = 1; k < 8; k++)
+			crc_tab[k][i] = (crc_tab[k-1][i] >> 8) ^
+				crc_tab[0][crc_tab[k-1][i] & 0xff];
+}
+
+/* continue crc, 0 to start, over len bytes; assumes a little-endian host */
+uint32_t fw_crc32(uint32_t crc, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+	uint32_t lo, hi;
+
+	pthread_once(&crc_once, crc_init);
+	crc = ~crc;
+	for (; len > 0 && ((uintptr_t)p & 3); len--)
+		crc = crc_tab[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	for (; len >= 8; len -= 8, p += 8) {
+		memcpy(&lo, p, 4);
+		memcpy(&hi, p + 4, 4);
+		lo ^= crc;
+		crc = crc_tab[7][lo & 0xff] ^ crc_tab[6][(lo >> 8) & 0xff] ^
+			crc_tab[5][(lo >> 16) & 0xff] ^ crc_tab[4][lo >> 24] ^
+			crc_tab[3][hi & 0xff] ^ crc_tab[2][(hi >> 8) & 0xff] ^
+			crc_tab[1][(hi >> 16) & 0xff] ^ crc_tab[0][hi >> 24];
+	}
+	for (; len > 0; len--)
+		crc = crc_tab[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+/* FNV-1a over the address, length and bytes of every segment */
+uint64_t fw_image_hash(const struct fw_image *img)
+{
+	const struct fw_segment *seg;
+	uint64_t hash;
+
+	hash = 0xcbf29ce484222325ull;
+	for (seg = img->segs; seg < img->segs + img->nsegs; seg++) {
+		hash = fnv1a(hash, (const uint8_t *)&seg->addr,
+				sizeof(seg->addr));
+		hash = fnv1a(hash, (const uint8_t *)&seg->len,
+				sizeof(seg->len));
+		hash = fnv1a(hash, seg->data, seg->len);
+	}
+	return hash;
+}
+
+/*
+ * Look up an object or function symbol in the symbol tables of an ELF
+ * image. Returns 1 with its address and size, 0 if there is none.
+ */
+int fw_elf_symbol(const struct fw_image *img, const char *name,
+		uint32_t *addr, uint32_t *size)
+{
+	const Elf32_Ehdr *eh = img->map;
+	const Elf32_Shdr *sh, *strsh;
+	const Elf32_Sym *sym;
+	const char *strtab;
+	uint32_t i, k, nsyms, type;
+
+	if (img->format != FW_ELF || eh->e_shentsize != sizeof(*sh) ||
+			eh->e_shoff > img->mapsize ||
+			eh->e_shnum * sizeof(*sh) > img->mapsize - eh->e_shoff)
+		return 0;
+	sh = (const Elf32_Shdr *)((const uint8_t *)img->map + eh->e_shoff);
+	for (i = 0; i < eh->e_shnum; i++) {
+		if (sh[i].sh_type != SHT_SYMTAB || sh[i].sh_link >= eh->e_shnum)
+			continue;
+		strsh = sh + sh[i].sh_link;
+		if (sh[i].sh_offset > img->mapsize ||
+				sh[i].sh_size > img->mapsize - sh[i].sh_offset ||
+				strsh->sh_offset > img->mapsize ||
+				strsh->sh_size > img->mapsize - strsh->sh_offset)
+			continue;
+		sym = (const Elf32_Sym *)((const uint8_t *)img->map +
+				sh[i].sh_offset);
+		nsyms = sh[i].sh_size / sizeof(*sym);
+		strtab = (const char *)img->map + strsh->sh_offset;
+		for (k = 0; k < nsyms; k++, sym++) {
+			type = ELF32_ST_TYPE(sym->st_info);
+			if (sym->st_shndx == SHN_UNDEF ||
+					sym->st_name >= strsh->sh_size ||
+					(type != STT_OBJECT && type != STT_FUNC &&
+					 type != STT_NOTYPE))
+				continue;
+			if (strnlen(strtab + sym->st_name, strsh->sh_size -
+					sym->st_name) != strlen(name) ||
+					memcmp(strtab + sym->st_name, name,
+						strlen(name)) != 0)
+				continue;
+			/* the Thumb bit is no part of the address */
+			*addr = type == STT_FUNC? sym->st_value & ~1u :
+				sym->st_value;
+			*size = sym->st_size;
+			return 1;
+		}
+	}
+	return 0;
+}
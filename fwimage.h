@@ -0,0 +1,68 @@
+#ifndef FWIMAGE_DSCAO__
+#define FWIMAGE_DSCAO__
+#include <stdint.h>
+#include <stddef.h>
+
+enum fw_format {FW_RAW, FW_ELF, FW_IHEX};
+
+/* a run of bytes to be programmed, data points into the mapped file */
+struct fw_segment {
+	uint32_t addr;
+	uint32_t len;
+	const uint8_t *data;
+};
+
+/*
+ * A firmware image: ascending, non-overlapping segments. Bytes between
+ * segments are absent and are neither erased nor written unless they
+ * share a flash sector with a segment.
+ */
+struct fw_image {
+	enum fw_format format;
+	int nsegs;
+	struct fw_segment *segs;
+	void *map;
+	size_t mapsize;
+	uint8_t *hexdata;	/* decoded Intel HEX records */
+};
+
+int fw_image_load(struct fw_image *img, const char *path, uint32_t addr);
+void fw_image_free(struct fw_image *img);
+uint64_t fw_image_hash(const struct fw_image *img);
+uint64_t fw_data_hash(const void *data, size_t len);
+uint32_t fw_crc32(uint32_t crc, const void *data, size_t len);
+int fw_elf_symbol(const struct fw_image *img, const char *name,
+		uint32_t *addr, uint32_t *size);
+
+static inline uint32_t fw_image_bytes(const struct fw_image *img)
+{
+	uint32_t len;
+	int i;
+
+	for (len = 0, i = 0; i < img->nsegs; i++)
+		len += img->segs[i].len;
+	return len;
+}
+
+static inline uint32_t fw_image_end(const struct fw_image *img)
+{
+	const struct fw_segment *seg;
+
+	if (img->nsegs == 0)
+		return 0;
+	seg = img->segs + img->nsegs - 1;
+	return seg->addr + seg->len;
+}
+
+static inline const char *fw_format_name(enum fw_format format)
+{
+	switch (format) {
+	case FW_ELF:
+		return "ELF";
+	case FW_IHEX:
+		return "Intel HEX";
+	default:
+		return "binary";
+	}
+}
+#endif /* FWIMAGE_DSCAO__ */
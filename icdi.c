@@ -1,134 +1,774 @@
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <limits.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <termios.h>
+#include <sys/uio.h>
+#include <sys/file.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/ioctl.h>
+#include <sys/inotify.h>
+#include <dirent.h>
+#include <poll.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/serial.h>
 #include "icdi.h"
 
-static int escape(const char *inbuf, int len, char *outbuf)
+static const char hexdigits[] = "0123456789abcdef";
+
+#define BYTES_01	0x0101010101010101ull
+#define BYTES_80	0x8080808080808080ull
+#define LANES_FF	0x00ff00ff00ff00ffull
+
+/* non-zero if any byte of w equals c */
+static inline uint64_t has_byte(uint64_t w, uint8_t c)
+{
+	uint64_t x = w ^ (BYTES_01 * c);
+
+	return (x - BYTES_01) & ~x & BYTES_80;
+}
+
+static inline int is_special(char cc)
+{
+	return cc == ESCAPE || cc == START || cc == END;
+}
+
+uint8_t icdi_checksum(const char *data, int len)
+{
+	const char *end;
+	uint8_t sum;
+
+	for (sum = 0, end = data + len; data < end; data++)
+		sum += *data;
+	return sum;
+}
+
+/*
+ * Escape inbuf into outbuf and add the escaped bytes to *sum, in one
+ * pass. Most flash data contains none of '$', '#' and '}', so the data
+ * is scanned a 64-bit word at a time, summed in 16-bit lanes, and only
+ * the words holding one of them are escaped byte by byte. At most room
+ * bytes are written; if the data does not fit, it is cut at a word
+ * (4 byte) boundary of the input.
+ * Returns the number of input bytes consumed, *olen the output length.
+ */
+int icdi_escape(const char *inbuf, int len, char *outbuf, int room,
+		int *olen, uint8_t *sum)
+{
+	int i, o, ci, co, end;
+	unsigned int s, cs;
+	uint64_t w, lanes;
+	char cc;
+
+	i = 0;
+	o = 0;
+	s = *sum;
+	lanes = 0;
+	while (i < len) {
+		while (i + 8 <= len && o + 8 <= room) {
+			memcpy(&w, inbuf + i, 8);
+			if (has_byte(w, ESCAPE) | has_byte(w, START) |
+					has_byte(w, END))
+				break;
+			memcpy(outbuf + o, &w, 8);
+			lanes = (lanes & LANES_FF) + (w & LANES_FF) +
+				((w >> 8) & LANES_FF);
+			i += 8;
+			o += 8;
+		}
+		if (i >= len)
+			break;
+		end = i + 8 < len? i + 8 : len;
+		if (o + 2*(end - i) <= room) {
+			for (; i < end; i++) {
+				cc = inbuf[i];
+				if (is_special(cc)) {
+					outbuf[o++] = ESCAPE;
+					s += ESCAPE;
+					cc ^= 0x20;
+				}
+				outbuf[o++] = cc;
+				s += (uint8_t)cc;
+			}
+			continue;
+		}
+		ci = i;
+		co = o;
+		cs = s;
+		for (end = i + 4 < len? i + 4 : len; i < end; i++) {
+			cc = inbuf[i];
+			if (o + 1 + is_special(cc) > room) {
+				i = ci;
+				o = co;
+				s = cs;
+				goto exit_10;
+			}
+			if (is_special(cc)) {
+				outbuf[o++] = ESCAPE;
+				s += ESCAPE;
+				cc ^= 0x20;
+			}
+			outbuf[o++] = cc;
+			s += (uint8_t)cc;
+		}
+	}
+
+exit_10:
+	s += ((lanes & LANES_FF) * 0x0001000100010001ull) >> 48;
+	*olen = o;
+	*sum = s;
+	return i;
+}
+
+void icdi_rx_init(struct icdi_rx *rx)
+{
+	rx->state = RX_IDLE;
+	rx->len = 0;
+	rx->sum = 0;
+	rx->xsum = 0;
+}
+
+static inline int hexval(char cc)
+{
+	if (cc >= '0' && cc <= '9')
+		return cc - '0';
+	if (cc >= 'a' && cc <= 'f')
+		return cc - 'a' + 10;
+	if (cc >= 'A' && cc <= 'F')
+		return cc - 'A' + 10;
+	return -1;
+}
+
+/*
+ * Feed len received bytes to the packet decoder. Bytes outside a packet
+ * are skipped, escapes are undone and '*' runs expanded while the sum
+ * of the raw bytes is kept for the check against the trailer. The
+ * decoded packet is laid out in out as '$', data, '#', checksum, so
+ * the reply accessors see the same bytes as on the wire. Stops after
+ * the byte that completes a packet and returns the bytes consumed;
+ * rx->state tells whether the packet is done, corrupted or too large.
+ */
+int icdi_rx_feed(struct icdi_rx *rx, const char *in, int len, char *out,
+		int size)
 {
 	const char *ibuf;
-	char *obuf, cc;
+	char cc;
+	int n, v;
 
-	*outbuf = *inbuf;
-	ibuf = inbuf+1;
-	obuf = outbuf+1;
-	while (ibuf < inbuf + len) {
+	for (ibuf = in; ibuf < in + len; ) {
 		cc = *ibuf++;
-		if (cc == ESCAPE || cc == START || cc == END) {
-			*obuf++ = ESCAPE;
+		switch (rx->state) {
+		case RX_IDLE:
+			if (cc == START) {
+				out[0] = START;
+				rx->len = START_LEN;
+				rx->sum = 0;
+				rx->state = RX_DATA;
+			}
+			continue;
+		case RX_DATA:
+			if (cc == END) {
+				out[rx->len++] = END;
+				rx->state = RX_CSUM1;
+				continue;
+			} else if (cc == START) {
+				rx->len = START_LEN;
+				rx->sum = 0;
+				continue;
+			}
+			rx->sum += cc;
+			if (cc == ESCAPE) {
+				rx->state = RX_ESC;
+				continue;
+			} else if (cc == STAR) {
+				rx->state = RX_RLE;
+				continue;
+			}
+			break;
+		case RX_ESC:
+			rx->sum += cc;
 			cc ^= 0x20;
+			rx->state = RX_DATA;
+			break;
+		case RX_RLE:
+			rx->sum += cc;
+			n = (uint8_t)cc - 29;
+			if (rx->len <= START_LEN || n < 0 ||
+					rx->len + n + END_LEN > size) {
+				rx->state = n < 0? RX_BADSUM : RX_OVERFLOW;
+				return ibuf - in;
+			}
+			memset(out + rx->len, out[rx->len-1], n);
+			rx->len += n;
+			rx->state = RX_DATA;
+			continue;
+		case RX_CSUM1:
+		case RX_CSUM2:
+			v = hexval(cc);
+			if (v == -1) {
+				rx->state = RX_BADSUM;
+				return ibuf - in;
+			}
+			rx->xsum = (rx->xsum << 4) | v;
+			out[rx->len++] = cc;
+			if (rx->state == RX_CSUM1) {
+				rx->state = RX_CSUM2;
+				continue;
+			}
+			rx->state = rx->xsum == rx->sum? RX_DONE : RX_BADSUM;
+			return ibuf - in;
+		default:
+			return 0;
+		}
+		if (rx->len + END_LEN >= size) {
+			rx->state = RX_OVERFLOW;
+			return ibuf - in;
 		}
-		*obuf++ = cc;
+		out[rx->len++] = cc;
 	}
-	return obuf - outbuf;
+	return ibuf - in;
 }
 
-static int unescape(const char *inbuf, int len, char *outbuf)
+/*
+ * Wait until fd is ready for events or the deadline passes. Returns 1
+ * when ready, 0 on timeout and -1 on error.
+ */
+static int wait_fd(int fd, short events, uint64_t deadline)
 {
-	const char *ibuf;
-	char *obuf, cc;
+	struct pollfd pfd;
+	uint64_t now;
+	int sysret;
 
-	*outbuf = *inbuf;
-	ibuf = inbuf + 1;
-	obuf = outbuf + 1;
-	while (ibuf < inbuf + len) {
-		cc = *ibuf++;
-		if (cc == ESCAPE)
-			cc = *ibuf++ ^ 0x20;
-		*obuf++ = cc;
+	pfd.fd = fd;
+	pfd.events = events;
+	do {
+		now = icdi_now_us();
+		if (now >= deadline)
+			return 0;
+		sysret = poll(&pfd, 1, (deadline - now + 999) / 1000);
+	} while (sysret == -1 && errno == EINTR);
+	return sysret;
+}
+
+/* refill the read buffer once it has been consumed */
+static int fill_rbuf(struct icdibuf *buf)
+{
+	int len, ready;
+
+	for (;;) {
+		len = read(buf->port, buf->rbuf, RBUFSIZE);
+		if (len >= 0 || (errno != EAGAIN && errno != EINTR))
+			break;
+		if (errno == EINTR)
+			continue;
+		ready = wait_fd(buf->port, POLLIN, buf->deadline);
+		if (ready == 0) {
+			fprintf(stderr, "Target not responding within %dms\n",
+				buf->timeout_ms);
+			len = -1;
+			errno = ETIMEDOUT;
+			break;
+		} else if (ready == -1)
+			break;
 	}
-	return obuf - outbuf;
+	if (len == -1 && errno != ETIMEDOUT)
+		printf("Error receiving data %s\n", strerror(errno));
+	else if (len == 0)
+		fprintf(stderr, "Connection to target closed\n");
+	buf->rpos = 0;
+	buf->rlen = len > 0? len : 0;
+	buf->lstat.bytes_in += buf->rlen;
+	return len;
 }
 
-static int send_down(struct icdibuf *buf)
+/*
+ * Wait for the target's '+' or '-'. A '$' means the reply is already
+ * coming and its ack got lost, it is left for recv_up(); anything else
+ * is line noise.
+ */
+static int read_ack(struct icdibuf *buf)
 {
-	int retlen, i, buflen, tries;
+	char cc;
+
+	do {
+		if (buf->rpos == buf->rlen && fill_rbuf(buf) <= 0)
+			return -1;
+		cc = buf->rbuf[buf->rpos];
+		if (cc == START)
+			return '+';
+		buf->rpos++;
+	} while (cc != '+' && cc != '-');
+	return cc;
+}
+
+/*
+ * Read all len bytes. A non-blocking fd is waited on until deadline, a
+ * blocking one never asks to wait.
+ */
+static int read_full(int fd, void *data, int len, uint64_t deadline)
+{
+	int retlen, pos, ready;
+
+	for (pos = 0; pos < len; pos += retlen) {
+		retlen = read(fd, (char *)data + pos, len - pos);
+		if (retlen == -1 && errno == EINTR)
+			retlen = 0;
+		else if (retlen == -1 && errno == EAGAIN) {
+			ready = wait_fd(fd, POLLIN, deadline);
+			if (ready == 0)
+				errno = ETIMEDOUT;
+			if (ready <= 0)
+				return -1;
+			retlen = 0;
+		} else if (retlen <= 0)
+			return -1;
+	}
+	return len;
+}
+
+/*
+ * Write out all of iov. A non-blocking port is waited on until deadline,
+ * a blocking one, like the socket to icdid while opening, never asks to
+ * wait.
+ */
+static int writev_all(int port, struct iovec *iov, int iovcnt,
+		uint64_t deadline)
+{
+	int retlen, total, ready;
+
+	total = 0;
+	while (iovcnt > 0) {
+		retlen = writev(port, iov, iovcnt);
+		if (retlen == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN)
+				return -1;
+			ready = wait_fd(port, POLLOUT, deadline);
+			if (ready == 0)
+				errno = ETIMEDOUT;
+			if (ready <= 0)
+				return -1;
+			continue;
+		}
+		total += retlen;
+		while (iovcnt > 0 && retlen >= iov->iov_len) {
+			retlen -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + retlen;
+			iov->iov_len -= retlen;
+		}
+	}
+	return total;
+}
+
+/* trace status of a failed read or write */
+static inline int link_status(void)
+{
+	return errno == ETIMEDOUT? TRACE_TIMEOUT : TRACE_ERROR;
+}
+
+/* open a trace file for appending, held exclusively by this session */
+static FILE *trace_lock(const char *path)
+{
+	FILE *fp;
+	int err;
+
+	fp = fopen(path, "a+b");
+	if (!fp)
+		return NULL;
+	if (flock(fileno(fp), LOCK_EX|LOCK_NB) == -1) {
+		err = errno;
+		fclose(fp);
+		errno = err;
+		return NULL;
+	}
+	return fp;
+}
+
+/*
+ * Start a packet trace for the adapter at port if $ICDI_TRACE asks for
+ * one. Sessions append to an existing trace on its time base. A trace
+ * file takes one session at a time: when $ICDI_TRACE names a file that
+ * another board of a gang or another tool is tracing to, this session
+ * traces to <file>.<port> instead. A failure to trace is reported but
+ * does not stop the session.
+ */
+static void trace_open(struct icdibuf *buf, const char *port)
+{
+	struct icdi_trace_hdr hdr;
+	struct timespec tm;
+	struct stat mstat;
+	const char *path, *name;
+	char fname[PATH_MAX];
+	uint64_t now;
+
+	path = getenv("ICDI_TRACE");
+	if (!path || *path == 0)
+		return;
+	name = strrchr(port, '/');
+	name = name? name + 1 : port;
+	if (stat(path, &mstat) == 0 && S_ISDIR(mstat.st_mode)) {
+		if (snprintf(fname, sizeof(fname), "%s/%s.trace", path,
+					name) >= (int)sizeof(fname))
+			goto exit_10;
+		path = fname;
+	}
+	buf->trace = trace_lock(path);
+	if (!buf->trace && errno == EWOULDBLOCK && path != fname) {
+		if (snprintf(fname, sizeof(fname), "%s.%s", path, name) >=
+				(int)sizeof(fname))
+			goto exit_10;
+		fprintf(stderr, "Trace file %s in use, tracing to %s\n", path,
+			fname);
+		path = fname;
+		buf->trace = trace_lock(path);
+	}
+	if (!buf->trace) {
+		fprintf(stderr, "Cannot open trace file %s->%s\n", path,
+			strerror(errno));
+		return;
+	}
+	clock_gettime(CLOCK_REALTIME, &tm);
+	now = (uint64_t)tm.tv_sec * 1000000 + tm.tv_nsec / 1000;
+	rewind(buf->trace);
+	if (fread(&hdr, sizeof(hdr), 1, buf->trace) != 1 ||
+			memcmp(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic)) != 0) {
+		fseek(buf->trace, 0, SEEK_SET);
+		if (ftruncate(fileno(buf->trace), 0) == -1)
+			fprintf(stderr, "Cannot truncate trace file %s\n", path);
+		memset(&hdr, 0, sizeof(hdr));
+		memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+		hdr.start = now;
+		fwrite(&hdr, sizeof(hdr), 1, buf->trace);
+	}
+	/* switching from reading to appending needs a seek */
+	fseek(buf->trace, 0, SEEK_END);
+	buf->trace_t0 = icdi_now_us() - (now - hdr.start);
+	return;
+exit_10:
+	fprintf(stderr, "Trace file path too long: %s\n", path);
+}
+
+/* record one packet, data of dlen bytes follows the head */
+static void trace_packet(struct icdibuf *buf, int dir, uint64_t usecs,
+		const char *head, int hlen, const char *data, int dlen)
+{
+	struct icdi_trace_rec rec;
+
+	if (hlen < 0)
+		hlen = 0;
+	memset(&rec, 0, sizeof(rec));
+	rec.usecs = usecs - buf->trace_t0;
+	rec.len = hlen + dlen;
+	rec.dir = dir;
+	rec.retries = buf->retries > 255? 255 : buf->retries;
+	rec.status = buf->tstatus;
+	fwrite(&rec, sizeof(rec), 1, buf->trace);
+	fwrite(head, 1, hlen, buf->trace);
+	if (dlen > 0)
+		fwrite(data, 1, dlen, buf->trace);
+	/* an exchange is complete, keep the trace usable after a crash */
+	if (dir == TRACE_RX)
+		fflush(buf->trace);
+}
+
+/*
+ * Frame the packet header in buf->buf, buf->len bytes starting with '$'
+ * and holding no character that needs escaping, and the binary data
+ * escaped straight after it into wbuf. The framed packet stays in wbuf
+ * for retransmission while the reply overwrites buf->buf. *dlen is
+ * updated to the number of data bytes that fitted in the packet.
+ */
+static void frame_packet(struct icdibuf *buf, const char *data, int *dlen)
+{
+	int elen, pos;
 	uint8_t sum;
-	char echo;
 
-	if (buf->len <= 0)
-		return 0;
+	memcpy(buf->wbuf, buf->buf, buf->len);
+	sum = icdi_checksum(buf->buf + START_LEN, buf->len - START_LEN);
+	elen = 0;
+	if (*dlen > 0)
+		*dlen = icdi_escape(data, *dlen, buf->wbuf + buf->len,
+			buf->pktsize - buf->len - END_LEN, &elen, &sum);
+	pos = buf->len + elen;
+	buf->wbuf[pos++] = END;
+	buf->wbuf[pos++] = hexdigits[sum >> 4];
+	buf->wbuf[pos++] = hexdigits[sum & 0x0f];
+	buf->wlen = pos;
+}
 
-	buflen = escape(buf->buf, buf->len, buf->wbuf);
+static int send_framed(struct icdibuf *buf)
+{
+	struct iovec iov;
+	int retlen;
 
-	sum = 0;
-	for (i = 1; i < buflen; i++)
-		sum += buf->wbuf[i];
-	buflen += sprintf(buf->wbuf + buflen, "%c%02x", END, sum);
+	iov.iov_base = buf->wbuf;
+	iov.iov_len = buf->wlen;
+	retlen = writev_all(buf->port, &iov, 1, buf->deadline);
+	if (retlen == -1)
+		printf("Error transmitting data %s\n", strerror(errno));
+	else
+		buf->lstat.bytes_out += retlen;
+	return retlen;
+}
+
+/*
+ * Send the packet and wait for the adapter to acknowledge it, sending
+ * it again on a '-'. Without acks it is sent once and a lost packet
+ * shows as a missing reply.
+ */
+static int send_down(struct icdibuf *buf, const char *data, int *dlen)
+{
+	int retlen, tries;
+	int echo;
 
+	if (buf->len <= 0)
+		return 0;
+
+	frame_packet(buf, data, dlen);
+	/* whatever is still buffered belongs to an earlier exchange */
+	buf->rpos = buf->rlen;
+	buf->retries = 0;
+	buf->tstatus = TRACE_OK;
+	if (buf->noack) {
+		retlen = send_framed(buf);
+		if (retlen == -1)
+			buf->tstatus = link_status();
+		return retlen;
+	}
 	tries = 0;
 	echo = '-';
 	do {
-		retlen = write(buf->port, buf->wbuf, buflen);
-		if (retlen == -1) {
-			printf("Error transmitting data %s\n", strerror(errno));
+		retlen = send_framed(buf);
+		if (retlen == -1)
 			break;
-		}
-		read(buf->port, &echo, 1);
+		echo = read_ack(buf);
 		tries++;
-	} while (echo != '+' && tries < 5);
+	} while (echo == '-' && tries < 5);
+	buf->retries = tries > 0? tries - 1 : 0;
 	if (echo != '+') {
 		fprintf(stderr, "Connection to target is not stable\n");
+		buf->tstatus = echo == '-'? TRACE_NOACK : link_status();
 		retlen = -1;
 	}
 
 	return retlen;
 }
 
+/*
+ * Receive one reply packet. The ICDI firmware does not expect its
+ * replies to be acknowledged, but a corrupted one is answered with '-'
+ * to have it sent again. Without acks the request itself is sent again
+ * instead, if it is idempotent; a corrupted reply to a write or a
+ * monitor command fails the exchange, as the target may have carried
+ * the request out already; icdi_reply_ok() then fails the accessor
+ * that sent it. The reply is decoded into xbuf and only
+ * takes the place of buf once its checksum is good, so a failed
+ * exchange never leaves part of a reply for the accessors to read.
+ */
 static int recv_up(struct icdibuf *buf)
 {
-	int retlen, len, srem;
-	char *u;
+	struct icdi_rx rx;
+	struct iovec iov;
+	char *tmp;
+	int naks;
 
-	retlen = 0;
-	srem = BUFSIZE;
-	u = buf->wbuf;
+	icdi_rx_init(&rx);
+	naks = 0;
+	buf->retries = 0;
+	buf->tstatus = TRACE_ERROR;
 	do {
-		len = read(buf->port, u, srem);
-		if (len == -1) {
-			printf("Error receiving data %s\n", strerror(errno));
-			break;
+		if (buf->rpos == buf->rlen && fill_rbuf(buf) <= 0) {
+			buf->tstatus = link_status();
+			return -1;
+		}
+		buf->rpos += icdi_rx_feed(&rx, buf->rbuf + buf->rpos,
+				buf->rlen - buf->rpos, buf->xbuf, buf->bufsize);
+		if (rx.state == RX_OVERFLOW) {
+			fprintf(stderr, "Reply exceeds %d bytes\n", buf->bufsize);
+			buf->rpos = buf->rlen;
+			return -1;
+		} else if (rx.state == RX_BADSUM) {
+			buf->retries = ++naks;
+			if (naks > MAX_NAKS) {
+				fprintf(stderr, "Too many corrupted replies\n");
+				buf->tstatus = TRACE_BADSUM;
+				return -1;
+			}
+			iov.iov_base = "-";
+			iov.iov_len = 1;
+			if (buf->noack && !icdi_idempotent(buf->wbuf)) {
+				fprintf(stderr, "Corrupted reply, not resending\n");
+				/* it may have reset or resumed the core */
+				buf->halted = 0;
+				buf->rpos = buf->rlen;
+				buf->tstatus = TRACE_BADSUM;
+				return -1;
+			} else if (buf->noack) {
+				buf->rpos = buf->rlen;
+				if (send_framed(buf) == -1) {
+					buf->tstatus = link_status();
+					return -1;
+				}
+			} else if (writev_all(buf->port, &iov, 1,
+						buf->deadline) == -1) {
+				printf("Error transmitting data %s\n",
+					strerror(errno));
+				buf->tstatus = link_status();
+				return -1;
+			} else
+				buf->lstat.bytes_out++;
+			icdi_rx_init(&rx);
 		}
-		retlen += len;
-		u += len;
-		srem -= len;
-	} while ((retlen < 3) || (buf->wbuf[retlen-3] != '#'));
+	} while (rx.state != RX_DONE);
+
+	/* only a reply that checks out replaces the request in buf */
+	tmp = buf->buf;
+	buf->buf = buf->xbuf;
+	buf->xbuf = tmp;
+	buf->tstatus = TRACE_OK;
+	buf->len = rx.len;
+	return buf->len;
+}
 
-	buf->len = unescape(buf->wbuf, retlen, buf->buf);
+/*
+ * Hand the packet to the icdid daemon, which sends it on the adapter
+ * and returns the decoded reply. A reply that misses the deadline may
+ * still turn up and be taken for the next one, so the session is closed
+ * then, to be reconnected.
+ */
+static int remote_sendrecv(struct icdibuf *buf, const char *data, int *dlen)
+{
+	struct icdid_req req;
+	struct icdid_rep rep;
+	struct iovec iov[3];
 
+	buf->retries = 0;
+	buf->tstatus = TRACE_OK;
+	if (*dlen > buf->pktsize)
+		*dlen = buf->pktsize;
+	req.op = ICDID_PACKET;
+	req.prio = buf->prio;
+	req.hlen = buf->len;
+	req.dlen = *dlen;
+	iov[0].iov_base = &req;
+	iov[0].iov_len = sizeof(req);
+	iov[1].iov_base = buf->buf;
+	iov[1].iov_len = buf->len;
+	iov[2].iov_base = (char *)data;
+	iov[2].iov_len = *dlen;
+	if (writev_all(buf->port, iov, 3, buf->deadline) == -1 ||
+			read_full(buf->port, &rep, sizeof(rep),
+				buf->deadline) == -1) {
+		buf->tstatus = link_status();
+		fprintf(stderr, "Connection to icdid lost: %s\n",
+			strerror(errno));
+		close(buf->port);
+		buf->port = -1;
+		return -1;
+	}
+	if (rep.status > buf->bufsize ||
+		(rep.status > 0 &&
+			read_full(buf->port, buf->buf, rep.status,
+				buf->deadline) == -1)) {
+		buf->tstatus = link_status();
+		fprintf(stderr, "Invalid reply from icdid\n");
+		close(buf->port);
+		buf->port = -1;
+		return -1;
+	}
+	*dlen = rep.dlen;
+	buf->lstat.bytes_out += sizeof(req) + req.hlen + req.dlen;
+	buf->lstat.bytes_in += sizeof(rep) + (rep.status > 0? rep.status : 0);
+	if (rep.status < 0)
+		return -1;
+	buf->len = rep.status;
 	return buf->len;
 }
 
-static int sendrecv(struct icdibuf *buf)
+/* account the outcome of send_down() or recv_up() in buf->lstat */
+static void count_link(struct icdibuf *buf, int retlen)
+{
+	buf->lstat.retries += buf->retries;
+	if (retlen != -1)
+		return;
+	buf->lstat.failures++;
+	if (buf->tstatus == TRACE_TIMEOUT)
+		buf->lstat.timeouts++;
+}
+
+static int sendrecv_bin(struct icdibuf *buf, const char *data, int *dlen)
 {
 	int retlen;
+	uint64_t tm0;
 
-	retlen = send_down(buf);
+	tm0 = icdi_now_us();
+	buf->deadline = tm0 + buf->timeout_ms * 1000ull;
+	buf->lstat.packets++;
+	if (buf->remote) {
+		retlen = remote_sendrecv(buf, data, dlen);
+		count_link(buf, retlen);
+		return retlen;
+	}
+	retlen = send_down(buf, data, dlen);
+	count_link(buf, retlen);
+	if (buf->trace && buf->len > 0)
+		trace_packet(buf, TRACE_TX, tm0, buf->buf + START_LEN,
+			buf->len - START_LEN, data, *dlen);
 	if (retlen <= 0)
 		return retlen;
 	retlen = recv_up(buf);
+	count_link(buf, retlen);
+	if (buf->trace)
+		trace_packet(buf, TRACE_RX, icdi_now_us(), buf->buf + START_LEN,
+			retlen - START_LEN - END_LEN, NULL, 0);
 	return retlen;
 }
 
+int icdi_transact(struct icdibuf *buf, const char *data, int *dlen)
+{
+	return sendrecv_bin(buf, data, dlen);
+}
+
+static inline int sendrecv(struct icdibuf *buf)
+{
+	int dlen = 0;
+
+	return sendrecv_bin(buf, NULL, &dlen);
+}
+
 int icdi_qRcmd(struct icdibuf *buf, const char *cmd)
 {
 	static const char cmdprefix[] = "qRcmd,";
-	int i, idx;
-	const char *cstr;
+	int idx;
+	const unsigned char *cstr;
 
-	idx = sprintf(buf->buf, "%c%s", START, cmdprefix);
-        for (cstr = cmd, i = 0; i < strlen(cmd); i++)
-                idx += sprintf(buf->buf + idx, "%02x", (unsigned int)(*cstr++));
+	buf->halted = 0;
+	buf->buf[0] = START;
+	memcpy(buf->buf + 1, cmdprefix, sizeof(cmdprefix) - 1);
+	idx = sizeof(cmdprefix);
+	for (cstr = (const unsigned char *)cmd;
+			*cstr && idx < buf->pktsize - END_LEN - 1; cstr++) {
+		buf->buf[idx++] = hexdigits[*cstr >> 4];
+		buf->buf[idx++] = hexdigits[*cstr & 0x0f];
+	}
 	buf->len = idx;
 	idx = sendrecv(buf);
 	return idx;
 }
 
 
-static inline void hex2str(const char *hex, int xlen, char *str, int size)
+void icdi_hex2str(const char *hex, int xlen, char *str, int size)
 {
 	char r, c, *ostr;
 	const char *ihex;
@@ -144,14 +784,7 @@ static inline void hex2str(const char *hex, int xlen, char *str, int size)
 	if (ostr < str + size)
 		*ostr = 0;
 	else
-		*(ostr+size-1) = 0;
-}
-
-static inline void u32_le2cpu(uint32_t *val)
-{
-}
-static inline void u32_cpu2le(uint32_t *val)
-{
+		*(str+size-1) = 0;
 }
 
 static inline int sendstr(struct icdibuf *buf, const char *str)
@@ -164,15 +797,248 @@ static inline int sendstr(struct icdibuf *buf, const char *str)
 	return idx;
 }
 
-int icdi_qSupported(struct icdibuf *buf, char *options, int len)
+/*
+ * Size buf, wbuf and xbuf for packets of pktsize bytes and decoded x
+ * replies of read_max data bytes.
+ */
+static int size_buffers(struct icdibuf *buf, int pktsize, int read_max)
+{
+	int bufsize;
+	char *nbuf, *nwbuf, *nxbuf;
+
+	bufsize = read_max + 16 > pktsize? read_max + 16 : pktsize;
+	bufsize = bufsize + 128 > BUFSIZE? bufsize + 128 : BUFSIZE;
+	if (bufsize != buf->bufsize) {
+		nbuf = malloc(bufsize);
+		nwbuf = malloc(bufsize);
+		nxbuf = malloc(bufsize);
+		if (!nbuf || !nwbuf || !nxbuf) {
+			fprintf(stderr, "Out of Memory!\n");
+			free(nbuf);
+			free(nwbuf);
+			free(nxbuf);
+			return 0;
+		}
+		free(buf->buf);
+		free(buf->wbuf);
+		free(buf->xbuf);
+		buf->buf = nbuf;
+		buf->wbuf = nwbuf;
+		buf->xbuf = nxbuf;
+		buf->bufsize = bufsize;
+		buf->len = 0;
+	}
+	return 1;
+}
+
+int icdi_set_pktsize(struct icdibuf *buf, int pktsize)
+{
+	if (pktsize < 64 || pktsize > PKTSIZE_MAX) {
+		fprintf(stderr, "Invalid packet size: %d\n", pktsize);
+		return 0;
+	}
+	if (!size_buffers(buf, pktsize, buf->read_max))
+		return 0;
+	buf->pktsize = pktsize;
+	return 1;
+}
+
+/* fix the x read size, 0 goes back to the one derived from pktsize */
+int icdi_set_read_max(struct icdibuf *buf, int read_max)
+{
+	if (read_max < 0 || read_max > PKTSIZE_MAX) {
+		fprintf(stderr, "Invalid read size: %d\n", read_max);
+		return 0;
+	}
+	read_max &= ~3;
+	if (!size_buffers(buf, buf->pktsize, read_max))
+		return 0;
+	buf->read_max = read_max;
+	return 1;
+}
+
+/*
+ * The probed read sizes are kept in $XDG_CACHE_HOME/icdi-readmax, or
+ * ~/.cache/icdi-readmax, one "serial size" line per adapter. Returns 0
+ * when there is no cache directory or the path does not fit in len.
+ */
+static int read_cache_path(char *path, int len)
 {
+	const char *dir;
+
+	dir = getenv("XDG_CACHE_HOME");
+	if (dir && *dir)
+		return snprintf(path, len, "%s/icdi-readmax", dir) < len;
+	dir = getenv("HOME");
+	if (!dir || !*dir)
+		return 0;
+	if (snprintf(path, len, "%s/.cache/icdi-readmax", dir) >= len)
+		return 0;
+	snprintf(path, len, "%s/.cache", dir);
+	mkdir(path, 0700);
+	snprintf(path, len, "%s/.cache/icdi-readmax", dir);
+	return 1;
+}
+
+static int read_cache_get(const char *serial)
+{
+	char path[PATH_MAX], key[64];
 	int size;
+	FILE *f;
+
+	if (!read_cache_path(path, sizeof(path)))
+		return 0;
+	f = fopen(path, "r");
+	if (!f)
+		return 0;
+	while (fscanf(f, "%63s %d", key, &size) == 2)
+		if (strcmp(key, serial) == 0) {
+			fclose(f);
+			return size;
+		}
+	fclose(f);
+	return 0;
+}
+
+/*
+ * Rewrite the cache with the entry of serial replaced. Boards of a gang
+ * probe at the same time, so the rewrite holds a lock on <cache>.lock:
+ * the cache itself is replaced by the rename and cannot carry it.
+ */
+static void read_cache_put(const char *serial, int size)
+{
+	char path[PATH_MAX], tmp[PATH_MAX + 16], key[64];
+	FILE *f, *nf;
+	int osize, lock, fd;
+
+	if (!read_cache_path(path, sizeof(path)))
+		return;
+	snprintf(tmp, sizeof(tmp), "%s.lock", path);
+	lock = open(tmp, O_RDWR|O_CREAT|O_CLOEXEC, 0600);
+	if (lock == -1)
+		return;
+	if (flock(lock, LOCK_EX) == -1)
+		goto exit_10;
+	snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+	fd = mkstemp(tmp);
+	if (fd == -1)
+		goto exit_10;
+	nf = fdopen(fd, "w");
+	if (!nf) {
+		close(fd);
+		unlink(tmp);
+		goto exit_10;
+	}
+	f = fopen(path, "r");
+	if (f) {
+		while (fscanf(f, "%63s %d", key, &osize) == 2)
+			if (strcmp(key, serial) != 0)
+				fprintf(nf, "%s %d\n", key, osize);
+		fclose(f);
+	}
+	fprintf(nf, "%s %d\n", serial, size);
+	if (fclose(nf) != 0 || rename(tmp, path) == -1)
+		unlink(tmp);
+exit_10:
+	close(lock);
+}
+
+/*
+ * Find the largest x read the adapter answers in one packet. Flash at
+ * address 0 is read with READ_PROBE_MAX bytes asked for, halving while
+ * the adapter refuses, and whatever length comes back is its limit.
+ * The result is cached by adapter serial number, so each adapter is
+ * probed once. Returns the read size now in use.
+ */
+int icdi_probe_read_max(struct icdibuf *buf)
+{
+	int size, rlen, probed, derived;
+
+	derived = (buf->pktsize - 7) / 2;
+	probed = buf->serial[0]? read_cache_get(buf->serial) : 0;
+	if (probed > derived && icdi_set_read_max(buf, probed))
+		return icdi_read_max(buf);
+
+	probed = 0;
+	for (size = READ_PROBE_MAX; size > derived && !probed; size /= 2) {
+		if (!icdi_set_read_max(buf, size))
+			break;
+		buf->len = sprintf(buf->buf, "%cx%08x,%x", START, 0, size);
+		rlen = sendrecv(buf);
+		if (rlen > 7 && icdi_reply_ok(buf, rlen))
+			probed = rlen - 7 < size? rlen - 7 : size;
+	}
+	if (probed <= derived)
+		probed = 0;
+	icdi_set_read_max(buf, probed);
+	if (buf->serial[0] && probed > 0)
+		read_cache_put(buf->serial, icdi_read_max(buf));
+	return icdi_read_max(buf);
+}
+
+/* the feature of a qSupported reply starting with key, NULL if absent */
+static const char *find_feature(const char *options, const char *key)
+{
+	const char *opt;
+
+	for (opt = options; opt; opt = strchr(opt, ';')) {
+		if (*opt == ';')
+			opt++;
+		if (strncmp(opt, key, strlen(key)) == 0)
+			return opt;
+	}
+	return NULL;
+}
+
+static int parse_pktsize(const char *options)
+{
+	static const char key[] = "PacketSize=";
+	const char *opt;
+
+	opt = find_feature(options, key);
+	return opt? strtol(opt + sizeof(key) - 1, NULL, 16) : 0;
+}
+
+/*
+ * Ask the adapter to stop acknowledging packets, which saves a
+ * turnaround per packet. Replies are still checked against their
+ * checksum. An adapter that refuses stays in acked mode, and
+ * ICDI_NOACK=0 keeps it there anyway.
+ */
+static void start_noack(struct icdibuf *buf)
+{
+	const char *env;
+
+	env = getenv("ICDI_NOACK");
+	if (env && strcmp(env, "0") == 0)
+		return;
+	if (sendstr(buf, "QStartNoAckMode") == 2 + START_LEN + END_LEN &&
+			buf->buf[1] == 'O' && buf->buf[2] == 'K')
+		buf->noack = 1;
+}
+
+int icdi_qSupported(struct icdibuf *buf, char *options, int len)
+{
+	int size, pktsize, noack;
 
 	size = sendstr(buf, "qSupported");
-	size = size > len? len : size-4;
+	if (size < 4)
+		return 0;
+	size -= 4;
+	if (size >= len)
+		size = len - 1;
 	memcpy(options, buf->buf+1, size);
 	options[size] = 0;
-	
+
+	buf->buf[buf->len-3] = 0;
+	pktsize = parse_pktsize(buf->buf+1);
+	noack = find_feature(buf->buf+1, "QStartNoAckMode+") != NULL;
+	if (pktsize > 0)
+		icdi_set_pktsize(buf, pktsize);
+	/* through icdid the daemon owns the link and its ack mode */
+	if (noack && !buf->noack && !buf->remote)
+		start_noack(buf);
+
 	return size;
 }
 
@@ -184,82 +1050,630 @@ int icdi_version(struct icdibuf *buf, char *ver, int len)
 	*ver = 0;
 	xlen = icdi_qRcmd(buf, cmd);
 	if (xlen > 4)
-		hex2str(buf->buf+1, xlen-4, ver, len);
+		icdi_hex2str(buf->buf+1, xlen-4, ver, len);
 	return xlen - 4;
 }
 
-struct icdibuf *icdi_init(const char *serial_port, int esize)
+static struct icdibuf *icdi_alloc(int port, int esize)
 {
 	struct icdibuf *buf;
-	int port, sysret;
+	const char *timeout;
+
+	buf = malloc(sizeof(struct icdibuf));
+	if (!buf) {
+		fprintf(stderr, "Out of Memory!\n");
+		close(port);
+		return NULL;
+	}
+	buf->port = port;
+	buf->remote = 0;
+	buf->prio = ICDID_PRIO_DEFAULT;
+	buf->len = 0;
+	buf->esize = esize;
+	buf->halted = 0;
+	buf->noack = 0;
+	buf->timeout_ms = TIMEOUT_MS_DEFAULT;
+	timeout = getenv("ICDI_TIMEOUT_MS");
+	if (timeout && strtol(timeout, NULL, 0) > 0)
+		buf->timeout_ms = strtol(timeout, NULL, 0);
+	buf->deadline = 0;
+	buf->retries = 0;
+	buf->tstatus = TRACE_OK;
+	buf->trace = NULL;
+	buf->trace_t0 = 0;
+	buf->rpos = 0;
+	buf->rlen = 0;
+	memset(&buf->wstat, 0, sizeof(buf->wstat));
+	memset(&buf->lstat, 0, sizeof(buf->lstat));
+	buf->bufsize = 0;
+	buf->read_max = 0;
+	buf->serial[0] = 0;
+	buf->buf = NULL;
+	buf->wbuf = NULL;
+	buf->wlen = 0;
+	buf->xbuf = NULL;
+	if (!icdi_set_pktsize(buf, PKTSIZE_DEFAULT)) {
+		close(port);
+		free(buf);
+		return NULL;
+	}
+	return buf;
+}
+
+/*
+ * A tty or pty: locked for exclusive use and put in raw mode, the
+ * timing is left to poll() rather than VMIN/VTIME.
+ */
+static int link_open_tty(const char *path)
+{
+	int port;
 	struct termios ctltio;
+	struct serial_struct serial;
 
-	port = open(serial_port, O_RDWR|O_NOCTTY);
+	port = open(path, O_RDWR|O_NOCTTY|O_NONBLOCK);
 	if (port == -1) {
-		fprintf(stderr, "Cannot open \"%s\"->%s\n", serial_port, strerror(errno));
-		return NULL;
+		fprintf(stderr, "Cannot open \"%s\"->%s\n", path, strerror(errno));
+		return -1;
+	}
+	/* the lock goes away with the descriptor, even if the tool crashes */
+	if (flock(port, LOCK_EX|LOCK_NB) == -1) {
+		if (errno == EWOULDBLOCK)
+			fprintf(stderr, "ICDI port %s is being locked.\n",
+				path);
+		else
+			fprintf(stderr, "Cannot lock \"%s\"->%s\n",
+				path, strerror(errno));
+		close(port);
+		return -1;
 	}
+	if (!isatty(port))
+		return port;
 
-	bzero(&ctltio, sizeof(ctltio));
-	ctltio.c_iflag = IGNBRK;
-	ctltio.c_cflag = CS8 | CLOCAL | CREAD;
+	if (tcgetattr(port, &ctltio) == -1) {
+		fprintf(stderr, "tcgetattr failed for %s: %s\n", path,
+			strerror(errno));
+		close(port);
+		return -1;
+	}
+	cfmakeraw(&ctltio);
+	ctltio.c_cflag |= CLOCAL | CREAD;
+	ctltio.c_cflag &= ~CRTSCTS;
 	ctltio.c_cc[VMIN] = 1;
-	ctltio.c_cc[VTIME] = 2;
-	sysret = tcsetattr(port, TCSANOW, &ctltio);
-	if (sysret == -1) {
-		fprintf(stderr, "tcgetattr failed for %s: %s\n", serial_port, strerror(errno));
+	ctltio.c_cc[VTIME] = 0;
+	cfsetspeed(&ctltio, B115200);
+	if (tcsetattr(port, TCSANOW, &ctltio) == -1) {
+		fprintf(stderr, "tcsetattr failed for %s: %s\n", path,
+			strerror(errno));
+		close(port);
+		return -1;
+	}
+	/* not every driver knows low latency, it only saves time */
+	if (ioctl(port, TIOCGSERIAL, &serial) == 0) {
+		serial.flags |= ASYNC_LOW_LATENCY;
+		ioctl(port, TIOCSSERIAL, &serial);
+	}
+	tcflush(port, TCIOFLUSH);
+	return port;
+}
+
+/* "host:port" of a serial server or a stand-in */
+static int link_open_tcp(const char *hostport)
+{
+	struct addrinfo hints, *res, *ai;
+	char host[128];
+	const char *service;
+	int sock, sysret, one;
+
+	service = strrchr(hostport, ':');
+	if (!service || service - hostport >= sizeof(host)) {
+		fprintf(stderr, "Invalid address \"%s\", host:port expected\n",
+			hostport);
+		return -1;
+	}
+	memcpy(host, hostport, service - hostport);
+	host[service - hostport] = 0;
+	service++;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	sysret = getaddrinfo(host, service, &hints, &res);
+	if (sysret != 0) {
+		fprintf(stderr, "Cannot resolve \"%s\"->%s\n", hostport,
+			gai_strerror(sysret));
+		return -1;
+	}
+	sock = -1;
+	for (ai = res; ai; ai = ai->ai_next) {
+		sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (sock == -1)
+			continue;
+		if (connect(sock, ai->ai_addr, ai->ai_addrlen) == 0)
+			break;
+		close(sock);
+		sock = -1;
+	}
+	freeaddrinfo(res);
+	if (sock == -1) {
+		fprintf(stderr, "Cannot connect to \"%s\"->%s\n", hostport,
+			strerror(errno));
+		return -1;
+	}
+	/* packets are small and every one waits for its reply */
+	one = 1;
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	return sock;
+}
+
+/* a descriptor inherited from the parent, e.g. one end of a socketpair */
+static int link_open_fd(const char *num)
+{
+	char *end;
+	int fd;
+
+	fd = strtol(num, &end, 10);
+	if (*num == 0 || *end != 0 || fcntl(fd, F_GETFD) == -1) {
+		fprintf(stderr, "Invalid descriptor \"%s\"\n", num);
+		return -1;
+	}
+	return fd;
+}
+
+/* USB serial number of the device of the tty called name, from sysfs */
+static void sysfs_serial(const char *name, char *serial, int len)
+{
+	char sysfs[PATH_MAX];
+	FILE *f;
+
+	serial[0] = 0;
+	snprintf(sysfs, sizeof(sysfs), "/sys/class/tty/%s/device/../serial",
+		name);
+	f = fopen(sysfs, "r");
+	if (!f)
+		return;
+	if (fgets(serial, len, f))
+		serial[strcspn(serial, "\n")] = 0;
+	else
+		serial[0] = 0;
+	fclose(f);
+}
+
+/*
+ * USB serial number of the adapter behind a tty. Left empty for ptys
+ * and other ttys that are not USB devices.
+ */
+static void tty_serial(const char *path, char *serial, int len)
+{
+	char real[PATH_MAX];
+	const char *name;
+
+	serial[0] = 0;
+	if (!realpath(path, real))
+		return;
+	name = strrchr(real, '/');
+	sysfs_serial(name? name + 1 : real, serial, len);
+}
+
+static const struct icdi_link {
+	const char *prefix;
+	int (*open)(const char *spec);
+} icdi_links[] = {
+	{LINK_TCP, link_open_tcp},
+	{LINK_FD, link_open_fd},
+	{"", link_open_tty},
+};
+
+/*
+ * Open the adapter behind serial_port, a tty or pty path or one of the
+ * LINK_* specs, and set its descriptor non-blocking so that every
+ * exchange honours its deadline.
+ */
+static struct icdibuf *open_port(const char *serial_port, int esize)
+{
+	const struct icdi_link *link;
+	struct icdibuf *buf;
+	int port, flags;
+
+	for (link = icdi_links; strncmp(serial_port, link->prefix,
+				strlen(link->prefix)) != 0; link++)
+		;
+	port = link->open(serial_port + strlen(link->prefix));
+	if (port == -1)
+		return NULL;
+	flags = fcntl(port, F_GETFL);
+	if (flags == -1 || fcntl(port, F_SETFL, flags|O_NONBLOCK) == -1) {
+		fprintf(stderr, "Cannot set \"%s\" non-blocking: %s\n",
+			serial_port, strerror(errno));
+		close(port);
 		return NULL;
 	}
-	buf = malloc(sizeof(struct icdibuf));
+	buf = icdi_alloc(port, esize);
 	if (!buf)
-		fprintf(stderr, "Out of Memory!\n");
-	else {
-		buf->port = port;
-		buf->len = 0;
-		buf->esize = esize;
+		return NULL;
+	if (*link->prefix == 0)
+		tty_serial(serial_port, buf->serial, sizeof(buf->serial));
+	return buf;
+}
+
+/* open the adapter and start its trace */
+struct icdibuf *icdi_open_port(const char *serial_port, int esize)
+{
+	struct icdibuf *buf;
+
+	buf = open_port(serial_port, esize);
+	if (buf)
+		trace_open(buf, serial_port);
+	return buf;
+}
+
+/*
+ * Open serial_port through the icdid daemon. Returns NULL, silently,
+ * when no daemon listens on ICDID_SOCKET or $ICDID_SOCKET.
+ */
+static struct icdibuf *icdi_open_remote(const char *serial_port, int esize)
+{
+	struct sockaddr_un addr;
+	struct icdid_req req;
+	struct icdid_rep rep;
+	struct icdibuf *buf;
+	struct iovec iov[2];
+	const char *path, *prio;
+	int sock, flags;
+
+	path = getenv("ICDID_SOCKET");
+	if (!path)
+		path = ICDID_SOCKET;
+	if (strlen(path) >= sizeof(addr.sun_path))
+		return NULL;
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock == -1)
+		return NULL;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		close(sock);
+		return NULL;
+	}
+
+	memset(&req, 0, sizeof(req));
+	req.op = ICDID_OPEN;
+	req.prio = ICDID_PRIO_DEFAULT;
+	prio = getenv("ICDID_PRIO");
+	if (prio)
+		req.prio = strtol(prio, NULL, 0);
+	req.hlen = strlen(serial_port);
+	iov[0].iov_base = &req;
+	iov[0].iov_len = sizeof(req);
+	iov[1].iov_base = (char *)serial_port;
+	iov[1].iov_len = req.hlen;
+	/* blocking: waiting for another client to give up the adapter */
+	if (writev_all(sock, iov, 2, 0) == -1 ||
+			read_full(sock, &rep, sizeof(rep), 0) == -1) {
+		fprintf(stderr, "icdid at %s not responding\n", path);
+		close(sock);
+		return NULL;
 	}
+	if (rep.status < 0) {
+		fprintf(stderr, "icdid cannot open \"%s\"\n", serial_port);
+		close(sock);
+		return NULL;
+	}
+	/* from now on every exchange honours its deadline */
+	flags = fcntl(sock, F_GETFL);
+	if (flags == -1 || fcntl(sock, F_SETFL, flags|O_NONBLOCK) == -1) {
+		fprintf(stderr, "Cannot set the icdid socket non-blocking: " \
+			"%s\n", strerror(errno));
+		close(sock);
+		return NULL;
+	}
+	buf = icdi_alloc(sock, esize);
+	if (!buf)
+		return NULL;
+	buf->remote = 1;
+	buf->prio = req.prio;
 	return buf;
 }
 
-int icdi_readu32(struct icdibuf *buf, uint32_t addr, uint32_t *val)
+struct icdibuf *icdi_init(const char *serial_port, int esize)
 {
-	buf->len = sprintf(buf->buf, "%cx%08x,4", START, addr);
-	sendrecv(buf);
-	*val = buf->bdat.u32[0];
-	return buf->bdat.O == 'O' && buf->bdat.K == 'K';
+	struct icdibuf *buf;
+
+	buf = icdi_open_remote(serial_port, esize);
+	if (!buf)
+		buf = icdi_open_port(serial_port, esize);
+	return buf;
 }
 
-int icdi_readbin(struct icdibuf *buf, uint32_t addr, int len, char *binstr)
+/* the session is not hung up and answers a version query */
+static int session_alive(struct icdibuf *buf, int timeout_ms)
 {
-	int rlen;
+	struct pollfd pfd;
+	char ver[64];
+	int saved, alive;
 
-	if (len > BUFSIZ - 128) {
-		fprintf(stderr, "chunk too large: %d -- %d\n", len, BUFSIZ);
+	pfd.fd = buf->port;
+	pfd.events = 0;
+	if (poll(&pfd, 1, 0) == 1 &&
+			(pfd.revents & (POLLHUP|POLLERR|POLLNVAL)))
 		return 0;
+	saved = buf->timeout_ms;
+	if (buf->timeout_ms > timeout_ms)
+		buf->timeout_ms = timeout_ms;
+	alive = icdi_version(buf, ver, sizeof(ver)) > 0;
+	buf->timeout_ms = saved;
+	return alive;
+}
+
+/* the node the adapter was opened at, to tell a new one from it */
+struct node_id {
+	ino_t lino;	/* of a symbolic link to the node */
+	ino_t ino;
+	dev_t rdev;
+};
+
+static void node_id(const char *path, struct node_id *id)
+{
+	struct stat mstat;
+
+	memset(id, 0, sizeof(*id));
+	if (lstat(path, &mstat) == 0)
+		id->lino = mstat.st_ino;
+	if (stat(path, &mstat) == 0) {
+		id->ino = mstat.st_ino;
+		id->rdev = mstat.st_rdev;
+	}
+}
+
+/*
+ * Where the adapter is back: the tty with its serial number, or
+ * serial_port once it names a node other than the old one. The old node
+ * lingers for a moment after the adapter drops off the bus.
+ */
+static int find_port(const char *serial_port, const char *serial,
+		const struct node_id *old, char *path, int len)
+{
+	struct node_id id;
+	struct dirent *de;
+	char sn[64];
+	DIR *dir;
+	int found;
+
+	if (!serial[0]) {
+		node_id(serial_port, &id);
+		snprintf(path, len, "%s", serial_port);
+		return id.ino && (id.lino != old->lino || id.ino != old->ino ||
+			id.rdev != old->rdev);
+	}
+	dir = opendir("/sys/class/tty");
+	if (!dir)
+		return 0;
+	found = 0;
+	while (!found && (de = readdir(dir))) {
+		if (de->d_name[0] == '.')
+			continue;
+		sysfs_serial(de->d_name, sn, sizeof(sn));
+		if (strcmp(sn, serial) != 0)
+			continue;
+		snprintf(path, len, "/dev/%s", de->d_name);
+		node_id(path, &id);
+		found = id.ino && (id.ino != old->ino || id.rdev != old->rdev);
+	}
+	closedir(dir);
+	return found;
+}
+
+/*
+ * Wait until the adapter that dropped off the bus is back and open it.
+ * inotify on the directory of its node wakes the wait as soon as the
+ * node is created or udev has set it up; it is looked for every
+ * RECONNECT_POLL_MS anyway, in case the watch misses it.
+ */
+static struct icdibuf *reopen_port(const char *serial_port,
+		const char *serial, const struct node_id *old, int esize,
+		uint64_t deadline)
+{
+	char path[PATH_MAX], dir[PATH_MAX];
+	struct icdibuf *buf;
+	struct pollfd pfd;
+	char events[4096];
+	uint64_t now;
+	char *slash;
+	int wait;
+
+	snprintf(dir, sizeof(dir), "%s", serial[0]? "/dev" : serial_port);
+	slash = strrchr(dir, '/');
+	if (slash == dir)
+		dir[1] = 0;
+	else if (slash)
+		*slash = 0;
+	else
+		strcpy(dir, ".");
+	pfd.fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+	pfd.events = POLLIN;
+	if (pfd.fd != -1 && inotify_add_watch(pfd.fd, dir,
+				IN_CREATE|IN_ATTRIB|IN_MOVED_TO) == -1) {
+		close(pfd.fd);
+		pfd.fd = -1;
+	}
+	buf = NULL;
+	/* watch first, then look, so that nothing slips in between */
+	while (!buf) {
+		if (find_port(serial_port, serial, old, path, sizeof(path)) &&
+				access(path, R_OK|W_OK) == 0)
+			buf = open_port(path, esize);
+		now = icdi_now_us();
+		if (buf || now >= deadline)
+			break;
+		wait = (deadline - now + 999) / 1000;
+		if (wait > RECONNECT_POLL_MS)
+			wait = RECONNECT_POLL_MS;
+		if (poll(&pfd, 1, wait) > 0)
+			while (read(pfd.fd, events, sizeof(events)) > 0)
+				;
 	}
+	if (pfd.fd != -1)
+		close(pfd.fd);
+	return buf;
+}
+
+/*
+ * Get back to the adapter after a chip reset. If the session still
+ * answers it is kept; otherwise the adapter dropped off the bus, and it
+ * is waited for until timeout_ms is up: found again by its USB serial
+ * number under whatever tty name it comes back as, or at serial_port.
+ * Sessions through icdid or a LINK_* spec are simply opened again. The
+ * link counters and the trace carry over to the new session. Returns 1
+ * with *pbuf the session to go on with, 0 with *pbuf still the dead
+ * one.
+ */
+int icdi_reconnect(struct icdibuf **pbuf, const char *serial_port,
+		int timeout_ms)
+{
+	struct icdibuf *buf = *pbuf, *nbuf;
+	struct node_id old;
+	uint64_t deadline;
+	char serial[64];
 
-	buf->len = sprintf(buf->buf, "%cx%08x,%x", START, addr, len);
+	deadline = icdi_now_us() + timeout_ms * 1000ull;
+	if (session_alive(buf, RECONNECT_PROBE_MS))
+		return 1;
+	snprintf(serial, sizeof(serial), "%s", buf->serial);
+	node_id(serial_port, &old);
+	close(buf->port);
+	buf->port = -1;
+	/* the new session takes over the trace rather than opening one */
+	nbuf = NULL;
+	if (buf->remote || icdi_link_spec(serial_port)) {
+		while (!(nbuf = icdi_open_remote(serial_port, buf->esize)) &&
+				!(nbuf = open_port(serial_port, buf->esize)) &&
+				icdi_now_us() < deadline)
+			usleep(RECONNECT_POLL_MS * 1000);
+	} else {
+		nbuf = reopen_port(serial_port, serial, &old, buf->esize,
+			deadline);
+		/* the old node may have been fine after all */
+		if (!nbuf)
+			nbuf = open_port(serial_port, buf->esize);
+	}
+	if (!nbuf)
+		return 0;
+	nbuf->lstat = buf->lstat;
+	nbuf->wstat = buf->wstat;
+	nbuf->trace = buf->trace;
+	nbuf->trace_t0 = buf->trace_t0;
+	buf->trace = NULL;
+	icdi_exit(buf);
+	*pbuf = nbuf;
+	return 1;
+}
+
+int icdi_readu32(struct icdibuf *buf, uint32_t addr, uint32_t *val)
+{
+	int rlen;
+
+	buf->len = sprintf(buf->buf, "%cx%08x,4", START, addr);
 	rlen = sendrecv(buf);
-	if (rlen <= 0 || buf->bdat.O != 'O' || buf->bdat.K != 'K') {
-		fprintf(stderr, "Memory read failed\n");
+	if (!icdi_reply_ok(buf, rlen) || rlen < 7 + 4) {
+		buf->halted = 0;
 		return 0;
 	}
-	memcpy(binstr, buf->bdat.u8, buf->len-7);
-	return buf->len-7;
+	*val = buf->bdat->u32[0];
+	return 1;
+}
+
+int icdi_readbin(struct icdibuf *buf, uint32_t addr, int len, char *binstr)
+{
+	int rlen, xlen, pos;
+
+	for (pos = 0; pos < len; pos += rlen) {
+		xlen = len - pos;
+		if (xlen > icdi_read_max(buf))
+			xlen = icdi_read_max(buf);
+		buf->len = sprintf(buf->buf, "%cx%08x,%x", START, addr + pos,
+				xlen);
+		rlen = sendrecv(buf);
+		if (!icdi_reply_ok(buf, rlen)) {
+			buf->halted = 0;
+			fprintf(stderr, "Memory read failed\n");
+			break;
+		}
+		rlen = buf->len - 7;
+		if (rlen > xlen)
+			rlen = xlen;
+		memcpy(binstr + pos, buf->bdat->u8, rlen);
+		/* a short reply is the adapter's limit, ask for the rest */
+		if (rlen == 0)
+			break;
+	}
+	return pos;
+}
+
+/*
+ * Read cnt registers at addrs into vals. Entries whose addresses follow
+ * each other word by word are fetched with a single 'x' packet, so a
+ * list sorted by address costs one round trip per contiguous block.
+ * Returns the number of registers read; on a failure the rest of vals
+ * is left untouched.
+ */
+int icdi_readv(struct icdibuf *buf, const uint32_t *addrs, uint32_t *vals,
+		int cnt)
+{
+	int i, k, n, len;
+
+	for (i = 0; i < cnt; i += n) {
+		for (n = 1; i + n < cnt; n++)
+			if (addrs[i+n] != addrs[i] + 4*n)
+				break;
+		len = icdi_readbin(buf, addrs[i], 4*n, (char *)(vals + i));
+		for (k = 0; k < len/4; k++)
+			u32_le2cpu(vals + i + k);
+		if (len != 4*n)
+			return i + len/4;
+	}
+	return cnt;
 }
 
 int icdi_writeu32(struct icdibuf *buf, uint32_t addr, uint32_t val)
 {
 	uint32_t rval;
-	int idx;
+	int dlen, rlen;
 
 	rval = val;
-	idx = sprintf(buf->buf, "%cX%08x,4:", START, addr);
+	buf->len = sprintf(buf->buf, "%cX%08x,4:", START, addr);
 	u32_cpu2le(&rval);
-	memcpy(buf->buf+idx, &rval, sizeof(val));
-	buf->len = idx + sizeof(val);
-	sendrecv(buf);
-	return buf->bdat.O == 'O' && buf->bdat.K == 'K';
+	dlen = sizeof(rval);
+	rlen = sendrecv_bin(buf, (const char *)&rval, &dlen);
+	if (!icdi_reply_ok(buf, rlen)) {
+		buf->halted = 0;
+		return 0;
+	}
+	return 1;
+}
+
+int icdi_writebin(struct icdibuf *buf, uint32_t addr, const char *binstr,
+		int len)
+{
+	int pos, cklen, olen, rlen;
+	uint8_t sum;
+
+	for (pos = 0; pos < len; pos += cklen) {
+		/* the header states the length, so size the packet first */
+		buf->len = sprintf(buf->buf, "%cX%08x,%04x:", START, addr + pos,
+				len - pos > 0xffff? 0xffff : len - pos);
+		sum = 0;
+		cklen = icdi_escape(binstr + pos, len - pos, buf->wbuf,
+				buf->pktsize - buf->len - END_LEN, &olen, &sum);
+		if (cklen == 0)
+			return 0;
+		buf->len = sprintf(buf->buf, "%cX%08x,%x:", START, addr + pos,
+				cklen);
+		rlen = sendrecv_bin(buf, binstr + pos, &cklen);
+		if (cklen == 0 || !icdi_reply_ok(buf, rlen)) {
+			buf->halted = 0;
+			return 0;
+		}
+	}
+	return 1;
 }
 
 int icdi_stop_target(struct icdibuf *buf)
@@ -268,7 +1682,7 @@ int icdi_stop_target(struct icdibuf *buf)
 
 	buf->len = sprintf(buf->buf, "%c?", START);
 	idx = sendrecv(buf);
-	return buf->bdat.O == 'S' && idx == 7;
+	return buf->bdat->O == 'S' && idx == 7;
 }
 
 int icdi_flash_erase(struct icdibuf *buf, uint32_t addr, int len)
@@ -279,22 +1693,33 @@ int icdi_flash_erase(struct icdibuf *buf, uint32_t addr, int len)
 		return 0;
 	}
 	buf->len = sprintf(buf->buf, "%cvFlashErase:%08x,%08x", START, addr, len);
-	sendrecv(buf);
-	return buf->bdat.O == 'O' && buf->bdat.K == 'K';
+	if (!icdi_reply_ok(buf, sendrecv(buf))) {
+		buf->halted = 0;
+		return 0;
+	}
+	return 1;
 }
 
 int icdi_flash_write(struct icdibuf *buf, uint32_t addr, char *binstr, int len)
 {
-	int idx;
+	int pos, cklen, rlen;
 
 	if ((addr % buf->esize) != 0) {
 		fprintf(stderr, "Address is not divisible by %d\n",
 			buf->esize);
 		return 0;
 	}
-	idx = sprintf(buf->buf, "%cvFlashWrite:%08x:", START, addr);
-	memcpy(buf->buf+idx, binstr, len);
-	buf->len = idx + len;
-	sendrecv(buf);
-	return buf->bdat.O == 'O' && buf->bdat.K == 'K';
+	for (pos = 0; pos < len; pos += cklen) {
+		buf->len = sprintf(buf->buf, "%cvFlashWrite:%08x:", START,
+				addr + pos);
+		cklen = len - pos;
+		rlen = sendrecv_bin(buf, binstr + pos, &cklen);
+		if (cklen == 0)
+			return 0;
+		if (!icdi_reply_ok(buf, rlen)) {
+			buf->halted = 0;
+			return 0;
+		}
+	}
+	return 1;
 }
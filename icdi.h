@@ -1,13 +1,19 @@
 #ifndef ICDI_DSCAO__
 #define ICDI_DSCAO__
+#include <stdio.h>
 #include <stdint.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #define FLASH_BLOCK_SIZE 512
 #define FLASH_ERASE_SIZE 1024
 /* Prefix + potentially every flash byte escaped */
 #define BUFSIZE 2176  /* 128 + 2048 */
+/* Packet size assumed until the adapter reports its own in qSupported */
+#define PKTSIZE_DEFAULT	(BUFSIZE - 128)
+#define PKTSIZE_MAX	65536
 
 #define START	'$'
 #define END	'#'
@@ -17,6 +23,80 @@
 #define START_LEN	1
 #define END_LEN		3 
 
+#define RBUFSIZE	512
+#define READ_PROBE_MAX	16384	/* first x read size tried by the probe */
+/* corrupted replies answered with '-' before giving up */
+#define MAX_NAKS	5
+/* deadline of one packet exchange, $ICDI_TIMEOUT_MS overrides it */
+#define TIMEOUT_MS_DEFAULT	5000
+/*
+ * icdi_reconnect(): how long an adapter may take to come back, how long
+ * a live session has to answer, and how often to look for the adapter
+ * between inotify events
+ */
+#define RECONNECT_MS_DEFAULT	10000
+#define RECONNECT_PROBE_MS	500
+#define RECONNECT_POLL_MS	250
+
+/*
+ * Adapter links other than a tty or pty path: "tcp:host:port" for a
+ * serial server or a stand-in, "fd:N" for an inherited descriptor such
+ * as one end of a socketpair.
+ */
+#define LINK_TCP	"tcp:"
+#define LINK_FD		"fd:"
+
+/*
+ * Packet trace, written when $ICDI_TRACE names a file, or a directory
+ * to get one <port>.trace per adapter. Each file is locked by the
+ * session tracing to it; further adapters given the same file trace to
+ * <file>.<port>. A struct icdi_trace_hdr is
+ * followed by one record per packet, each a struct icdi_trace_rec and
+ * len payload bytes: the packet without '$', '#xx' and escapes.
+ */
+#define TRACE_MAGIC	"ICDITRC1"
+
+struct icdi_trace_hdr {
+	char magic[8];
+	uint64_t start;		/* wall clock, us since the epoch */
+};
+
+enum trace_dir {
+	TRACE_TX = '>',
+	TRACE_RX = '<',
+};
+
+enum trace_status {
+	TRACE_OK,
+	TRACE_NOACK,		/* sent but never acknowledged */
+	TRACE_BADSUM,		/* reply corrupted after MAX_NAKS, or once
+				   for a request not safe to resend */
+	TRACE_TIMEOUT,
+	TRACE_ERROR,
+};
+
+struct icdi_trace_rec {
+	uint64_t usecs;		/* since the trace started, monotonic */
+	uint32_t len;
+	uint8_t dir;
+	uint8_t retries;	/* retransmissions, or replies NAKed */
+	uint8_t status;
+	uint8_t pad;
+};
+
+enum rxstate {
+	RX_IDLE, RX_DATA, RX_ESC, RX_RLE, RX_CSUM1, RX_CSUM2,
+	RX_DONE, RX_BADSUM, RX_OVERFLOW
+};
+
+/* incremental decoder of received packets */
+struct icdi_rx {
+	enum rxstate state;
+	int len;	/* bytes stored in the output so far */
+	uint8_t sum;	/* sum of the raw bytes between '$' and '#' */
+	uint8_t xsum;	/* checksum from the trailer */
+};
+
 struct bindat {
 	char dollar;
 	char O;
@@ -28,58 +108,200 @@ struct bindat {
 		uint32_t u32[0];
 	};
 } __attribute__((packed));
+/* statistics of the waits for the target to become ready */
+struct icdi_waitstat {
+	unsigned int waits;	/* waits that had to poll the target */
+	unsigned int skips;	/* waits skipped, target known to be halted */
+	unsigned int polls;
+	unsigned int last_polls;
+	uint64_t usecs;
+	uint64_t max_usecs;
+	uint64_t last_usecs;
+};
+
+/* traffic of a session, for job metrics */
+struct icdi_linkstat {
+	unsigned long packets;	/* request/reply exchanges */
+	unsigned long retries;	/* retransmissions and replies NAKed */
+	unsigned long failures;	/* exchanges that got no valid reply */
+	unsigned long timeouts;	/* failures by timeout */
+	uint64_t bytes_out;
+	uint64_t bytes_in;
+};
+
 struct icdibuf {
-	int port;
+	int port;	/* the tty, or the socket to icdid when remote */
+	int remote;
+	int prio;	/* priority waiting for the adapter in icdid */
 	int len;
 	int esize;
+	int halted;	/* core proved halted, no operation failed since */
+	int noack;	/* QStartNoAckMode accepted, no '+'/'-' exchanged */
+	int timeout_ms;
+	uint64_t deadline;	/* of the exchange in progress, icdi_now_us() */
+	int retries;	/* of the last packet sent or received */
+	int tstatus;	/* enum trace_status of the same */
+	FILE *trace;
+	uint64_t trace_t0;
+	int rpos, rlen;	/* unconsumed bytes of rbuf */
+	struct icdi_waitstat wstat;
+	struct icdi_linkstat lstat;
+	int pktsize;	/* largest packet accepted, '$' and '#xx' included */
+	int read_max;	/* probed x read size, 0 to derive from pktsize */
+	char serial[64];	/* USB serial number of the adapter, if known */
+	int bufsize;	/* allocated size of buf and wbuf */
 	union {
-		char buf[BUFSIZE];
-		struct bindat bdat;
+		char *buf;
+		struct bindat *bdat;
 	};
-	char wbuf[BUFSIZE];
+	char *wbuf;	/* the framed packet last sent */
+	int wlen;
+	char *xbuf;	/* reply being decoded, swapped with buf once good */
+	char rbuf[RBUFSIZE];
+};
+
+/*
+ * icdid keeps adapter sessions open and serves them over a unix socket.
+ * ICDID_OPEN waits until the adapter is free and keeps it for the
+ * client until the socket is closed. Every other request is one packet:
+ * the header as built in buf->buf followed by the binary data, and the
+ * reply is the decoded packet.
+ */
+#define ICDID_SOCKET	"/run/icdid.sock"
+#define ICDID_PRIO_DEFAULT	128
+
+enum icdid_op {
+	ICDID_OPEN = 1,		/* header is the device path */
+	ICDID_PACKET,
+};
+
+struct icdid_req {
+	uint8_t op;
+	uint8_t prio;		/* higher is served first */
+	uint16_t hlen;		/* header bytes following */
+	uint32_t dlen;		/* data bytes following the header */
 };
 
+struct icdid_rep {
+	int32_t status;		/* reply bytes following, -1 on failure */
+	uint32_t dlen;		/* data bytes carried by the packet */
+};
+
+/*
+ * The packet starting with '$' only reads, so sending it again cannot
+ * change the target: memory reads and queries other than monitor
+ * commands, which may reset or resume the core.
+ */
+static inline int icdi_idempotent(const char *pkt)
+{
+	static const char rcmd[] = "qRcmd,";
+	const char *cmd = pkt + START_LEN;
+
+	if (*cmd == 'x')
+		return 1;
+	return *cmd == 'q' && strncmp(cmd, rcmd, sizeof(rcmd) - 1) != 0;
+}
+
+/* true when spec names a link rather than a device node */
+static inline int icdi_link_spec(const char *spec)
+{
+	return strncmp(spec, LINK_TCP, strlen(LINK_TCP)) == 0 ||
+		strncmp(spec, LINK_FD, strlen(LINK_FD)) == 0;
+}
+
 struct icdibuf *icdi_init(const char *serial_port, int esize);
+struct icdibuf *icdi_open_port(const char *serial_port, int esize);
+int icdi_reconnect(struct icdibuf **pbuf, const char *serial_port,
+		int timeout_ms);
+int icdi_transact(struct icdibuf *buf, const char *data, int *dlen);
 static inline void icdi_exit(struct icdibuf *buf)
 {
 	close(buf->port);
+	if (buf->trace)
+		fclose(buf->trace);
+	free(buf->xbuf);
+	free(buf->wbuf);
+	free(buf->buf);
 	free(buf);
 };
 
+int icdi_escape(const char *inbuf, int len, char *outbuf, int room,
+		int *olen, uint8_t *sum);
+uint8_t icdi_checksum(const char *data, int len);
+void icdi_hex2str(const char *hex, int xlen, char *str, int size);
+
+void icdi_rx_init(struct icdi_rx *rx);
+int icdi_rx_feed(struct icdi_rx *rx, const char *in, int len, char *out,
+		int size);
+
 int icdi_qRcmd(struct icdibuf *buf, const char *cmd);
 int icdi_version(struct icdibuf *buf, char *ver, int len);
 int icdi_qSupported(struct icdibuf *buf, char *options, int len);
+int icdi_set_pktsize(struct icdibuf *buf, int pktsize);
+int icdi_set_read_max(struct icdibuf *buf, int read_max);
+int icdi_probe_read_max(struct icdibuf *buf);
+/*
+ * Largest x read asked for in one packet: as probed or set, otherwise
+ * what fits a packet even if every byte is escaped.
+ */
+static inline int icdi_read_max(const struct icdibuf *buf)
+{
+	return buf->read_max > 0? buf->read_max : (buf->pktsize - 7) / 2;
+}
+/* the exchange returning retlen got a reply, and it starts with OK */
+static inline int icdi_reply_ok(const struct icdibuf *buf, int retlen)
+{
+	return retlen > 0 && buf->bdat->O == 'O' && buf->bdat->K == 'K';
+}
 static inline int icdi_debug_sreset(struct icdibuf *buf)
 {
-	icdi_qRcmd(buf, "debug sreset");
-	return buf->bdat.O = 'O' && buf->bdat.K == 'K';
+	buf->halted = 0;
+	return icdi_reply_ok(buf, icdi_qRcmd(buf, "debug sreset"));
 };
 static inline int icdi_debug_creset(struct icdibuf *buf)
 {
-	icdi_qRcmd(buf, "debug creset");
-	return buf->bdat.O = 'O' && buf->bdat.K == 'K';
+	buf->halted = 0;
+	return icdi_reply_ok(buf, icdi_qRcmd(buf, "debug creset"));
 };
 static inline int icdi_chip_reset(struct icdibuf *buf)
 {
-	icdi_qRcmd(buf, "debug hreset");
-	return buf->bdat.O = 'O' && buf->bdat.K == 'K';
+	buf->halted = 0;
+	return icdi_reply_ok(buf, icdi_qRcmd(buf, "debug hreset"));
 };
 static inline int debug_clock(struct icdibuf *buf)
 {
 	static const char *cmd = "debug clock";
 
-	icdi_qRcmd(buf, cmd);
-	return buf->buf[1] == 'O' && buf->buf[2] == 'K';
+	return icdi_reply_ok(buf, icdi_qRcmd(buf, cmd));
+}
+
+/* target words are little endian, as is every host this runs on */
+static inline void u32_le2cpu(uint32_t *val)
+{
+}
+static inline void u32_cpu2le(uint32_t *val)
+{
 }
 
 int icdi_readu32(struct icdibuf *buf, uint32_t addr, uint32_t *val);
 int icdi_writeu32(struct icdibuf *buf, uint32_t addr, uint32_t val);
 
 int icdi_readbin(struct icdibuf *buf, uint32_t addr, int len, char *binstr);
+int icdi_readv(struct icdibuf *buf, const uint32_t *addrs, uint32_t *vals,
+		int cnt);
+int icdi_writebin(struct icdibuf *buf, uint32_t addr, const char *binstr,
+		int len);
 int icdi_flash_write(struct icdibuf *buf, uint32_t addr, char *binstr, int len);
 int icdi_flash_erase(struct icdibuf *buf, uint32_t addr, int len);
 
 int icdi_stop_target(struct icdibuf *buf);
 
-#define lock "icdi_lock"
+static inline uint64_t icdi_now_us(void)
+{
+	struct timespec tm;
+
+	clock_gettime(CLOCK_MONOTONIC, &tm);
+	return (uint64_t)tm.tv_sec * 1000000 + tm.tv_nsec / 1000;
+}
+
 #endif /* ICDI_DSCAO__ */
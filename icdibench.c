@@ -0,0 +1,451 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include "icdi.h"
+#include "simcore.h"
+
+/*
+ * icdibench: throughput of the packet codec and latency of the library
+ * calls against a simcore target on a pty. Every result is one JSON
+ * object per line on stdout; with --baseline the results are compared
+ * with an earlier run on stderr.
+ */
+
+#define BENCH_SIZE	(256*1024)
+#define BENCH_ROUNDS	64
+#define MAX_RESULTS	64
+/* change against the baseline taken as noise, in percent */
+#define BASELINE_SLACK	10.0
+
+struct result {
+	char bench[32];
+	char data[16];
+	int n;
+	double mbps;
+	double p50, p90, p99, max;	/* us, end-to-end only */
+};
+
+static struct result results[MAX_RESULTS];
+static int nresults;
+
+static void emit(const struct result *res)
+{
+	printf("{\"bench\":\"%s\"", res->bench);
+	if (res->data[0])
+		printf(",\"data\":\"%s\"", res->data);
+	if (res->n)
+		printf(",\"n\":%d,\"p50_us\":%.1f,\"p90_us\":%.1f," \
+			"\"p99_us\":%.1f,\"max_us\":%.1f", res->n, res->p50,
+			res->p90, res->p99, res->max);
+	printf(",\"mbps\":%.2f}\n", res->mbps);
+	fflush(stdout);
+	if (nresults < MAX_RESULTS)
+		results[nresults++] = *res;
+}
+
+/* throughput of the fastest round, the others lost the CPU or cache */
+static void micro(const char *bench, const char *data, int len,
+		uint64_t usecs)
+{
+	struct result res;
+
+	memset(&res, 0, sizeof(res));
+	snprintf(res.bench, sizeof(res.bench), "%s", bench);
+	snprintf(res.data, sizeof(res.data), "%s", data);
+	res.mbps = (double)len / (usecs? usecs : 1);
+	emit(&res);
+}
+
+static inline void best_round(uint64_t tm0, uint64_t *best)
+{
+	uint64_t usecs;
+
+	usecs = icdi_now_us() - tm0;
+	if (usecs < *best)
+		*best = usecs;
+}
+
+/* the escape-then-checksum pair send_down() used before fusing them */
+static int escape_ref(const char *inbuf, int len, char *outbuf, uint8_t *sum)
+{
+	const char *ibuf;
+	char *obuf, cc;
+	int i, olen;
+	uint8_t s;
+
+	ibuf = inbuf;
+	obuf = outbuf;
+	while (ibuf < inbuf + len) {
+		cc = *ibuf++;
+		if (cc == ESCAPE || cc == START || cc == END) {
+			*obuf++ = ESCAPE;
+			cc ^= 0x20;
+		}
+		*obuf++ = cc;
+	}
+	olen = obuf - outbuf;
+	s = 0;
+	for (i = 0; i < olen; i++)
+		s += outbuf[i];
+	*sum = s;
+	return olen;
+}
+
+static void bench_codec(const char *name, const char *data, int len,
+		char *out, char *wire)
+{
+	struct icdi_rx rx;
+	uint64_t tm0, best;
+	int round, olen, rlen, wlen;
+	uint8_t rsum, fsum;
+	volatile uint8_t sink;
+
+	best = UINT64_MAX;
+	for (round = 0; round < BENCH_ROUNDS; round++) {
+		tm0 = icdi_now_us();
+		rlen = escape_ref(data, len, out, &rsum);
+		best_round(tm0, &best);
+	}
+	micro("escape_2pass", name, len, best);
+
+	best = UINT64_MAX;
+	for (round = 0; round < BENCH_ROUNDS; round++) {
+		tm0 = icdi_now_us();
+		fsum = 0;
+		icdi_escape(data, len, out, 2*len, &olen, &fsum);
+		best_round(tm0, &best);
+	}
+	micro("escape", name, len, best);
+	if (rlen != olen || rsum != fsum)
+		fprintf(stderr, "%s: results differ: %d/%02x -- %d/%02x\n",
+			name, rlen, rsum, olen, fsum);
+
+	best = UINT64_MAX;
+	for (round = 0; round < BENCH_ROUNDS; round++) {
+		tm0 = icdi_now_us();
+		sink = icdi_checksum(data, len);
+		best_round(tm0, &best);
+	}
+	micro("checksum", name, len, best);
+
+	wlen = sim_frame(data, len, wire);
+	best = UINT64_MAX;
+	for (round = 0; round < BENCH_ROUNDS; round++) {
+		tm0 = icdi_now_us();
+		icdi_rx_init(&rx);
+		icdi_rx_feed(&rx, wire, wlen, out, 2*len + 8);
+		best_round(tm0, &best);
+	}
+	micro("unescape", name, len, best);
+	if (rx.state != RX_DONE || rx.len != len + START_LEN + END_LEN ||
+			memcmp(out + START_LEN, data, len) != 0)
+		fprintf(stderr, "%s: unescape mismatch\n", name);
+
+	for (olen = 0; olen < len; olen++)
+		sprintf(wire + 2*olen, "%02x", (uint8_t)data[olen]);
+	best = UINT64_MAX;
+	for (round = 0; round < BENCH_ROUNDS; round++) {
+		tm0 = icdi_now_us();
+		icdi_hex2str(wire, 2*len, out, len + 1);
+		best_round(tm0, &best);
+	}
+	micro("hex2str", name, len, best);
+	sink = out[0];
+	(void)sink;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	const uint64_t *ua = a, *ub = b;
+
+	return *ua < *ub? -1 : *ua > *ub;
+}
+
+static void latency(const char *bench, int latency_us, uint64_t *lat, int n,
+		uint64_t bytes)
+{
+	struct result res;
+	uint64_t total;
+	int i;
+
+	memset(&res, 0, sizeof(res));
+	snprintf(res.bench, sizeof(res.bench), "%s", bench);
+	snprintf(res.data, sizeof(res.data), "lat%d", latency_us);
+	for (total = 0, i = 0; i < n; i++)
+		total += lat[i];
+	qsort(lat, n, sizeof(*lat), cmp_u64);
+	res.n = n;
+	res.p50 = lat[n/2];
+	res.p90 = lat[n*90/100];
+	res.p99 = lat[n*99/100];
+	res.max = lat[n-1];
+	res.mbps = bytes? (double)bytes / (total? total : 1) : 0;
+	emit(&res);
+}
+
+/* a simcore target on a fresh pty, served by a child process */
+static struct icdibuf *start_target(int latency_us, pid_t *child)
+{
+	struct sim_target *sim;
+	struct icdibuf *buf;
+	char options[128];
+	int master;
+
+	master = posix_openpt(O_RDWR|O_NOCTTY);
+	if (master == -1 || grantpt(master) == -1 || unlockpt(master) == -1) {
+		fprintf(stderr, "Cannot create a pty: %s\n", strerror(errno));
+		return NULL;
+	}
+	*child = fork();
+	if (*child == -1) {
+		fprintf(stderr, "Cannot fork: %s\n", strerror(errno));
+		close(master);
+		return NULL;
+	} else if (*child == 0) {
+		sim = sim_alloc();
+		if (!sim)
+			_exit(1);
+		sim->latency_us = latency_us;
+		sim_serve(sim, master);
+		_exit(0);
+	}
+	buf = icdi_open_port(ptsname(master), FLASH_ERASE_SIZE);
+	close(master);
+	if (buf && !icdi_qSupported(buf, options, sizeof(options)))
+		fprintf(stderr, "No packet size from target\n");
+	return buf;
+}
+
+static void bench_link(int latency_us, char *image)
+{
+	struct icdibuf *buf;
+	uint64_t *lat, tm0;
+	uint32_t val, addr;
+	pid_t child;
+	char *rbuf;
+	int i;
+
+	buf = start_target(latency_us, &child);
+	if (!buf)
+		return;
+	lat = malloc(1000 * sizeof(*lat));
+	rbuf = malloc(BENCH_SIZE);
+	if (!lat || !rbuf) {
+		fprintf(stderr, "Out of Memory!\n");
+		goto exit_10;
+	}
+
+	for (i = 0; i < 1000; i++) {
+		tm0 = icdi_now_us();
+		if (!icdi_readu32(buf, SCSP_BASE+DID0_OFFSET, &val))
+			goto fail;
+		lat[i] = icdi_now_us() - tm0;
+	}
+	latency("readu32", latency_us, lat, 1000, 0);
+
+	for (i = 0; i < 200; i++) {
+		tm0 = icdi_now_us();
+		if (icdi_readbin(buf, (i % 64) * 4096, 4096, rbuf) != 4096)
+			goto fail;
+		lat[i] = icdi_now_us() - tm0;
+	}
+	latency("readbin_4k", latency_us, lat, 200, 200*4096);
+
+	for (i = 0; i < 100; i++) {
+		tm0 = icdi_now_us();
+		if (!icdi_flash_erase(buf, i * FLASH_ERASE_SIZE,
+					FLASH_ERASE_SIZE))
+			goto fail;
+		lat[i] = icdi_now_us() - tm0;
+	}
+	latency("flash_erase_1k", latency_us, lat, 100, 0);
+
+	for (i = 0; i < 32; i++) {
+		addr = i * 8192;
+		tm0 = icdi_now_us();
+		if (!icdi_flash_write(buf, addr, image + addr, 8192))
+			goto fail;
+		lat[i] = icdi_now_us() - tm0;
+	}
+	latency("flash_write_8k", latency_us, lat, 32, 32*8192);
+
+	/* what flashbin --erase does with a full image */
+	for (i = 0; i < 3; i++) {
+		tm0 = icdi_now_us();
+		if (!icdi_flash_erase(buf, 0, 0))
+			goto fail;
+		for (addr = 0; addr < BENCH_SIZE; addr += 8192)
+			if (!icdi_flash_write(buf, addr, image + addr, 8192))
+				goto fail;
+		lat[i] = icdi_now_us() - tm0;
+	}
+	latency("full_chip", latency_us, lat, 3, 3*BENCH_SIZE);
+	goto exit_10;
+
+fail:
+	fprintf(stderr, "Target stopped answering\n");
+exit_10:
+	free(rbuf);
+	free(lat);
+	icdi_exit(buf);
+	kill(child, SIGTERM);
+	waitpid(child, NULL, 0);
+}
+
+static double json_num(const char *line, const char *key)
+{
+	const char *pos;
+
+	pos = strstr(line, key);
+	return pos? strtod(pos + strlen(key), NULL) : -1.0;
+}
+
+static void json_str(const char *line, const char *key, char *val, int size)
+{
+	const char *pos, *end;
+
+	val[0] = 0;
+	pos = strstr(line, key);
+	if (!pos)
+		return;
+	pos += strlen(key);
+	end = strchr(pos, '"');
+	if (end && end - pos < size) {
+		memcpy(val, pos, end - pos);
+		val[end - pos] = 0;
+	}
+}
+
+/*
+ * Compare with a baseline run: the median latency of end-to-end calls,
+ * lower is better, the throughput of the codec, higher is better.
+ */
+static int compare_baseline(const char *path, double slack)
+{
+	FILE *fin;
+	char line[512], bench[32], data[16];
+	const struct result *res;
+	double old, now, change;
+	int worse;
+
+	fin = fopen(path, "r");
+	if (!fin) {
+		fprintf(stderr, "Cannot open baseline %s->%s\n", path,
+			strerror(errno));
+		return 0;
+	}
+	worse = 0;
+	fprintf(stderr, "\n%-16s %-10s %12s %12s %8s\n", "Benchmark", "Data",
+		"Baseline", "Now", "Change");
+	while (fgets(line, sizeof(line), fin)) {
+		json_str(line, "\"bench\":\"", bench, sizeof(bench));
+		json_str(line, "\"data\":\"", data, sizeof(data));
+		for (res = results; res < results + nresults; res++)
+			if (strcmp(res->bench, bench) == 0 &&
+					strcmp(res->data, data) == 0)
+				break;
+		if (bench[0] == 0 || res == results + nresults)
+			continue;
+		if (res->n) {
+			old = json_num(line, "\"p50_us\":");
+			now = res->p50;
+			change = old > 0? (old - now) / old * 100.0 : 0;
+		} else {
+			old = json_num(line, "\"mbps\":");
+			now = res->mbps;
+			change = old > 0? (now - old) / old * 100.0 : 0;
+		}
+		fprintf(stderr, "%-16s %-10s %12.1f %12.1f %+7.1f%% %s\n",
+			bench, data, old, now, change,
+			change < -slack? "WORSE" : change > slack? "better" : "");
+		if (change < -slack)
+			worse++;
+	}
+	fclose(fin);
+	fprintf(stderr, "%d benchmark(s) more than %.0f%% worse than %s\n",
+		worse, slack, path);
+	return 1;
+}
+
+int main(int argc, char *argv[])
+{
+	static const struct option lopts[] = {
+		{.name = "latency", .has_arg = required_argument, .flag = NULL, .val = 'l'},
+		{.name = "baseline", .has_arg = required_argument, .flag = NULL, .val = 'b'},
+		{.name = "micro", .has_arg = no_argument, .flag = NULL, .val = 'm'},
+		{.name = "slack", .has_arg = required_argument, .flag = NULL, .val = 's'},
+		{.name = NULL, .has_arg = 0, .flag = 0, .val = 0}
+	};
+	const char *fwfile, *baseline;
+	FILE *fin;
+	char *data, *out, *wire;
+	int len, optc, latency_us, micro_only;
+	double slack;
+
+	baseline = NULL;
+	slack = BASELINE_SLACK;
+	latency_us = 0;
+	micro_only = 0;
+	while ((optc = getopt_long(argc, argv, "l:b:ms:", lopts, NULL)) != -1) {
+		switch(optc) {
+		case 'l':
+			latency_us = strtol(optarg, NULL, 0);
+			break;
+		case 'b':
+			baseline = optarg;
+			break;
+		case 'm':
+			micro_only = 1;
+			break;
+		case 's':
+			slack = strtod(optarg, NULL);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [--latency us] [--baseline " \
+				"file] [--slack percent] [--micro] " \
+				"[firmware.bin]\n", argv[0]);
+			return 1;
+		}
+	}
+	fwfile = optind < argc? argv[optind] : "tm4c123g.bin";
+	data = malloc(BENCH_SIZE);
+	out = malloc(2*BENCH_SIZE + 8);
+	wire = malloc(2*BENCH_SIZE + 8);
+	if (!data || !out || !wire) {
+		fprintf(stderr, "Out of Memory!\n");
+		return 1000;
+	}
+
+	fin = fopen(fwfile, "rb");
+	if (!fin) {
+		fprintf(stderr, "Cannot open file: %s->%s\n", fwfile,
+			strerror(errno));
+		return 4;
+	}
+	len = fread(data, 1, BENCH_SIZE, fin);
+	fclose(fin);
+	/* repeat a short image to fill the chip */
+	if (len > 0)
+		for (; len < BENCH_SIZE; len *= 2)
+			memcpy(data + len, data, len < BENCH_SIZE - len?
+				len : BENCH_SIZE - len);
+	bench_codec("firmware", data, BENCH_SIZE, out, wire);
+	if (!micro_only)
+		bench_link(latency_us, data);
+
+	memset(data, ESCAPE, BENCH_SIZE);
+	bench_codec("all_escape", data, BENCH_SIZE, out, wire);
+
+	if (baseline)
+		compare_baseline(baseline, slack);
+	free(wire);
+	free(out);
+	free(data);
+	return 0;
+}
@@ -0,0 +1,496 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include "icdi.h"
+
+/*
+ * icdid: holds ICDI adapter sessions open and serves packets from any
+ * number of clients over a unix socket. A client owns the adapter it
+ * opened until it disconnects, so the packets of one flash or dump never
+ * interleave with another's. Clients opening an adapter in use wait in
+ * a queue ordered by priority, so a high priority client overtakes
+ * queued ones. Replies to the identification packets every tool sends
+ * at startup are cached per adapter until the adapter has to be
+ * reopened.
+ */
+
+#define MAX_CACHE	8
+#define REOPEN_TRIES	30
+#define REOPEN_WAIT_US	100000
+#define REQUEST_MS	5000	/* to read the rest of a request, or a reply */
+
+struct job {
+	char *hdr;
+	int hlen;
+	char *data;
+	int dlen;
+	/* reply */
+	int status;
+	char *reply;
+};
+
+/* a client holding or waiting for an adapter */
+struct lease {
+	struct lease *next;
+	int prio;
+};
+
+struct cache_entry {
+	char *hdr;
+	char *reply;
+	int len;
+};
+
+struct adapter {
+	struct adapter *next;
+	char *dev;
+	struct icdibuf *buf;	/* used by the owner only */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct lease *owner;
+	struct lease *waiting;
+	int ncache;
+	struct cache_entry cache[MAX_CACHE];
+};
+
+/* packets whose replies do not change while the adapter stays open */
+static const char *cacheable[] = {
+	"$qSupported",
+	"$qRcmd,76657273696f6e",	/* version */
+	"$x400fe000,4",			/* DID0 */
+	"$x400fe004,4",			/* DID1 */
+	"$x400fdfc0,4",			/* FSIZE */
+	NULL
+};
+
+static pthread_mutex_t adapters_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct adapter *adapters;
+static int verbose;
+
+static int is_cacheable(const char *hdr, int hlen)
+{
+	const char **pkt;
+
+	for (pkt = cacheable; *pkt; pkt++)
+		if (strlen(*pkt) == hlen && memcmp(*pkt, hdr, hlen) == 0)
+			return 1;
+	return 0;
+}
+
+static struct cache_entry *cache_find(struct adapter *ad, const char *hdr,
+		int hlen)
+{
+	struct cache_entry *ce;
+
+	for (ce = ad->cache; ce < ad->cache + ad->ncache; ce++)
+		if (strlen(ce->hdr) == hlen && memcmp(ce->hdr, hdr, hlen) == 0)
+			return ce;
+	return NULL;
+}
+
+static void cache_store(struct adapter *ad, const char *hdr, int hlen,
+		const char *reply, int len)
+{
+	struct cache_entry *ce;
+
+	if (ad->ncache == MAX_CACHE || cache_find(ad, hdr, hlen))
+		return;
+	ce = ad->cache + ad->ncache;
+	ce->hdr = strndup(hdr, hlen);
+	ce->reply = malloc(len);
+	if (!ce->hdr || !ce->reply) {
+		free(ce->hdr);
+		free(ce->reply);
+		return;
+	}
+	memcpy(ce->reply, reply, len);
+	ce->len = len;
+	ad->ncache++;
+}
+
+static void cache_flush(struct adapter *ad)
+{
+	struct cache_entry *ce;
+
+	for (ce = ad->cache; ce < ad->cache + ad->ncache; ce++) {
+		free(ce->hdr);
+		free(ce->reply);
+	}
+	ad->ncache = 0;
+}
+
+/* open the adapter and prime the cache with its identification */
+static struct icdibuf *adapter_open(struct adapter *ad)
+{
+	struct icdibuf *buf;
+	char options[128];
+	int tries;
+
+	for (tries = 0; tries < REOPEN_TRIES; tries++) {
+		buf = icdi_open_port(ad->dev, FLASH_ERASE_SIZE);
+		if (buf)
+			break;
+		usleep(REOPEN_WAIT_US);
+	}
+	if (!buf)
+		return NULL;
+	cache_flush(ad);
+	if (icdi_version(buf, options, sizeof(options)) > 0)
+		cache_store(ad, cacheable[1], strlen(cacheable[1]), buf->buf,
+				buf->len);
+	if (icdi_qSupported(buf, options, sizeof(options)) > 0)
+		cache_store(ad, cacheable[0], strlen(cacheable[0]), buf->buf,
+				buf->len);
+	/* sized for the largest read a client may probe for */
+	icdi_probe_read_max(buf);
+	if (verbose)
+		fprintf(stderr, "%s: opened, packet size %d, read size %d\n",
+			ad->dev, buf->pktsize, icdi_read_max(buf));
+	return buf;
+}
+
+static int run_job(struct adapter *ad, struct job *jb)
+{
+	struct cache_entry *ce;
+	struct icdibuf *buf;
+	int status, dlen, tries;
+
+	ce = cache_find(ad, jb->hdr, jb->hlen);
+	if (ce) {
+		jb->reply = malloc(ce->len);
+		if (!jb->reply)
+			return -1;
+		memcpy(jb->reply, ce->reply, ce->len);
+		jb->dlen = 0;
+		return ce->len;
+	}
+
+	/*
+	 * Only a link that is gone, timed out or failing I/O, is reopened,
+	 * and only a request that merely reads is sent again on it. Any
+	 * other failure goes back to the client: the target may have
+	 * carried the request out already.
+	 */
+	status = -1;
+	dlen = 0;
+	for (tries = 0; tries < 2 && status < 0; tries++) {
+		buf = ad->buf;
+		if (!buf) {
+			buf = ad->buf = adapter_open(ad);
+			if (!buf)
+				break;
+		}
+		if (jb->hlen >= buf->bufsize)
+			return -1;
+		memcpy(buf->buf, jb->hdr, jb->hlen);
+		buf->len = jb->hlen;
+		dlen = jb->dlen;
+		status = icdi_transact(buf, jb->data, &dlen);
+		if (status >= 0)
+			break;
+		if (buf->tstatus != TRACE_TIMEOUT &&
+				buf->tstatus != TRACE_ERROR)
+			return -1;
+		/* the adapter went away, e.g. reset; reopen it */
+		fprintf(stderr, "%s: link lost, reopening\n", ad->dev);
+		icdi_exit(buf);
+		ad->buf = NULL;
+		if (!icdi_idempotent(jb->hdr))
+			return -1;
+	}
+	if (status < 0)
+		return -1;
+	jb->dlen = dlen;
+	jb->reply = malloc(status);
+	if (!jb->reply)
+		return -1;
+	memcpy(jb->reply, ad->buf->buf, status);
+	if (is_cacheable(jb->hdr, jb->hlen) && status > 4 &&
+			ad->buf->buf[1] != 'E')
+		cache_store(ad, jb->hdr, jb->hlen, jb->reply, status);
+	return status;
+}
+
+/*
+ * Wait for the adapter to be free and take it over. Waiters are served
+ * by priority, first come first served within a priority.
+ */
+static void adapter_claim(struct adapter *ad, struct lease *ls)
+{
+	struct lease **pos;
+
+	pthread_mutex_lock(&ad->lock);
+	for (pos = &ad->waiting; *pos && (*pos)->prio >= ls->prio;
+			pos = &(*pos)->next)
+		;
+	ls->next = *pos;
+	*pos = ls;
+	while (ad->owner || ad->waiting != ls)
+		pthread_cond_wait(&ad->cond, &ad->lock);
+	ad->waiting = ls->next;
+	ad->owner = ls;
+	pthread_mutex_unlock(&ad->lock);
+}
+
+static void adapter_release(struct adapter *ad, struct lease *ls)
+{
+	pthread_mutex_lock(&ad->lock);
+	if (ad->owner == ls) {
+		ad->owner = NULL;
+		pthread_cond_broadcast(&ad->cond);
+	}
+	pthread_mutex_unlock(&ad->lock);
+}
+
+/*
+ * Find the adapter, or add it unopened. The owner opens it, so a slow
+ * open never holds up clients of other adapters.
+ */
+static struct adapter *adapter_get(const char *dev)
+{
+	struct adapter *ad;
+
+	pthread_mutex_lock(&adapters_lock);
+	for (ad = adapters; ad; ad = ad->next)
+		if (strcmp(ad->dev, dev) == 0)
+			goto exit_10;
+
+	ad = calloc(1, sizeof(struct adapter));
+	if (!ad)
+		goto exit_10;
+	ad->dev = strdup(dev);
+	if (!ad->dev) {
+		free(ad);
+		ad = NULL;
+		goto exit_10;
+	}
+	pthread_mutex_init(&ad->lock, NULL);
+	pthread_cond_init(&ad->cond, NULL);
+	ad->next = adapters;
+	adapters = ad;
+exit_10:
+	pthread_mutex_unlock(&adapters_lock);
+	return ad;
+}
+
+/* take the adapter over for the client, opening it if need be */
+static struct adapter *adapter_lease(const char *dev, struct lease *ls)
+{
+	struct adapter *ad;
+
+	ad = adapter_get(dev);
+	if (!ad)
+		return NULL;
+	adapter_claim(ad, ls);
+	if (!ad->buf)
+		ad->buf = adapter_open(ad);
+	if (!ad->buf) {
+		adapter_release(ad, ls);
+		return NULL;
+	}
+	if (verbose)
+		fprintf(stderr, "%s: leased, priority %d\n", ad->dev, ls->prio);
+	return ad;
+}
+
+/* read all len bytes before deadline, or waiting forever when it is 0 */
+static int read_full(int fd, void *data, int len, uint64_t deadline)
+{
+	struct pollfd pfd;
+	uint64_t now;
+	int retlen, pos, ready;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	for (pos = 0; pos < len; pos += retlen) {
+		retlen = 0;
+		if (deadline) {
+			now = icdi_now_us();
+			if (now >= deadline)
+				return -1;
+			ready = poll(&pfd, 1, (deadline - now + 999) / 1000);
+			if (ready == -1 && errno == EINTR)
+				continue;
+			if (ready <= 0)
+				return -1;
+		}
+		retlen = read(fd, (char *)data + pos, len - pos);
+		if (retlen == -1 && errno == EINTR)
+			retlen = 0;
+		else if (retlen <= 0)
+			return -1;
+	}
+	return len;
+}
+
+static int send_reply(int sock, int status, int dlen, const char *reply)
+{
+	struct icdid_rep rep;
+	struct iovec iov[2];
+	int iovcnt;
+
+	rep.status = status;
+	rep.dlen = dlen;
+	iov[0].iov_base = &rep;
+	iov[0].iov_len = sizeof(rep);
+	iov[1].iov_base = (char *)reply;
+	iov[1].iov_len = status > 0? status : 0;
+	iovcnt = status > 0? 2 : 1;
+	return writev(sock, iov, iovcnt) == sizeof(rep) + iov[1].iov_len;
+}
+
+static void *client_thread(void *arg)
+{
+	int sock = (long)arg;
+	struct icdid_req req;
+	struct adapter *ad;
+	struct lease ls;
+	struct job jb;
+	char *hdr, *data;
+	uint64_t deadline;
+
+	ad = NULL;
+	hdr = NULL;
+	data = NULL;
+	/* a client may idle between requests, not in the middle of one */
+	while (read_full(sock, &req, 1, 0) != -1) {
+		deadline = icdi_now_us() + REQUEST_MS * 1000ull;
+		if (read_full(sock, (char *)&req + 1, sizeof(req) - 1,
+					deadline) == -1 ||
+				req.dlen > PKTSIZE_MAX)
+			break;
+		hdr = malloc(req.hlen + 1);
+		data = malloc(req.dlen + 1);
+		if (!hdr || !data ||
+			read_full(sock, hdr, req.hlen, deadline) == -1 ||
+			read_full(sock, data, req.dlen, deadline) == -1)
+			break;
+		hdr[req.hlen] = 0;
+
+		if (req.op == ICDID_OPEN) {
+			if (ad)
+				adapter_release(ad, &ls);
+			ls.prio = req.prio;
+			ad = adapter_lease(hdr, &ls);
+			if (!send_reply(sock, ad? 0 : -1, 0, NULL))
+				break;
+		} else if (req.op == ICDID_PACKET && ad) {
+			memset(&jb, 0, sizeof(jb));
+			jb.hdr = hdr;
+			jb.hlen = req.hlen;
+			jb.data = data;
+			jb.dlen = req.dlen;
+			jb.status = run_job(ad, &jb);
+			if (!send_reply(sock, jb.status, jb.dlen, jb.reply)) {
+				free(jb.reply);
+				break;
+			}
+			free(jb.reply);
+		} else
+			break;
+		free(hdr);
+		free(data);
+		hdr = NULL;
+		data = NULL;
+	}
+	free(hdr);
+	free(data);
+	if (ad)
+		adapter_release(ad, &ls);
+	close(sock);
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	static const struct option lopts[] = {
+		{.name = "socket", .has_arg = required_argument, .flag = NULL, .val = 's'},
+		{.name = "foreground", .has_arg = no_argument, .flag = NULL, .val = 'f'},
+		{.name = "verbose", .has_arg = no_argument, .flag = NULL, .val = 'v'},
+		{.name = NULL, .has_arg = 0, .flag = 0, .val = 0}
+	};
+	const char *path;
+	struct sockaddr_un addr;
+	struct timeval sndtmo;
+	int lsock, sock, optc, foreground;
+	pthread_t thid;
+
+	path = ICDID_SOCKET;
+	foreground = 0;
+	opterr = 0;
+	while ((optc = getopt_long(argc, argv, "s:fv", lopts, NULL)) != -1) {
+		switch(optc) {
+		case 's':
+			path = optarg;
+			break;
+		case 'f':
+			foreground = 1;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [--socket path] " \
+				"[--foreground] [--verbose]\n", argv[0]);
+			return 4;
+		}
+	}
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket path too long: %s\n", path);
+		return 8;
+	}
+
+	lsock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (lsock == -1) {
+		fprintf(stderr, "Cannot create socket: %s\n", strerror(errno));
+		return 12;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	unlink(path);
+	if (bind(lsock, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+			listen(lsock, 16) == -1) {
+		fprintf(stderr, "Cannot listen on %s: %s\n", path,
+			strerror(errno));
+		return 16;
+	}
+	signal(SIGPIPE, SIG_IGN);
+	if (!foreground && daemon(0, 1) == -1) {
+		fprintf(stderr, "Cannot detach: %s\n", strerror(errno));
+		return 20;
+	}
+
+	while (1) {
+		sock = accept(lsock, NULL, NULL);
+		if (sock == -1) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "accept failed: %s\n", strerror(errno));
+			break;
+		}
+		/* a client not reading its replies must not keep its lease */
+		sndtmo.tv_sec = REQUEST_MS / 1000;
+		sndtmo.tv_usec = 0;
+		setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &sndtmo,
+			sizeof(sndtmo));
+		if (pthread_create(&thid, NULL, client_thread,
+					(void *)(long)sock) != 0) {
+			close(sock);
+			continue;
+		}
+		pthread_detach(thid);
+	}
+	close(lsock);
+	unlink(path);
+	return 0;
+}
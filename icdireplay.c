@@ -0,0 +1,483 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <termios.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "icdi.h"
+
+/*
+ * icdireplay: serve a packet trace recorded with $ICDI_TRACE back to
+ * the tools through a pty, standing in for the adapter. Requests are
+ * matched against the recorded ones in order; retransmissions, NAKed
+ * replies and timeouts happen where they happened in the trace, and
+ * with --timing the replies keep their recorded latency.
+ */
+
+#define PKT_MAX		(2*PKTSIZE_MAX)
+#define NAK_WAIT_MS	2000
+
+struct replay_rec {
+	struct icdi_trace_rec rec;
+	const char *data;
+};
+
+struct replay {
+	struct replay_rec *recs;
+	int nrec;
+	int cursor;		/* next record expected */
+	int naks;		/* NAKs sent for the request at cursor */
+	int acks;		/* acknowledge requests, until QStartNoAckMode */
+	int strict, timing;
+	int master;
+	int served, skipped, unmatched;
+	char *reply;		/* last reply sent, wire format */
+	int rlen;
+};
+
+static const char *status_names[] = {
+	"ok", "noack", "badsum", "timeout", "error"
+};
+
+static int load_trace(const char *path, struct replay *rp)
+{
+	struct icdi_trace_hdr hdr;
+	struct stat mstat;
+	const char *map, *pos, *end;
+	int fd, room;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1 || fstat(fd, &mstat) == -1) {
+		fprintf(stderr, "Cannot open trace %s->%s\n", path,
+			strerror(errno));
+		return 0;
+	}
+	if (mstat.st_size < sizeof(hdr)) {
+		fprintf(stderr, "%s: not a trace\n", path);
+		close(fd);
+		return 0;
+	}
+	map = mmap(NULL, mstat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "Cannot map trace %s->%s\n", path,
+			strerror(errno));
+		return 0;
+	}
+	memcpy(&hdr, map, sizeof(hdr));
+	if (memcmp(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic)) != 0) {
+		fprintf(stderr, "%s: not a trace\n", path);
+		return 0;
+	}
+
+	room = 0;
+	pos = map + sizeof(hdr);
+	end = map + mstat.st_size;
+	while (end - pos >= sizeof(struct icdi_trace_rec)) {
+		if (rp->nrec == room) {
+			room = room? room * 2 : 1024;
+			rp->recs = realloc(rp->recs, room * sizeof(*rp->recs));
+			if (!rp->recs) {
+				fprintf(stderr, "Out of Memory!\n");
+				return 0;
+			}
+		}
+		/* records are packed, copy the header out */
+		memcpy(&rp->recs[rp->nrec].rec, pos, sizeof(struct icdi_trace_rec));
+		pos += sizeof(struct icdi_trace_rec);
+		if (end - pos < rp->recs[rp->nrec].rec.len) {
+			fprintf(stderr, "%s: truncated after %d records\n",
+				path, rp->nrec);
+			break;
+		}
+		rp->recs[rp->nrec].data = pos;
+		pos += rp->recs[rp->nrec].rec.len;
+		rp->nrec++;
+	}
+	return 1;
+}
+
+static void dump_trace(const struct replay *rp)
+{
+	const struct replay_rec *rr;
+	const struct icdi_trace_rec *rec;
+	int i;
+	char cc;
+
+	for (rr = rp->recs; rr < rp->recs + rp->nrec; rr++) {
+		rec = &rr->rec;
+		printf("%12.6f %c %-7s %d %6u ", rec->usecs / 1000000.0,
+			rec->dir, rec->status < 5? status_names[rec->status] :
+			"?", rec->retries, rec->len);
+		for (i = 0; i < rec->len && i < 64; i++) {
+			cc = rr->data[i];
+			putchar(cc >= ' ' && cc < 0x7f? cc : '.');
+		}
+		printf("%s\n", rec->len > 64? "..." : "");
+	}
+}
+
+static int write_all(int fd, const char *data, int len)
+{
+	int retlen, pos;
+
+	for (pos = 0; pos < len; pos += retlen) {
+		retlen = write(fd, data + pos, len - pos);
+		if (retlen == -1 && errno == EINTR)
+			retlen = 0;
+		else if (retlen == -1)
+			return -1;
+	}
+	return len;
+}
+
+/* wire format of a reply; '*' is escaped too, the host expands runs */
+static int build_reply(const char *data, int len, char *out)
+{
+	uint8_t sum;
+	int i, o;
+	char cc;
+
+	o = 0;
+	sum = 0;
+	out[o++] = START;
+	for (i = 0; i < len; i++) {
+		cc = data[i];
+		if (cc == START || cc == END || cc == ESCAPE || cc == STAR) {
+			out[o++] = ESCAPE;
+			sum += ESCAPE;
+			cc ^= 0x20;
+		}
+		out[o++] = cc;
+		sum += cc;
+	}
+	o += sprintf(out + o, "%c%02x", END, sum);
+	return o;
+}
+
+/*
+ * Wait for the host to NAK a corrupted reply or, once acks are off, to
+ * send the request again. The resent copy is consumed here.
+ */
+static int wait_nak(int fd, int acks)
+{
+	struct pollfd pfd;
+	int tail;
+	char cc;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	tail = -1;
+	while (poll(&pfd, 1, NAK_WAIT_MS) == 1) {
+		if (read(fd, &cc, 1) != 1)
+			return 0;
+		if (acks && cc == '-')
+			return 1;
+		if (!acks && cc == END)
+			tail = END_LEN - 1;
+		else if (tail > 0 && --tail == 0)
+			return 1;
+	}
+	return 0;
+}
+
+/* index of the recorded request equal to pkt, -1 if there is none */
+static int find_request(const struct replay *rp, const char *pkt, int len)
+{
+	const struct replay_rec *rr;
+	int i, n;
+
+	for (n = 0; n < rp->nrec; n++) {
+		/* search forward from the cursor first, then wrap */
+		i = (rp->cursor + n) % rp->nrec;
+		rr = rp->recs + i;
+		if (rr->rec.dir == TRACE_TX && rr->rec.len == len &&
+				memcmp(rr->data, pkt, len) == 0)
+			return i;
+	}
+	return -1;
+}
+
+static void sleep_until(uint64_t when)
+{
+	uint64_t now;
+
+	now = icdi_now_us();
+	if (when > now)
+		usleep(when - now);
+}
+
+/* answer one decoded request packet, returns 0 to stop replaying */
+static int serve(struct replay *rp, const char *pkt, int len)
+{
+	const struct replay_rec *tx, *rx;
+	uint64_t tm0;
+	int idx, nak, i;
+	char cc;
+
+	tm0 = icdi_now_us();
+	idx = -1;
+	if (rp->cursor < rp->nrec) {
+		tx = rp->recs + rp->cursor;
+		if (tx->rec.dir == TRACE_TX && tx->rec.len == len &&
+				memcmp(tx->data, pkt, len) == 0)
+			idx = rp->cursor;
+	}
+	if (idx == -1) {
+		fprintf(stderr, "Request %.*s%s not expected at record %d\n",
+			len > 40? 40 : len, pkt, len > 40? "..." : "",
+			rp->cursor);
+		if (rp->strict)
+			return 0;
+		idx = find_request(rp, pkt, len);
+		if (idx == -1) {
+			rp->unmatched++;
+			if (rp->acks && write_all(rp->master, "+", 1) == -1)
+				return 0;
+			rp->rlen = build_reply("", 0, rp->reply);
+			return write_all(rp->master, rp->reply, rp->rlen) != -1;
+		}
+		rp->skipped++;
+		rp->naks = 0;
+	}
+	tx = rp->recs + idx;
+	if (tx->rec.status == TRACE_TIMEOUT || tx->rec.status == TRACE_ERROR) {
+		/* the adapter did not even acknowledge it */
+		rp->served++;
+		rp->cursor = idx + 1;
+		return 1;
+	}
+
+	/* the request was retransmitted, or never acknowledged at all */
+	nak = tx->rec.retries + (tx->rec.status == TRACE_NOACK);
+	if (rp->acks && rp->naks < nak) {
+		rp->naks++;
+		rp->cursor = idx;
+		return write_all(rp->master, "-", 1) != -1;
+	}
+	rp->naks = 0;
+	rp->served++;
+	if (rp->acks && write_all(rp->master, "+", 1) == -1)
+		return 0;
+
+	rx = idx + 1 < rp->nrec && rp->recs[idx+1].rec.dir == TRACE_RX?
+		rp->recs + idx + 1 : NULL;
+	rp->cursor = rx? idx + 2 : idx + 1;
+	if (!rx || rx->rec.status == TRACE_TIMEOUT ||
+			rx->rec.status == TRACE_ERROR)
+		return 1;	/* the adapter never answered */
+
+	if (rp->timing)
+		sleep_until(tm0 + (rx->rec.usecs - tx->rec.usecs));
+	rp->rlen = build_reply(rx->data, rx->rec.len, rp->reply);
+	for (i = 0; i < rx->rec.retries; i++) {
+		/* a corrupted copy first, as the host saw it */
+		cc = rp->reply[rp->rlen-1];
+		rp->reply[rp->rlen-1] = cc == '0'? '1' : '0';
+		if (write_all(rp->master, rp->reply, rp->rlen) == -1)
+			return 0;
+		rp->reply[rp->rlen-1] = cc;
+		if (rx->rec.status == TRACE_BADSUM && i == rx->rec.retries - 1)
+			return 1;
+		if (!wait_nak(rp->master, rp->acks))
+			fprintf(stderr, "No NAK for corrupted reply %d\n",
+				idx + 1);
+	}
+	if (write_all(rp->master, rp->reply, rp->rlen) == -1)
+		return 0;
+	if (len == 15 && memcmp(pkt, "QStartNoAckMode", 15) == 0 &&
+			rx->rec.len == 2 && memcmp(rx->data, "OK", 2) == 0)
+		rp->acks = 0;
+	return 1;
+}
+
+/*
+ * Take complete packets off the front of inbuf and serve them. Returns
+ * the bytes consumed, -1 to stop.
+ */
+static int serve_input(struct replay *rp, const char *inbuf, int len,
+		char *pkt)
+{
+	const char *pos, *end, *hash;
+	uint8_t sum;
+	unsigned int csum;
+	int plen;
+	char cc;
+
+	pos = inbuf;
+	end = inbuf + len;
+	while (pos < end) {
+		if (*pos == '-' && rp->rlen > 0) {
+			/* the host could not read the last reply */
+			if (write_all(rp->master, rp->reply, rp->rlen) == -1)
+				return -1;
+			pos++;
+			continue;
+		}
+		if (*pos != START) {
+			pos++;
+			continue;
+		}
+		hash = memchr(pos, END, end - pos);
+		if (!hash || end - hash < END_LEN)
+			break;
+		sum = 0;
+		plen = 0;
+		for (pos++; pos < hash; pos++) {
+			cc = *pos;
+			sum += cc;
+			if (cc == ESCAPE && pos + 1 < hash) {
+				cc = *++pos ^ 0x20;
+				sum += *pos;
+			}
+			pkt[plen++] = cc;
+		}
+		pos = hash + END_LEN;
+		if (sscanf(hash + 1, "%2x", &csum) != 1 || csum != sum) {
+			if (write_all(rp->master, "-", 1) == -1)
+				return -1;
+			continue;
+		}
+		if (!serve(rp, pkt, plen))
+			return -1;
+	}
+	return pos - inbuf;
+}
+
+static int open_pty(const char *link)
+{
+	struct termios tio;
+	const char *slave;
+	int master, fd;
+
+	master = posix_openpt(O_RDWR|O_NOCTTY);
+	if (master == -1 || grantpt(master) == -1 || unlockpt(master) == -1) {
+		fprintf(stderr, "Cannot create a pty: %s\n", strerror(errno));
+		return -1;
+	}
+	slave = ptsname(master);
+	fd = open(slave, O_RDWR|O_NOCTTY);
+	if (fd != -1) {
+		if (tcgetattr(fd, &tio) == 0) {
+			cfmakeraw(&tio);
+			tcsetattr(fd, TCSANOW, &tio);
+		}
+		close(fd);
+	}
+	if (link) {
+		unlink(link);
+		if (symlink(slave, link) == -1)
+			fprintf(stderr, "Cannot link %s to %s: %s\n", link,
+				slave, strerror(errno));
+	}
+	printf("Replaying on %s\n", slave);
+	fflush(stdout);
+	return master;
+}
+
+int main(int argc, char *argv[])
+{
+	static const struct option lopts[] = {
+		{.name = "dump", .has_arg = no_argument, .flag = NULL, .val = 'd'},
+		{.name = "strict", .has_arg = no_argument, .flag = NULL, .val = 's'},
+		{.name = "timing", .has_arg = no_argument, .flag = NULL, .val = 't'},
+		{.name = "link", .has_arg = required_argument, .flag = NULL, .val = 'l'},
+		{.name = NULL, .has_arg = 0, .flag = 0, .val = 0}
+	};
+	struct replay rp;
+	const char *link;
+	char *inbuf, *pkt;
+	int optc, dump, ilen, len, retv, seen;
+
+	memset(&rp, 0, sizeof(rp));
+	rp.acks = 1;
+	link = NULL;
+	dump = 0;
+	while ((optc = getopt_long(argc, argv, "dstl:", lopts, NULL)) != -1) {
+		switch(optc) {
+		case 'd':
+			dump = 1;
+			break;
+		case 's':
+			rp.strict = 1;
+			break;
+		case 't':
+			rp.timing = 1;
+			break;
+		case 'l':
+			link = optarg;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [--dump] [--strict] " \
+				"[--timing] [--link path] trace\n", argv[0]);
+			return 1;
+		}
+	}
+	if (optind != argc - 1) {
+		fprintf(stderr, "A trace file must be specified.\n");
+		return 1;
+	}
+	if (!load_trace(argv[optind], &rp))
+		return 4;
+	if (dump) {
+		dump_trace(&rp);
+		return 0;
+	}
+
+	inbuf = malloc(PKT_MAX);
+	pkt = malloc(PKT_MAX);
+	rp.reply = malloc(2*PKT_MAX + 8);
+	if (!inbuf || !pkt || !rp.reply) {
+		fprintf(stderr, "Out of Memory!\n");
+		return 1000;
+	}
+	rp.master = open_pty(link);
+	if (rp.master == -1)
+		return 8;
+
+	retv = 0;
+	ilen = 0;
+	seen = 0;
+	for (;;) {
+		len = read(rp.master, inbuf + ilen, PKT_MAX - ilen);
+		if (len == -1 && errno == EIO) {
+			/* no client has the pty open, done once it got it all */
+			if (seen && rp.cursor >= rp.nrec)
+				break;
+			usleep(10000);
+			continue;
+		} else if (len == -1 && errno == EINTR)
+			continue;
+		else if (len <= 0) {
+			fprintf(stderr, "Cannot read pty: %s\n", strerror(errno));
+			retv = 12;
+			break;
+		}
+		seen = 1;
+		ilen += len;
+		len = serve_input(&rp, inbuf, ilen, pkt);
+		if (len == -1) {
+			retv = 16;
+			break;
+		}
+		ilen -= len;
+		memmove(inbuf, inbuf + len, ilen);
+		if (ilen == PKT_MAX)
+			ilen = 0;
+	}
+	printf("Served %d requests, %d out of order, %d unmatched, " \
+		"%d of %d records replayed\n", rp.served, rp.skipped,
+		rp.unmatched, rp.cursor, rp.nrec);
+	if (link)
+		unlink(link);
+	close(rp.master);
+	free(rp.reply);
+	free(pkt);
+	free(inbuf);
+	return retv;
+}
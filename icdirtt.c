@@ -0,0 +1,387 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include "icdi.h"
+#include "tm4c123x.h"
+
+/*
+ * icdirtt: stream the log a running target writes to an up buffer of a
+ * SEGGER RTT control block. The block is found by scanning the SRAM
+ * once; after that a poll reads the write and read offsets of the
+ * buffer in one packet, and only when the target wrote something the
+ * new bytes, up to the end of the ring and from its start. The read
+ * offset is written back to release the bytes. The core is never
+ * halted.
+ *
+ *	control block:	char id[16], int max_up, int max_down,
+ *			up buffers[max_up], down buffers[max_down]
+ *	buffer:		name, buf, size, wroff, rdoff, flags
+ */
+#define RTT_ID		"SEGGER RTT"
+#define RTT_ID_LEN	16
+#define RTT_MAX_BUFS	16
+#define RTT_DESC_SIZE	24
+#define RTT_NAME	0
+#define RTT_BUF		4
+#define RTT_SIZE	8
+#define RTT_WROFF	12
+#define RTT_RDOFF	16
+
+/* times the block is looked for again before giving up */
+#define RTT_RETRIES	3
+
+/* wait between polls while the target writes nothing, doubling */
+#define POLL_MIN_US	1000
+#define POLL_MAX_US	100000
+
+struct rtt_chan {
+	uint32_t desc;		/* address of the buffer descriptor */
+	uint32_t buf;
+	uint32_t size;
+	uint32_t rdoff;
+	char name[32];
+};
+
+struct rtt_stats {
+	uint64_t bytes;
+	unsigned long polls, idle;
+	unsigned long wraps;	/* data read in two pieces */
+};
+
+static volatile int stop;
+
+static void rtt_stop(int sig)
+{
+	stop = 1;
+}
+
+static inline int in_sram(uint32_t addr, uint32_t len)
+{
+	return addr >= SRAM_BASE && addr - SRAM_BASE <= SRAM_SIZE &&
+		len <= SRAM_SIZE - (addr - SRAM_BASE);
+}
+
+/*
+ * Scan the SRAM for the id of the control block, NUL terminated and
+ * followed by sane buffer counts. Returns its address, 0 if not found.
+ */
+static uint32_t find_cb(struct icdibuf *buf, const char *id)
+{
+	char *sram, *pos;
+	uint32_t nup, ndown, addr;
+	int idlen;
+
+	sram = malloc(SRAM_SIZE);
+	if (!sram) {
+		fprintf(stderr, "Out of Memory!\n");
+		return 0;
+	}
+	addr = 0;
+	idlen = strlen(id) + 1;
+	if (icdi_readbin(buf, SRAM_BASE, SRAM_SIZE, sram) != SRAM_SIZE) {
+		fprintf(stderr, "Cannot read the SRAM\n");
+		goto exit_10;
+	}
+	for (pos = sram; (pos = memmem(pos, SRAM_SIZE - (pos - sram), id,
+				idlen)); pos++) {
+		if ((pos - sram) % 4 != 0 ||
+				pos - sram + RTT_ID_LEN + 8 > SRAM_SIZE)
+			continue;
+		memcpy(&nup, pos + RTT_ID_LEN, 4);
+		memcpy(&ndown, pos + RTT_ID_LEN + 4, 4);
+		u32_le2cpu(&nup);
+		u32_le2cpu(&ndown);
+		if (nup > 0 && nup <= RTT_MAX_BUFS && ndown <= RTT_MAX_BUFS) {
+			addr = SRAM_BASE + (pos - sram);
+			break;
+		}
+	}
+exit_10:
+	free(sram);
+	return addr;
+}
+
+/* read the descriptor of up buffer chan of the control block at cb */
+static int open_chan(struct icdibuf *buf, uint32_t cb, int chan,
+		struct rtt_chan *ch)
+{
+	uint32_t desc[RTT_DESC_SIZE/4], nup;
+	int i;
+
+	if (!icdi_readu32(buf, cb + RTT_ID_LEN, &nup))
+		return 0;
+	if (chan >= (int)nup || nup > RTT_MAX_BUFS) {
+		fprintf(stderr, "No up buffer %d, the target has %u\n", chan,
+			nup);
+		return 0;
+	}
+	ch->desc = cb + RTT_ID_LEN + 8 + chan * RTT_DESC_SIZE;
+	if (icdi_readbin(buf, ch->desc, RTT_DESC_SIZE, (char *)desc) !=
+			RTT_DESC_SIZE)
+		return 0;
+	for (i = 0; i < RTT_DESC_SIZE/4; i++)
+		u32_le2cpu(desc + i);
+	ch->buf = desc[RTT_BUF/4];
+	ch->size = desc[RTT_SIZE/4];
+	ch->rdoff = desc[RTT_RDOFF/4];
+	if (ch->size == 0 || !in_sram(ch->buf, ch->size) ||
+			ch->rdoff >= ch->size) {
+		fprintf(stderr, "Up buffer %d is not set up: %u bytes at " \
+			"%08X\n", chan, ch->size, ch->buf);
+		return 0;
+	}
+	ch->name[0] = 0;
+	if (desc[RTT_NAME/4] && icdi_readbin(buf, desc[RTT_NAME/4],
+				sizeof(ch->name) - 1, ch->name) > 0) {
+		ch->name[sizeof(ch->name) - 1] = 0;
+		for (i = 0; ch->name[i]; i++)
+			if (ch->name[i] < ' ' || ch->name[i] > '~')
+				ch->name[i] = '?';
+	}
+	return 1;
+}
+
+static int write_all(int fd, const char *data, int len)
+{
+	int retlen, pos;
+
+	for (pos = 0; pos < len; pos += retlen) {
+		retlen = write(fd, data + pos, len - pos);
+		if (retlen == -1) {
+			if (errno == EINTR) {
+				retlen = 0;
+				continue;
+			}
+			return -1;
+		}
+	}
+	return len;
+}
+
+/*
+ * Move what the target wrote since the last poll to outfd. Returns the
+ * number of bytes, or -1 when the buffer no longer makes sense or the
+ * link failed.
+ */
+static int rtt_poll(struct icdibuf *buf, struct rtt_chan *ch, char *data,
+		int outfd, struct rtt_stats *st)
+{
+	uint32_t offs[2], wroff, rdoff, len;
+
+	st->polls++;
+	if (icdi_readbin(buf, ch->desc + RTT_WROFF, sizeof(offs),
+				(char *)offs) != sizeof(offs))
+		return -1;
+	u32_le2cpu(offs);
+	u32_le2cpu(offs + 1);
+	wroff = offs[0];
+	rdoff = offs[1];
+	if (wroff >= ch->size || rdoff >= ch->size)
+		return -1;
+	/* the target's offset wins: it may have started over */
+	ch->rdoff = rdoff;
+	if (wroff == rdoff) {
+		st->idle++;
+		return 0;
+	}
+	len = (wroff > rdoff? wroff : ch->size) - rdoff;
+	if (icdi_readbin(buf, ch->buf + rdoff, len, data) != (int)len)
+		return -1;
+	if (wroff < rdoff && wroff > 0) {
+		if (icdi_readbin(buf, ch->buf, wroff, data + len) !=
+				(int)wroff)
+			return -1;
+		len += wroff;
+		st->wraps++;
+	}
+	if (write_all(outfd, data, len) == -1) {
+		fprintf(stderr, "Cannot write log: %s\n", strerror(errno));
+		return -1;
+	}
+	if (!icdi_writeu32(buf, ch->desc + RTT_RDOFF, wroff))
+		return -1;
+	ch->rdoff = wroff;
+	st->bytes += len;
+	return len;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s --icdi port [--channel n] [--addr cb] " \
+		"[--id string]\n\t[--output file] [--poll-min us] " \
+		"[--poll-max us]\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+	static const struct option lopts[] = {
+		{.name = "icdi", .has_arg = required_argument, .flag = NULL, .val = 'i'},
+		{.name = "channel", .has_arg = required_argument, .flag = NULL, .val = 'c'},
+		{.name = "addr", .has_arg = required_argument, .flag = NULL, .val = 'a'},
+		{.name = "id", .has_arg = required_argument, .flag = NULL, .val = 'd'},
+		{.name = "output", .has_arg = required_argument, .flag = NULL, .val = 'o'},
+		{.name = "poll-min", .has_arg = required_argument, .flag = NULL, .val = 'm'},
+		{.name = "poll-max", .has_arg = required_argument, .flag = NULL, .val = 'M'},
+		{.name = NULL, .has_arg = 0, .flag = 0, .val = 0}
+	};
+	struct icdibuf *buf;
+	struct rtt_chan ch;
+	struct rtt_stats st;
+	struct sigaction sa;
+	const char *port, *id, *output;
+	char options[128], *data;
+	uint32_t cb, poll_min, poll_max, delay;
+	uint64_t tm0, secs;
+	int optc, retv, chan, outfd, len, fixed, fails;
+
+	port = NULL;
+	id = RTT_ID;
+	output = NULL;
+	chan = 0;
+	cb = 0;
+	poll_min = POLL_MIN_US;
+	poll_max = POLL_MAX_US;
+	while ((optc = getopt_long(argc, argv, "i:c:a:d:o:m:M:", lopts,
+					NULL)) != -1) {
+		switch(optc) {
+		case 'i':
+			port = optarg;
+			break;
+		case 'c':
+			chan = strtol(optarg, NULL, 0);
+			break;
+		case 'a':
+			cb = strtoul(optarg, NULL, 0);
+			break;
+		case 'd':
+			id = optarg;
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		case 'm':
+			poll_min = strtoul(optarg, NULL, 0);
+			break;
+		case 'M':
+			poll_max = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			return 4;
+		}
+	}
+	if (!port || optind != argc || chan < 0 || poll_min == 0 ||
+			poll_max < poll_min ||
+			strlen(id) >= RTT_ID_LEN) {
+		usage(argv[0]);
+		return 4;
+	}
+	if (cb && !in_sram(cb, RTT_ID_LEN + 8)) {
+		fprintf(stderr, "Control block must be in the SRAM\n");
+		return 4;
+	}
+
+	/* the log goes to stdout unless told otherwise, messages to stderr */
+	if (output) {
+		outfd = open(output, O_WRONLY|O_CREAT|O_APPEND, 0644);
+		if (outfd == -1) {
+			fprintf(stderr, "Cannot open file: %s->%s\n", output,
+				strerror(errno));
+			return 8;
+		}
+	} else {
+		outfd = dup(STDOUT_FILENO);
+		if (outfd == -1 || dup2(STDERR_FILENO, STDOUT_FILENO) == -1) {
+			fprintf(stderr, "Cannot redirect stdout: %s\n",
+				strerror(errno));
+			return 1000;
+		}
+	}
+
+	buf = icdi_init(port, FLASH_ERASE_SIZE);
+	if (buf == NULL)
+		return 1000;
+
+	retv = 0;
+	data = NULL;
+	icdi_version(buf, options, 128);
+	printf("ICDI Version: %s", options);
+	if (!debug_clock(buf)) {
+		fprintf(stderr, "Debug Clock is not stable!\n");
+		retv = 100;
+		goto exit_10;
+	}
+	icdi_probe_read_max(buf);
+	fixed = cb != 0;
+	if (!fixed)
+		cb = find_cb(buf, id);
+	if (!cb) {
+		fprintf(stderr, "No control block \"%s\" in the SRAM\n", id);
+		retv = 12;
+		goto exit_10;
+	}
+	if (!open_chan(buf, cb, chan, &ch)) {
+		retv = 16;
+		goto exit_10;
+	}
+	printf("Control block at %08X, up buffer %d \"%s\": %u bytes at " \
+		"%08X\n", cb, chan, ch.name, ch.size, ch.buf);
+	/* room for any buffer open_chan() accepts, also after a reset */
+	data = malloc(SRAM_SIZE);
+	if (!data) {
+		fprintf(stderr, "Out of Memory!\n");
+		retv = 20;
+		goto exit_10;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = rtt_stop;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	memset(&st, 0, sizeof(st));
+	tm0 = icdi_now_us();
+	delay = 0;
+	fails = 0;
+	while (!stop) {
+		len = rtt_poll(buf, &ch, data, outfd, &st);
+		if (len == -1) {
+			/* a reset target sets the block up again, find it */
+			if (stop || ++fails > RTT_RETRIES ||
+					(!fixed && !(cb = find_cb(buf, id))) ||
+					!open_chan(buf, cb, chan, &ch)) {
+				fprintf(stderr, "Lost the control block\n");
+				retv = 24;
+				break;
+			}
+			continue;
+		}
+		fails = 0;
+		/* more may be waiting right away, or nothing for a while */
+		if (len > 0)
+			delay = 0;
+		else
+			delay = delay? delay * 2 : poll_min;
+		if (delay > poll_max)
+			delay = poll_max;
+		if (delay)
+			usleep(delay);
+	}
+	secs = icdi_now_us() - tm0;
+	printf("Log: %llu bytes in %.2fs, %.1f KiB/s, polls: %lu (%lu idle), " \
+		"wrapped reads: %lu\n", (unsigned long long)st.bytes,
+		secs / 1000000.0, secs? st.bytes * 1000000.0 / 1024 / secs : 0.0,
+		st.polls, st.idle, st.wraps);
+	icdi_qRcmd(buf, "debug disable");
+
+exit_10:
+	free(data);
+	icdi_exit(buf);
+	if (outfd != -1)
+		close(outfd);
+	return retv;
+}
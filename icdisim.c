@@ -0,0 +1,233 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <termios.h>
+#include "simcore.h"
+
+/*
+ * icdisim: a TM4C123GH6PM LaunchPad on a pty, for running flashbin,
+ * dumpflash and txicdi without hardware. The link can be slowed down
+ * and made unreliable; on exit the flash contents can be saved for
+ * comparison with what was programmed.
+ */
+
+static struct sim_target *sim;
+
+static void sim_stop(int sig)
+{
+	sim->stop = 1;
+}
+
+static int open_pty(const char *link)
+{
+	struct termios tio;
+	const char *slave;
+	int master, fd;
+
+	master = posix_openpt(O_RDWR|O_NOCTTY);
+	if (master == -1 || grantpt(master) == -1 || unlockpt(master) == -1) {
+		fprintf(stderr, "Cannot create a pty: %s\n", strerror(errno));
+		return -1;
+	}
+	slave = ptsname(master);
+	fd = open(slave, O_RDWR|O_NOCTTY);
+	if (fd != -1) {
+		if (tcgetattr(fd, &tio) == 0) {
+			cfmakeraw(&tio);
+			tcsetattr(fd, TCSANOW, &tio);
+		}
+		close(fd);
+	}
+	if (link) {
+		unlink(link);
+		if (symlink(slave, link) == -1)
+			fprintf(stderr, "Cannot link %s to %s: %s\n", link,
+				slave, strerror(errno));
+	}
+	printf("Simulating on %s\n", slave);
+	fflush(stdout);
+	return master;
+}
+
+static int load_file(const char *path, uint8_t *mem, int size, int save)
+{
+	FILE *f;
+	int len;
+
+	f = fopen(path, save? "wb" : "rb");
+	if (!f) {
+		fprintf(stderr, "Cannot open file: %s->%s\n", path,
+			strerror(errno));
+		return 0;
+	}
+	if (save)
+		len = fwrite(mem, 1, size, f);
+	else
+		len = fread(mem, 1, size, f);
+	fclose(f);
+	if (save && len != size) {
+		fprintf(stderr, "Cannot save flash to %s\n", path);
+		return 0;
+	}
+	return 1;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [--link path] [--latency us] " \
+		"[--bandwidth bytes/s]\n\t[--drop-ack pct] [--nak pct] " \
+		"[--corrupt pct] [--seed n] [--pktsize n]\n\t" \
+		"[--flash image] [--sram image] [--save file]\n\t" \
+		"[--ack-only] [--read-max n] [--drop-reset ms]\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+	static const struct option lopts[] = {
+		{.name = "link", .has_arg = required_argument, .flag = NULL, .val = 'l'},
+		{.name = "latency", .has_arg = required_argument, .flag = NULL, .val = 't'},
+		{.name = "bandwidth", .has_arg = required_argument, .flag = NULL, .val = 'b'},
+		{.name = "drop-ack", .has_arg = required_argument, .flag = NULL, .val = 'a'},
+		{.name = "nak", .has_arg = required_argument, .flag = NULL, .val = 'n'},
+		{.name = "corrupt", .has_arg = required_argument, .flag = NULL, .val = 'c'},
+		{.name = "seed", .has_arg = required_argument, .flag = NULL, .val = 'r'},
+		{.name = "pktsize", .has_arg = required_argument, .flag = NULL, .val = 'p'},
+		{.name = "flash", .has_arg = required_argument, .flag = NULL, .val = 'f'},
+		{.name = "save", .has_arg = required_argument, .flag = NULL, .val = 's'},
+		{.name = "sram", .has_arg = required_argument, .flag = NULL, .val = 'S'},
+		{.name = "ack-only", .has_arg = no_argument, .flag = NULL, .val = 'k'},
+		{.name = "read-max", .has_arg = required_argument, .flag = NULL, .val = 'm'},
+		{.name = "drop-reset", .has_arg = required_argument, .flag = NULL, .val = 'd'},
+		{.name = NULL, .has_arg = 0, .flag = 0, .val = 0}
+	};
+	struct sigaction act;
+	const char *link, *image, *sram, *save;
+	int master, optc, retv;
+
+	sim = sim_alloc();
+	if (!sim)
+		return 1000;
+	link = NULL;
+	image = NULL;
+	sram = NULL;
+	save = NULL;
+	while ((optc = getopt_long(argc, argv, "l:t:b:a:n:c:r:p:f:s:S:km:d:", lopts,
+					NULL)) != -1) {
+		switch(optc) {
+		case 'l':
+			link = optarg;
+			break;
+		case 't':
+			sim->latency_us = strtol(optarg, NULL, 0);
+			break;
+		case 'b':
+			sim->bandwidth = strtol(optarg, NULL, 0);
+			break;
+		case 'a':
+			sim->faults.drop_ack = strtol(optarg, NULL, 0);
+			break;
+		case 'n':
+			sim->faults.nak = strtol(optarg, NULL, 0);
+			break;
+		case 'c':
+			sim->faults.corrupt = strtol(optarg, NULL, 0);
+			break;
+		case 'r':
+			sim->seed = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			sim->pktsize = strtol(optarg, NULL, 0);
+			if (sim->pktsize < 64 || sim->pktsize > PKTSIZE_MAX) {
+				fprintf(stderr, "Packet size out of range\n");
+				return 4;
+			}
+			break;
+		case 'f':
+			image = optarg;
+			break;
+		case 's':
+			save = optarg;
+			break;
+		case 'S':
+			sram = optarg;
+			break;
+		case 'k':
+			sim->ack_only = 1;
+			break;
+		case 'm':
+			sim->read_max = strtol(optarg, NULL, 0);
+			if (sim->read_max < 4 || sim->read_max > PKTSIZE_MAX) {
+				fprintf(stderr, "Read size out of range\n");
+				return 4;
+			}
+			break;
+		case 'd':
+			sim->drop_reset_ms = strtol(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (optind != argc) {
+		usage(argv[0]);
+		return 1;
+	}
+	if (image && !load_file(image, sim->flash, SIM_FLASH_SIZE, 0))
+		return 8;
+	/* what firmware left in the SRAM, an RTT control block say */
+	if (sram && !load_file(sram, sim->sram, SRAM_SIZE, 0))
+		return 8;
+
+	memset(&act, 0, sizeof(act));
+	act.sa_handler = sim_stop;
+	sigaction(SIGINT, &act, NULL);
+	sigaction(SIGTERM, &act, NULL);
+	master = open_pty(link);
+	if (master == -1)
+		return 12;
+
+	retv = 0;
+	while (!sim->stop) {
+		if (sim_serve(sim, master) == -1) {
+			fprintf(stderr, "Cannot serve pty: %s\n",
+				strerror(errno));
+			retv = 16;
+			break;
+		}
+		/* gone off the bus, back as another tty like a USB adapter */
+		if (sim->dropped) {
+			close(master);
+			if (link)
+				unlink(link);
+			usleep(sim->drop_reset_ms * 1000);
+			sim->dropped = 0;
+			master = open_pty(link);
+			if (master == -1) {
+				retv = 12;
+				break;
+			}
+			continue;
+		}
+		/* no client has the pty open, wait for the next one */
+		if (!sim->stop)
+			usleep(10000);
+	}
+	printf("Packets: %lu, in %lu bytes, out %lu bytes, NAKs: %lu, " \
+		"acks dropped: %lu, replies corrupted: %lu\n",
+		sim->stats.packets, sim->stats.bytes_in, sim->stats.bytes_out,
+		sim->stats.naks, sim->stats.acks_dropped,
+		sim->stats.corrupted);
+	if (save && !load_file(save, sim->flash, SIM_FLASH_SIZE, 1))
+		retv = 20;
+	if (link)
+		unlink(link);
+	close(master);
+	sim_free(sim);
+	return retv;
+}
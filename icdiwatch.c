@@ -0,0 +1,645 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <math.h>
+#include <getopt.h>
+#include <signal.h>
+#include "icdi.h"
+#include "tm4c123x.h"
+#include "fwimage.h"
+
+/*
+ * icdiwatch: sample memory of a running target in a tight loop. The
+ * ranges to watch are coalesced into as few 'x' reads as possible and
+ * every sample is stored, timestamped, in a ring buffer file:
+ *
+ *	struct watch_hdr
+ *	struct watch_range	nranges times
+ *	record			nrecs times, each a struct watch_rec
+ *				followed by the bytes of every range
+ *
+ * The newest record is in slot (count - 1) % nrecs.
+ */
+#define WATCH_MAGIC	"ICDIWAT1"
+#define WATCH_RANGES	64
+#define WATCH_RING	65536
+#define WATCH_GAP	64
+/* consecutive failed samples that end the watch */
+#define WATCH_FAILS	10
+
+struct watch_hdr {
+	char magic[8];
+	uint32_t nranges;
+	uint32_t recsize;	/* struct watch_rec and the sampled bytes */
+	uint32_t nrecs;		/* slots of the ring */
+	uint32_t pad;
+	uint64_t start;		/* CLOCK_REALTIME of the first sample, us */
+	uint64_t count;		/* records written */
+};
+
+struct watch_range {
+	uint32_t addr;
+	uint32_t len;
+	uint32_t offset;	/* in the sampled bytes of a record */
+	uint32_t pad;
+	char name[48];
+};
+
+struct watch_rec {
+	uint64_t seq;
+	uint64_t usecs;		/* since start, when the reads began */
+	uint32_t span_us;	/* taken by the reads */
+	uint32_t status;	/* 1 if a read failed, the bytes are stale */
+};
+
+/* one 'x' read covering one or more ranges */
+struct watch_read {
+	uint32_t addr;
+	uint32_t len;
+	char *data;
+};
+
+struct watch_job {
+	int nranges;
+	struct watch_range ranges[WATCH_RANGES];
+	int nreads;
+	struct watch_read *reads;
+	int first[WATCH_RANGES];	/* read each range starts in */
+	const char *src[WATCH_RANGES];	/* its bytes in mem */
+	char *mem;		/* the bytes of all reads */
+	uint32_t datalen;	/* sampled bytes per record */
+};
+
+struct watch_stats {
+	uint64_t samples, failed;
+	uint64_t first, last;
+	uint64_t min_us, max_us;
+	double sum, sumsq;	/* of the intervals between samples */
+	uint64_t span;
+};
+
+static volatile int stop;
+
+static void watch_stop(int sig)
+{
+	stop = 1;
+}
+
+/*
+ * Parse name[+offset][:len] or addr[:len]. A symbol defaults to its
+ * size in the ELF, an address to one word.
+ */
+static int parse_range(const char *spec, const struct fw_image *elf,
+		struct watch_range *rng)
+{
+	char name[sizeof(rng->name)], *colon, *plus, *end;
+	uint32_t addr, size, off;
+
+	snprintf(name, sizeof(name), "%s", spec);
+	size = 0;
+	colon = strchr(name, ':');
+	if (colon) {
+		*colon++ = 0;
+		size = strtoul(colon, &end, 0);
+		if (*end || size == 0) {
+			fprintf(stderr, "Bad length in \"%s\"\n", spec);
+			return 0;
+		}
+	}
+	if (name[0] >= '0' && name[0] <= '9') {
+		addr = strtoul(name, &end, 0);
+		if (*end) {
+			fprintf(stderr, "Bad address in \"%s\"\n", spec);
+			return 0;
+		}
+		if (size == 0)
+			size = 4;
+	} else {
+		off = 0;
+		plus = strchr(name, '+');
+		if (plus) {
+			*plus++ = 0;
+			off = strtoul(plus, &end, 0);
+			if (*end) {
+				fprintf(stderr, "Bad offset in \"%s\"\n", spec);
+				return 0;
+			}
+		}
+		if (!elf || !fw_elf_symbol(elf, name, &addr, &rng->len)) {
+			fprintf(stderr, "Symbol \"%s\" not found%s\n", name,
+				elf? "" : ", no ELF given");
+			return 0;
+		}
+		addr += off;
+		if (size == 0)
+			size = rng->len > off? rng->len - off : 4;
+	}
+	if (size > SRAM_SIZE) {
+		fprintf(stderr, "\"%s\" is larger than the SRAM\n", spec);
+		return 0;
+	}
+	rng->addr = addr;
+	rng->len = size;
+	rng->pad = 0;
+	snprintf(rng->name, sizeof(rng->name), "%s", spec);
+	return 1;
+}
+
+static int range_cmp(const void *a, const void *b)
+{
+	const struct watch_range *ra = *(struct watch_range *const *)a;
+	const struct watch_range *rb = *(struct watch_range *const *)b;
+
+	return ra->addr < rb->addr? -1 : ra->addr > rb->addr;
+}
+
+/*
+ * Cover the ranges with word aligned reads. Ranges less than gap bytes
+ * apart share a read, as reading the gap is cheaper than a round trip,
+ * and no read is longer than the adapter answers in one packet.
+ */
+static int plan_reads(struct watch_job *job, uint32_t gap, int read_max)
+{
+	struct watch_range *sorted[WATCH_RANGES];
+	struct watch_read *rd;
+	uint32_t start, end, rend, total;
+	int i, k, room;
+	char *mem;
+
+	for (i = 0; i < job->nranges; i++)
+		sorted[i] = job->ranges + i;
+	qsort(sorted, job->nranges, sizeof(sorted[0]), range_cmp);
+	job->datalen = 0;
+	for (i = 0; i < job->nranges; i++) {
+		job->ranges[i].offset = job->datalen;
+		job->datalen += job->ranges[i].len;
+	}
+
+	room = 0;
+	job->nreads = 0;
+	job->reads = NULL;
+	total = 0;
+	read_max &= ~3;
+	for (i = 0; i < job->nranges; i++) {
+		k = sorted[i] - job->ranges;
+		start = sorted[i]->addr & ~3u;
+		end = (sorted[i]->addr + sorted[i]->len + 3) & ~3u;
+		rd = job->nreads? job->reads + job->nreads - 1 : NULL;
+		rend = rd? rd->addr + rd->len : 0;
+		if (rd && start >= rd->addr && start <= rend + gap &&
+				end - rd->addr <= (uint32_t)read_max) {
+			if (end > rend) {
+				total += end - rend;
+				rd->len = end - rd->addr;
+			}
+			job->first[k] = job->nreads - 1;
+			continue;
+		}
+		/* a range longer than a packet goes in consecutive reads */
+		job->first[k] = job->nreads;
+		for (; start < end; start += read_max) {
+			if (job->nreads == room) {
+				room = room? room * 2 : 16;
+				rd = realloc(job->reads, room * sizeof(*rd));
+				if (!rd) {
+					fprintf(stderr, "Out of Memory!\n");
+					return 0;
+				}
+				job->reads = rd;
+			}
+			rd = job->reads + job->nreads++;
+			rd->addr = start;
+			rd->len = end - start < (uint32_t)read_max?
+				end - start : (uint32_t)read_max;
+			total += rd->len;
+		}
+	}
+	mem = malloc(total);
+	if (!mem) {
+		fprintf(stderr, "Out of Memory!\n");
+		return 0;
+	}
+	job->mem = mem;
+	for (rd = job->reads; rd < job->reads + job->nreads; rd++) {
+		rd->data = mem;
+		mem += rd->len;
+	}
+	for (i = 0; i < job->nranges; i++) {
+		rd = job->reads + job->first[i];
+		job->src[i] = rd->data + (job->ranges[i].addr - rd->addr);
+	}
+	return 1;
+}
+
+static int write_all_at(int fd, const void *data, size_t len, off_t pos)
+{
+	ssize_t retlen;
+	size_t done;
+
+	for (done = 0; done < len; done += retlen) {
+		retlen = pwrite(fd, (const char *)data + done, len - done,
+				pos + done);
+		if (retlen == -1) {
+			if (errno == EINTR) {
+				retlen = 0;
+				continue;
+			}
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static int ring_create(const char *path, const struct watch_job *job,
+		struct watch_hdr *hdr, uint32_t nrecs)
+{
+	size_t hlen;
+	int fd;
+
+	memset(hdr, 0, sizeof(*hdr));
+	memcpy(hdr->magic, WATCH_MAGIC, sizeof(hdr->magic));
+	hdr->nranges = job->nranges;
+	hdr->recsize = sizeof(struct watch_rec) + job->datalen;
+	hdr->nrecs = nrecs;
+	fd = open(path, O_RDWR|O_CREAT|O_TRUNC, 0644);
+	if (fd == -1) {
+		fprintf(stderr, "Cannot open file: %s->%s\n", path,
+			strerror(errno));
+		return -1;
+	}
+	hlen = sizeof(*hdr) + job->nranges * sizeof(struct watch_range);
+	if (ftruncate(fd, hlen + (off_t)nrecs * hdr->recsize) == -1 ||
+			!write_all_at(fd, hdr, sizeof(*hdr), 0) ||
+			!write_all_at(fd, job->ranges, hlen - sizeof(*hdr),
+				sizeof(*hdr))) {
+		fprintf(stderr, "Cannot write %s: %s\n", path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static void stats_add(struct watch_stats *st, uint64_t t0, uint64_t span)
+{
+	uint64_t ival;
+
+	if (st->samples == 0)
+		st->first = t0;
+	else {
+		ival = t0 - st->last;
+		if (st->samples == 1 || ival < st->min_us)
+			st->min_us = ival;
+		if (ival > st->max_us)
+			st->max_us = ival;
+		st->sum += ival;
+		st->sumsq += (double)ival * ival;
+	}
+	st->last = t0;
+	st->span += span;
+	st->samples++;
+}
+
+static void stats_report(const struct watch_stats *st,
+		const struct watch_job *job, uint32_t period_us)
+{
+	double secs, mean, dev;
+	uint64_t n;
+
+	n = st->samples > 1? st->samples - 1 : 0;
+	secs = (st->last - st->first) / 1000000.0;
+	mean = n? st->sum / n : 0.0;
+	dev = n? sqrt(st->sumsq / n - mean * mean) : 0.0;
+	printf("Samples: %llu (%llu failed), %d read(s) of %u bytes each\n",
+		(unsigned long long)st->samples,
+		(unsigned long long)st->failed, job->nreads, job->datalen);
+	printf("Rate: %.1f Hz over %.2fs, reads take %.0fus per sample\n",
+		secs > 0? n / secs : 0.0, secs,
+		st->samples? (double)st->span / st->samples : 0.0);
+	printf("Interval: mean %.0fus, jitter %.0fus stddev, " \
+		"min %lluus, max %lluus", mean, dev,
+		(unsigned long long)st->min_us, (unsigned long long)st->max_us);
+	if (period_us)
+		printf(", asked for %uus", period_us);
+	printf("\n");
+}
+
+/*
+ * Sample until stopped, count samples are taken or duration_us is up.
+ * With a period the samples are paced on absolute deadlines, so a late
+ * one does not delay the rest.
+ */
+static int watch(struct icdibuf *buf, const struct watch_job *job, int fd,
+		struct watch_hdr *hdr, uint64_t count, uint64_t duration_us,
+		uint32_t period_us)
+{
+	struct watch_stats st;
+	struct watch_rec *rec;
+	const struct watch_read *rd;
+	const struct watch_range *rng;
+	struct timespec tm;
+	uint64_t t0, t1, next, tstart;
+	off_t base;
+	char *record;
+	int i, fails, retv;
+
+	record = malloc(hdr->recsize);
+	if (!record) {
+		fprintf(stderr, "Out of Memory!\n");
+		return 0;
+	}
+	rec = (struct watch_rec *)record;
+	base = sizeof(*hdr) + job->nranges * sizeof(struct watch_range);
+	memset(&st, 0, sizeof(st));
+	clock_gettime(CLOCK_REALTIME, &tm);
+	hdr->start = (uint64_t)tm.tv_sec * 1000000 + tm.tv_nsec / 1000;
+	tstart = icdi_now_us();
+	next = tstart;
+	fails = 0;
+	retv = 1;
+	while (!stop && (count == 0 || st.samples < count)) {
+		if (period_us) {
+			tm.tv_sec = next / 1000000;
+			tm.tv_nsec = next % 1000000 * 1000;
+			while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+					&tm, NULL) == EINTR && !stop)
+				;
+			next += period_us;
+		}
+		t0 = icdi_now_us();
+		if (duration_us && t0 - tstart >= duration_us)
+			break;
+		/* after an overrun the missed slots are dropped, not made up */
+		if (period_us && next <= t0)
+			next = t0 + period_us;
+		rec->status = 0;
+		for (rd = job->reads; rd < job->reads + job->nreads; rd++)
+			if (icdi_readbin(buf, rd->addr, rd->len, rd->data) !=
+					(int)rd->len) {
+				rec->status = 1;
+				break;
+			}
+		t1 = icdi_now_us();
+		rec->seq = st.samples;
+		rec->usecs = t0 - tstart;
+		rec->span_us = t1 - t0;
+		for (i = 0, rng = job->ranges; i < job->nranges; i++, rng++)
+			memcpy(record + sizeof(*rec) + rng->offset,
+				job->src[i], rng->len);
+		if (!write_all_at(fd, record, hdr->recsize, base +
+				(off_t)(st.samples % hdr->nrecs) * hdr->recsize)) {
+			fprintf(stderr, "Cannot write samples: %s\n",
+				strerror(errno));
+			retv = 0;
+			break;
+		}
+		stats_add(&st, t0, t1 - t0);
+		hdr->count = st.samples;
+		if (rec->status) {
+			st.failed++;
+			if (++fails == WATCH_FAILS) {
+				fprintf(stderr, "Target not readable, giving up\n");
+				retv = 0;
+				break;
+			}
+		} else
+			fails = 0;
+		/* readers of the ring see the count move now and then */
+		if ((st.samples % 256) == 0)
+			write_all_at(fd, hdr, sizeof(*hdr), 0);
+	}
+	if (!write_all_at(fd, hdr, sizeof(*hdr), 0))
+		retv = 0;
+	stats_report(&st, job, period_us);
+	free(record);
+	return retv;
+}
+
+/* print the records of a ring buffer file, oldest first */
+static int print_ring(const char *path)
+{
+	struct watch_hdr hdr;
+	struct watch_range ranges[WATCH_RANGES];
+	const struct watch_range *rng;
+	const struct watch_rec *rec;
+	uint64_t seq, first;
+	uint32_t i, k, word;
+	char *record;
+	off_t base;
+	int fd, retv;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		fprintf(stderr, "Cannot open file: %s->%s\n", path,
+			strerror(errno));
+		return 24;
+	}
+	retv = 28;
+	if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+			memcmp(hdr.magic, WATCH_MAGIC, sizeof(hdr.magic)) != 0 ||
+			hdr.nranges == 0 || hdr.nranges > WATCH_RANGES ||
+			hdr.nrecs == 0 || hdr.recsize < sizeof(*rec) ||
+			pread(fd, ranges, hdr.nranges * sizeof(ranges[0]),
+				sizeof(hdr)) !=
+				(ssize_t)(hdr.nranges * sizeof(ranges[0]))) {
+		fprintf(stderr, "%s: not a watch file\n", path);
+		goto exit_10;
+	}
+	record = malloc(hdr.recsize);
+	if (!record) {
+		fprintf(stderr, "Out of Memory!\n");
+		goto exit_10;
+	}
+	rec = (const struct watch_rec *)record;
+	base = sizeof(hdr) + hdr.nranges * sizeof(ranges[0]);
+	for (i = 0; i < hdr.nranges; i++)
+		printf("# %s: %08X, %u bytes\n", ranges[i].name, ranges[i].addr,
+			ranges[i].len);
+	first = hdr.count > hdr.nrecs? hdr.count - hdr.nrecs : 0;
+	retv = 0;
+	for (seq = first; seq < hdr.count; seq++) {
+		if (pread(fd, record, hdr.recsize, base + (off_t)(seq %
+				hdr.nrecs) * hdr.recsize) != hdr.recsize) {
+			fprintf(stderr, "%s: truncated\n", path);
+			retv = 28;
+			break;
+		}
+		printf("%llu %.6f %u%s", (unsigned long long)rec->seq,
+			rec->usecs / 1000000.0, rec->span_us,
+			rec->status? " failed" : "");
+		for (i = 0, rng = ranges; i < hdr.nranges; i++, rng++) {
+			if (rng->offset + rng->len > hdr.recsize - sizeof(*rec))
+				break;
+			printf(" %s=", rng->name);
+			for (k = 0; k + 4 <= rng->len; k += 4) {
+				memcpy(&word, record + sizeof(*rec) +
+					rng->offset + k, 4);
+				printf("%s%08X", k? "," : "", word);
+			}
+			for (; k < rng->len; k++)
+				printf("%s%02X", k? "," : "", (uint8_t)
+					record[sizeof(*rec) + rng->offset + k]);
+		}
+		printf("\n");
+	}
+	free(record);
+exit_10:
+	close(fd);
+	return retv;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s --icdi port [--elf firmware] " \
+		"--output ring [--ring records]\n" \
+		"\t[--rate Hz] [--count samples] [--duration secs] " \
+		"[--gap bytes] range...\n" \
+		"       %s --print ring\n" \
+		"A range is symbol[+offset][:length] or address[:length]\n",
+		prog, prog);
+}
+
+int main(int argc, char *argv[])
+{
+	static const struct option lopts[] = {
+		{.name = "icdi", .has_arg = required_argument, .flag = NULL, .val = 'i'},
+		{.name = "elf", .has_arg = required_argument, .flag = NULL, .val = 'e'},
+		{.name = "output", .has_arg = required_argument, .flag = NULL, .val = 'o'},
+		{.name = "ring", .has_arg = required_argument, .flag = NULL, .val = 'n'},
+		{.name = "rate", .has_arg = required_argument, .flag = NULL, .val = 'r'},
+		{.name = "count", .has_arg = required_argument, .flag = NULL, .val = 'c'},
+		{.name = "duration", .has_arg = required_argument, .flag = NULL, .val = 't'},
+		{.name = "gap", .has_arg = required_argument, .flag = NULL, .val = 'g'},
+		{.name = "print", .has_arg = required_argument, .flag = NULL, .val = 'p'},
+		{.name = NULL, .has_arg = 0, .flag = 0, .val = 0}
+	};
+	struct watch_job job;
+	struct watch_hdr hdr;
+	struct fw_image elf, *elfp;
+	struct icdibuf *buf;
+	struct sigaction sa;
+	const char *port, *elfname, *output;
+	char options[128];
+	uint32_t nrecs, gap, period_us;
+	uint64_t count, duration_us;
+	double rate;
+	int optc, retv, fd, i;
+
+	port = NULL;
+	elfname = NULL;
+	output = NULL;
+	nrecs = WATCH_RING;
+	gap = WATCH_GAP;
+	rate = 0;
+	count = 0;
+	duration_us = 0;
+	while ((optc = getopt_long(argc, argv, "i:e:o:n:r:c:t:g:p:", lopts,
+					NULL)) != -1) {
+		switch(optc) {
+		case 'i':
+			port = optarg;
+			break;
+		case 'e':
+			elfname = optarg;
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		case 'n':
+			nrecs = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			rate = strtod(optarg, NULL);
+			break;
+		case 'c':
+			count = strtoull(optarg, NULL, 0);
+			break;
+		case 't':
+			duration_us = strtod(optarg, NULL) * 1000000;
+			break;
+		case 'g':
+			gap = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			return print_ring(optarg);
+		default:
+			usage(argv[0]);
+			return 4;
+		}
+	}
+	if (!port || !output || optind >= argc || nrecs == 0 || rate < 0) {
+		usage(argv[0]);
+		return 4;
+	}
+	if (argc - optind > WATCH_RANGES) {
+		fprintf(stderr, "At most %d ranges\n", WATCH_RANGES);
+		return 4;
+	}
+	period_us = rate > 0? 1000000 / rate : 0;
+
+	elfp = NULL;
+	if (elfname) {
+		if (!fw_image_load(&elf, elfname, 0))
+			return 8;
+		if (elf.format != FW_ELF) {
+			fprintf(stderr, "%s is not an ELF file\n", elfname);
+			fw_image_free(&elf);
+			return 8;
+		}
+		elfp = &elf;
+	}
+	memset(&job, 0, sizeof(job));
+	retv = 0;
+	for (i = optind; i < argc && !retv; i++)
+		if (!parse_range(argv[i], elfp, job.ranges + job.nranges++))
+			retv = 12;
+	if (elfp)
+		fw_image_free(elfp);
+	if (retv)
+		return retv;
+
+	buf = icdi_init(port, FLASH_ERASE_SIZE);
+	if (buf == NULL)
+		return 1000;
+
+	icdi_version(buf, options, 128);
+	printf("ICDI Version: %s", options);
+	if (icdi_qSupported(buf, options, 128))
+		printf("Supported: %s\n", options);
+	/* the core is never halted, memory is read while it runs */
+	if (!debug_clock(buf)) {
+		fprintf(stderr, "Debug Clock is not stable!\n");
+		retv = 100;
+		goto exit_10;
+	}
+	icdi_probe_read_max(buf);
+	if (!plan_reads(&job, gap, icdi_read_max(buf))) {
+		retv = 16;
+		goto exit_10;
+	}
+	printf("Watching %d range(s), %u bytes, in %d read(s) of up to " \
+		"%d bytes\n", job.nranges, job.datalen, job.nreads,
+		icdi_read_max(buf));
+
+	fd = ring_create(output, &job, &hdr, nrecs);
+	if (fd == -1) {
+		retv = 24;
+		goto exit_20;
+	}
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = watch_stop;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	if (!watch(buf, &job, fd, &hdr, count, duration_us, period_us))
+		retv = 28;
+	close(fd);
+	icdi_qRcmd(buf, "debug disable");
+
+exit_20:
+	free(job.reads);
+	free(job.mem);
+exit_10:
+	icdi_exit(buf);
+	return retv;
+}
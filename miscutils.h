@@ -1,30 +1,605 @@
 #ifndef MISCUTILS_DSCAO__
 #define MISCUTILS_DSCAO__
-#include <sys/types.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <limits.h>
+#include <pthread.h>
 #include <sys/stat.h>
-#include <unistd.h>
-#include <fcntl.h>
+#include "icdi.h"
 
-static inline int instance_start(const char *file_lock)
+#define MAX_GANG	16
+
+enum job_phase {
+	PHASE_CONNECT, PHASE_IDENTIFY, PHASE_ERASE, PHASE_WRITE,
+	PHASE_VERIFY, PHASE_READ, PHASE_RESET, PHASE_RECONNECT,
+	PHASE_COUNT
+};
+
+static const char *const job_phase_names[PHASE_COUNT] = {
+	"connect", "identify", "erase", "write",
+	"verify", "read", "reset", "reconnect",
+};
+
+/*
+ * What a board's job did, for --metrics-json and --prom-textfile. The
+ * link and wait counters add up every session of the job, so they must
+ * be collected with job_collect() before each icdi_exit().
+ */
+struct job_metrics {
+	uint64_t phase_us[PHASE_COUNT];
+	uint64_t tm;		/* start of the phase being timed */
+	int identified;		/* did0 and did1 are valid */
+	uint32_t did0, did1;
+	struct icdi_linkstat link;
+	unsigned int ready_waits;
+	uint64_t ready_us;
+};
+
+/* close the phase running since the last mark as ph, start the next */
+static inline void job_phase(struct job_metrics *jm, int ph)
+{
+	uint64_t now;
+
+	now = icdi_now_us();
+	jm->phase_us[ph] += now - jm->tm;
+	jm->tm = now;
+}
+
+/* start the next phase without accounting the time since the last mark */
+static inline void job_mark(struct job_metrics *jm)
+{
+	jm->tm = icdi_now_us();
+}
+
+static inline void job_collect(struct job_metrics *jm,
+		const struct icdibuf *buf)
+{
+	jm->link.packets += buf->lstat.packets;
+	jm->link.retries += buf->lstat.retries;
+	jm->link.failures += buf->lstat.failures;
+	jm->link.timeouts += buf->lstat.timeouts;
+	jm->link.bytes_out += buf->lstat.bytes_out;
+	jm->link.bytes_in += buf->lstat.bytes_in;
+	jm->ready_waits += buf->wstat.waits;
+	jm->ready_us += buf->wstat.usecs;
+}
+
+/*
+ * One board of a gang. Every board gets its own thread and its own
+ * struct icdibuf session; ports are locked one by one in icdi_init().
+ */
+struct gang_port {
+	const char *dev;
+	const char *tag;	/* message prefix, empty for a single board */
+	const void *args;
+	int (*board)(struct gang_port *gp);
+	pthread_t thid;
+	int started;
+	int retv;
+	uint32_t bytes;		/* bytes flashed or dumped */
+	uint64_t usecs;
+	struct job_metrics metrics;
+	char tagbuf[32];
+};
+
+static inline void *gang_thread(void *arg)
+{
+	struct gang_port *gp = arg;
+	uint64_t tm0;
+
+	tm0 = icdi_now_us();
+	gp->metrics.tm = tm0;
+	gp->retv = gp->board(gp);
+	gp->usecs = icdi_now_us() - tm0;
+	return NULL;
+}
+
+static inline void gang_report(const struct gang_port *ports, int nports,
+		uint64_t wall)
+{
+	const struct gang_port *gp;
+	double secs;
+
+	printf("\n%-20s %-8s %10s %9s %9s\n", "Port", "Status", "Bytes",
+		"Time", "KiB/s");
+	for (gp = ports; gp < ports + nports; gp++) {
+		secs = gp->usecs / 1000000.0;
+		printf("%-20s %-8s %10u %8.2fs %9.1f\n", gp->dev,
+			gp->retv? "FAILED" : "OK", gp->bytes, secs,
+			secs > 0? gp->bytes / 1024.0 / secs : 0.0);
+	}
+	printf("Boards: %d, wall time: %.2fs\n", nports, wall / 1000000.0);
+}
+
+/*
+ * Run board() on every port, concurrently when there is more than one.
+ * Returns the exit code of the first failing board, 0 if all succeeded.
+ */
+static inline int gang_run(struct gang_port *ports, int nports,
+		const void *args, int (*board)(struct gang_port *gp))
+{
+	struct gang_port *gp;
+	const char *name;
+	uint64_t tm0;
+	int retv;
+
+	tm0 = icdi_now_us();
+	for (gp = ports; gp < ports + nports; gp++) {
+		gp->args = args;
+		gp->board = board;
+		gp->retv = 0;
+		gp->bytes = 0;
+		memset(&gp->metrics, 0, sizeof(gp->metrics));
+		gp->tag = "";
+		if (nports == 1) {
+			gang_thread(gp);
+			return gp->retv;
+		}
+		name = strrchr(gp->dev, '/');
+		snprintf(gp->tagbuf, sizeof(gp->tagbuf), "%s: ",
+			name? name + 1 : gp->dev);
+		gp->tag = gp->tagbuf;
+		gp->started = pthread_create(&gp->thid, NULL, gang_thread,
+				gp) == 0;
+		if (!gp->started) {
+			fprintf(stderr, "Cannot start thread for %s\n", gp->dev);
+			gp->retv = 1000;
+		}
+	}
+	retv = 0;
+	for (gp = ports; gp < ports + nports; gp++) {
+		if (gp->started)
+			pthread_join(gp->thid, NULL);
+		if (retv == 0)
+			retv = gp->retv;
+	}
+	gang_report(ports, nports, icdi_now_us() - tm0);
+	return retv;
+}
+
+/* a string quoted for JSON and Prometheus label values alike */
+static inline void put_quoted(FILE *fout, const char *str)
+{
+	fputc('"', fout);
+	for (; *str; str++) {
+		if (*str == '"' || *str == '\\')
+			fprintf(fout, "\\%c", *str);
+		else if (*str == '\n')
+			fputs("\\n", fout);
+		else if ((unsigned char)*str < 0x20)
+			fputc('?', fout);
+		else
+			fputc(*str, fout);
+	}
+	fputc('"', fout);
+}
+
+static inline double job_throughput(const struct gang_port *gp)
 {
-	int fd;
-	char fname[64];
+	return gp->usecs > 0? gp->bytes * 1000000.0 / gp->usecs : 0.0;
+}
 
-	strcpy(fname, "/var/lock/");
-	strcat(fname, file_lock);
-	fd = open(fname, O_WRONLY|O_CREAT|O_EXCL);
-	if (fd == -1)
+/*
+ * Replace path with a temporary file written by out(), so that readers
+ * never see half a report. Returns 1 on success.
+ */
+static inline int job_report(const char *path, const char *tool,
+		const struct gang_port *ports, int nports, int retv,
+		void (*out)(FILE *, const char *, const struct gang_port *,
+			int, int))
+{
+	char tmpname[512];
+	FILE *fout;
+	int err;
+
+	snprintf(tmpname, sizeof(tmpname), "%s.%d.tmp", path, (int)getpid());
+	fout = fopen(tmpname, "w");
+	if (!fout) {
+		fprintf(stderr, "Cannot create %s->%s\n", tmpname,
+			strerror(errno));
+		return 0;
+	}
+	out(fout, tool, ports, nports, retv);
+	err = ferror(fout);
+	if (fclose(fout) != 0 || err || rename(tmpname, path) == -1) {
+		fprintf(stderr, "Cannot write %s->%s\n", path,
+			strerror(errno));
+		unlink(tmpname);
 		return 0;
-	close(fd);
+	}
 	return 1;
 }
 
-static inline void instance_exit(const char *file_lock)
+static inline void job_json_out(FILE *fout, const char *tool,
+		const struct gang_port *ports, int nports, int retv)
+{
+	const struct gang_port *gp;
+	const struct job_metrics *jm;
+	int ph;
+
+	fprintf(fout, "{\"tool\": ");
+	put_quoted(fout, tool);
+	fprintf(fout, ", \"time\": %ld, \"exit_code\": %d, \"boards\": [",
+		(long)time(NULL), retv);
+	for (gp = ports; gp < ports + nports; gp++) {
+		jm = &gp->metrics;
+		fprintf(fout, "%s\n  {\"port\": ", gp == ports? "" : ",");
+		put_quoted(fout, gp->dev);
+		fprintf(fout, ", \"exit_code\": %d, ", gp->retv);
+		if (jm->identified)
+			fprintf(fout, "\"did0\": \"%08X\", \"did1\": \"%08X\", ",
+				jm->did0, jm->did1);
+		else
+			fprintf(fout, "\"did0\": null, \"did1\": null, ");
+		fprintf(fout, "\"bytes\": %u, \"wall_us\": %llu, " \
+			"\"throughput_bps\": %.0f,\n   \"phases_us\": {",
+			gp->bytes, (unsigned long long)gp->usecs,
+			job_throughput(gp));
+		for (ph = 0; ph < PHASE_COUNT; ph++)
+			fprintf(fout, "%s\"%s\": %llu", ph? ", " : "",
+				job_phase_names[ph],
+				(unsigned long long)jm->phase_us[ph]);
+		fprintf(fout, "},\n   \"packets\": %lu, \"retries\": %lu, " \
+			"\"failures\": %lu, \"timeouts\": %lu, " \
+			"\"link_bytes_out\": %llu, \"link_bytes_in\": %llu, " \
+			"\"ready_waits\": %u, \"ready_wait_us\": %llu}",
+			jm->link.packets, jm->link.retries,
+			jm->link.failures, jm->link.timeouts,
+			(unsigned long long)jm->link.bytes_out,
+			(unsigned long long)jm->link.bytes_in,
+			jm->ready_waits, (unsigned long long)jm->ready_us);
+	}
+	fprintf(fout, "\n]}\n");
+}
+
+/* the labels every sample of a board carries */
+static inline void prom_labels(FILE *fout, const char *tool,
+		const struct gang_port *gp)
+{
+	fprintf(fout, "{tool=");
+	put_quoted(fout, tool);
+	fprintf(fout, ",port=");
+	put_quoted(fout, gp->dev);
+}
+
+static inline void prom_head(FILE *fout, const char *name, const char *help)
+{
+	fprintf(fout, "# HELP icdi_job_%s %s\n# TYPE icdi_job_%s gauge\n",
+		name, help, name);
+}
+
+/* a gauge with one sample per board, of value(board) */
+static inline void prom_gauge(FILE *fout, const char *tool,
+		const struct gang_port *ports, int nports, const char *name,
+		const char *help, double (*value)(const struct gang_port *))
+{
+	const struct gang_port *gp;
+	double val;
+
+	prom_head(fout, name, help);
+	for (gp = ports; gp < ports + nports; gp++) {
+		fprintf(fout, "icdi_job_%s", name);
+		prom_labels(fout, tool, gp);
+		val = value(gp);
+		fprintf(fout, val == (uint64_t)val? "} %.0f\n" : "} %.6f\n",
+			val);
+	}
+}
+
+static inline double prom_exit_code(const struct gang_port *gp)
+{
+	return gp->retv;
+}
+
+static inline double prom_bytes(const struct gang_port *gp)
 {
-	char fname[64];
+	return gp->bytes;
+}
 
-	strcpy(fname, "/var/lock/");
-	strcat(fname, file_lock);
-	unlink(fname);
+static inline double prom_seconds(const struct gang_port *gp)
+{
+	return gp->usecs / 1000000.0;
+}
+
+static inline double prom_packets(const struct gang_port *gp)
+{
+	return gp->metrics.link.packets;
+}
+
+static inline double prom_retries(const struct gang_port *gp)
+{
+	return gp->metrics.link.retries;
+}
+
+static inline double prom_failures(const struct gang_port *gp)
+{
+	return gp->metrics.link.failures;
+}
+
+static inline double prom_timeouts(const struct gang_port *gp)
+{
+	return gp->metrics.link.timeouts;
+}
+
+static inline double prom_ready_waits(const struct gang_port *gp)
+{
+	return gp->metrics.ready_waits;
+}
+
+static inline double prom_ready_seconds(const struct gang_port *gp)
+{
+	return gp->metrics.ready_us / 1000000.0;
+}
+
+static inline void job_prom_out(FILE *fout, const char *tool,
+		const struct gang_port *ports, int nports, int retv)
+{
+	const struct gang_port *gp;
+	const struct job_metrics *jm;
+	long now;
+	int ph;
+
+	now = time(NULL);
+	prom_gauge(fout, tool, ports, nports, "exit_code",
+		"Exit code of the board's last job, 0 on success.",
+		prom_exit_code);
+	prom_head(fout, "last_run_timestamp_seconds",
+		"When the last job finished.");
+	for (gp = ports; gp < ports + nports; gp++) {
+		fprintf(fout, "icdi_job_last_run_timestamp_seconds");
+		prom_labels(fout, tool, gp);
+		fprintf(fout, "} %ld\n", now);
+	}
+	prom_head(fout, "info", "Chip identification of the board.");
+	for (gp = ports; gp < ports + nports; gp++) {
+		jm = &gp->metrics;
+		if (!jm->identified)
+			continue;
+		fprintf(fout, "icdi_job_info");
+		prom_labels(fout, tool, gp);
+		fprintf(fout, ",did0=\"%08X\",did1=\"%08X\"} 1\n",
+			jm->did0, jm->did1);
+	}
+	prom_gauge(fout, tool, ports, nports, "bytes",
+		"Image bytes flashed or dumped.", prom_bytes);
+	prom_gauge(fout, tool, ports, nports, "seconds",
+		"Wall time of the job.", prom_seconds);
+	prom_gauge(fout, tool, ports, nports, "throughput_bytes_per_second",
+		"Bytes over the wall time of the job.", job_throughput);
+	prom_head(fout, "phase_seconds", "Wall time of each phase of the job.");
+	for (gp = ports; gp < ports + nports; gp++)
+		for (ph = 0; ph < PHASE_COUNT; ph++) {
+			fprintf(fout, "icdi_job_phase_seconds");
+			prom_labels(fout, tool, gp);
+			fprintf(fout, ",phase=\"%s\"} %.6f\n",
+				job_phase_names[ph],
+				gp->metrics.phase_us[ph] / 1000000.0);
+		}
+	prom_gauge(fout, tool, ports, nports, "packets",
+		"Packets exchanged with the adapter.", prom_packets);
+	prom_gauge(fout, tool, ports, nports, "retries",
+		"Packets sent again and replies NAKed.", prom_retries);
+	prom_gauge(fout, tool, ports, nports, "failures",
+		"Exchanges that got no valid reply.", prom_failures);
+	prom_gauge(fout, tool, ports, nports, "timeouts",
+		"Exchanges that timed out.", prom_timeouts);
+	prom_head(fout, "link_bytes", "Bytes on the link, framing included.");
+	for (gp = ports; gp < ports + nports; gp++) {
+		jm = &gp->metrics;
+		fprintf(fout, "icdi_job_link_bytes");
+		prom_labels(fout, tool, gp);
+		fprintf(fout, ",dir=\"out\"} %llu\n",
+			(unsigned long long)jm->link.bytes_out);
+		fprintf(fout, "icdi_job_link_bytes");
+		prom_labels(fout, tool, gp);
+		fprintf(fout, ",dir=\"in\"} %llu\n",
+			(unsigned long long)jm->link.bytes_in);
+	}
+	prom_gauge(fout, tool, ports, nports, "ready_waits",
+		"Waits for the debug interface to become ready.",
+		prom_ready_waits);
+	prom_gauge(fout, tool, ports, nports, "ready_wait_seconds",
+		"Time spent waiting for the debug interface.",
+		prom_ready_seconds);
+}
+
+/* write the reports asked for; returns 1 if all were written */
+static inline int job_metrics_write(const char *json, const char *prom,
+		const char *tool, const struct gang_port *ports, int nports,
+		int retv)
+{
+	int ok;
+
+	ok = 1;
+	if (json && !job_report(json, tool, ports, nports, retv,
+				job_json_out))
+		ok = 0;
+	if (prom && !job_report(prom, tool, ports, nports, retv,
+				job_prom_out))
+		ok = 0;
+	return ok;
+}
+
+/*
+ * Progress journal of a job, so that an interrupted one can be resumed.
+ * There is one per tool and adapter, named after the adapter's serial
+ * number, in $XDG_CACHE_HOME/icdi-journal or ~/.cache/icdi-journal.
+ * The first line is the key of the job, which names the target and
+ * what is written or read; a journal with another key is started over.
+ * Every following "done addr len" line records a range completed.
+ */
+struct journal_ent {
+	uint32_t addr;
+	uint32_t len;
+};
+
+struct job_journal {
+	FILE *fp;		/* NULL when not journaling */
+	char path[PATH_MAX];
+	char key[PATH_MAX];
+	int nents;		/* ranges completed by earlier runs */
+	struct journal_ent *ents;
+};
+
+static inline int journal_dir(char *path, int len)
+{
+	const char *dir;
+
+	dir = getenv("XDG_CACHE_HOME");
+	if (dir && *dir) {
+		if (snprintf(path, len, "%s/icdi-journal", dir) >= len)
+			return 0;
+	} else {
+		dir = getenv("HOME");
+		if (!dir || !*dir)
+			return 0;
+		if (snprintf(path, len, "%s/.cache/icdi-journal", dir) >= len)
+			return 0;
+		snprintf(path, len, "%s/.cache", dir);
+		mkdir(path, 0700);
+		snprintf(path, len, "%s/.cache/icdi-journal", dir);
+	}
+	return mkdir(path, 0700) == 0 || errno == EEXIST;
+}
+
+/* load the ranges of the journal at jn->path if its key matches */
+static inline void journal_load(struct job_journal *jn)
+{
+	char line[PATH_MAX + 8];
+	struct journal_ent ent, *ents;
+	int size;
+	FILE *fin;
+
+	fin = fopen(jn->path, "r");
+	if (!fin)
+		return;
+	size = 0;
+	if (fgets(line, sizeof(line), fin) && strncmp(line, "key ", 4) == 0 &&
+			strcspn(line + 4, "\n") == strlen(jn->key) &&
+			strncmp(line + 4, jn->key, strlen(jn->key)) == 0)
+		/* a line torn by a crash ends the journal */
+		while (fgets(line, sizeof(line), fin) &&
+				strchr(line, '\n') &&
+				sscanf(line, "done %x %u", &ent.addr,
+					&ent.len) == 2) {
+			if (jn->nents == size) {
+				size = size? size * 2 : 64;
+				ents = realloc(jn->ents, size * sizeof(*ents));
+				if (!ents)
+					break;
+				jn->ents = ents;
+			}
+			jn->ents[jn->nents++] = ent;
+		}
+	fclose(fin);
+}
+
+/*
+ * Rewrite the journal with the key and the first nents ranges, then
+ * keep it open for appending. Returns 0 and stops journaling if it
+ * cannot be written.
+ */
+static inline int journal_rewrite(struct job_journal *jn, int nents,
+		const char *tag)
+{
+	char tmp[PATH_MAX + 16];
+	int i;
+
+	if (jn->fp)
+		fclose(jn->fp);
+	snprintf(tmp, sizeof(tmp), "%s.%d", jn->path, (int)getpid());
+	jn->fp = fopen(tmp, "w");
+	if (jn->fp) {
+		fprintf(jn->fp, "key %s\n", jn->key);
+		for (i = 0; i < nents; i++)
+			fprintf(jn->fp, "done %08X %u\n", jn->ents[i].addr,
+				jn->ents[i].len);
+		if (fflush(jn->fp) == 0 && fdatasync(fileno(jn->fp)) == 0 &&
+				rename(tmp, jn->path) == 0)
+			return 1;
+		fclose(jn->fp);
+		jn->fp = NULL;
+	}
+	fprintf(stderr, "%sCannot write journal %s->%s\n", tag, jn->path,
+		strerror(errno));
+	unlink(tmp);
+	return 0;
+}
+
+/*
+ * The file of tool for the adapter in the journal directory. id is the
+ * adapter's serial number, or the port when it has none. Returns 0 when
+ * there is no journal directory or the path does not fit in len.
+ */
+static inline int journal_path(char *path, int len, const char *tool,
+		const char *id)
+{
+	char dir[PATH_MAX - 64], name[64];
+	int i;
+
+	if (strrchr(id, '/'))
+		id = strrchr(id, '/') + 1;
+	for (i = 0; id[i] && i < (int)sizeof(name) - 1; i++)
+		name[i] = isalnum((unsigned char)id[i])? id[i] : '_';
+	name[i] = 0;
+	if (!journal_dir(dir, sizeof(dir)))
+		return 0;
+	return snprintf(path, len, "%s/%s-%s", dir, tool, name) < len;
+}
+
+/*
+ * Start the journal of tool for the adapter, keeping the ranges of an
+ * earlier run with the same key when resuming.
+ */
+static inline int journal_open(struct job_journal *jn, const char *tool,
+		const char *id, const char *key, int resume, const char *tag)
+{
+	memset(jn, 0, sizeof(*jn));
+	if (!journal_path(jn->path, sizeof(jn->path), tool, id)) {
+		fprintf(stderr, "%sNo journal directory, cannot resume " \
+			"later\n", tag);
+		return 0;
+	}
+	snprintf(jn->key, sizeof(jn->key), "%s", key);
+	if (resume) {
+		journal_load(jn);
+		if (jn->nents == 0)
+			printf("%sNothing to resume, starting over\n", tag);
+	}
+	return journal_rewrite(jn, jn->nents, tag);
+}
+
+/* forget the earlier runs, their work is being undone */
+static inline void journal_reset(struct job_journal *jn, const char *tag)
+{
+	if (!jn->fp)
+		return;
+	jn->nents = 0;
+	journal_rewrite(jn, 0, tag);
+}
+
+/* record [addr, addr+len) as done for good */
+static inline void journal_commit(struct job_journal *jn, uint32_t addr,
+		uint32_t len)
+{
+	if (!jn->fp)
+		return;
+	fprintf(jn->fp, "done %08X %u\n", addr, len);
+	fflush(jn->fp);
+	fdatasync(fileno(jn->fp));
+}
+
+/* close the journal, removing it when the job is complete */
+static inline void journal_close(struct job_journal *jn, int complete)
+{
+	if (jn->fp) {
+		fclose(jn->fp);
+		if (complete)
+			unlink(jn->path);
+	}
+	free(jn->ents);
+	memset(jn, 0, sizeof(*jn));
 }
 #endif /* MISCUTILS_DSCAO__ */
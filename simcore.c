@@ -0,0 +1,517 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include "simcore.h"
+#include "tm4c123stub.h"
+
+#define SIM_BUFSIZE	(2*PKTSIZE_MAX + 8)
+#define NAK_WAIT_MS	1000
+
+static const struct sim_reg reset_regs[] = {
+	{SCSP_BASE+DID0_OFFSET, 0x10050102},
+	{SCSP_BASE+DID1_OFFSET, 0x10a1606e},
+	{SCSP_BASE+RM_CTRL_OFFSET, 0},
+	{FM_CTRL_BASE+FSIZE_OFFSET, 0x7f},
+};
+
+struct sim_target *sim_alloc(void)
+{
+	struct sim_target *sim;
+
+	sim = malloc(sizeof(*sim));
+	if (!sim) {
+		fprintf(stderr, "Out of Memory!\n");
+		return NULL;
+	}
+	memset(sim, 0, sizeof(*sim));
+	sim->ibuf = malloc(SIM_BUFSIZE);
+	sim->pkt = malloc(SIM_BUFSIZE);
+	sim->reply = malloc(SIM_BUFSIZE);
+	sim->wire = malloc(2*SIM_BUFSIZE);
+	if (!sim->ibuf || !sim->pkt || !sim->reply || !sim->wire) {
+		fprintf(stderr, "Out of Memory!\n");
+		sim_free(sim);
+		return NULL;
+	}
+	sim->pktsize = PKTSIZE_DEFAULT;
+	sim->read_max = SIM_READ_MAX;
+	sim->seed = 1;
+	memset(sim->flash, 0xff, sizeof(sim->flash));
+	sim->nregs = sizeof(reset_regs)/sizeof(reset_regs[0]);
+	memcpy(sim->regs, reset_regs, sizeof(reset_regs));
+	return sim;
+}
+
+void sim_free(struct sim_target *sim)
+{
+	free(sim->wire);
+	free(sim->reply);
+	free(sim->pkt);
+	free(sim->ibuf);
+	free(sim);
+}
+
+static struct sim_reg *sim_reg(struct sim_target *sim, uint32_t addr,
+		int create)
+{
+	struct sim_reg *reg;
+
+	for (reg = sim->regs; reg < sim->regs + sim->nregs; reg++)
+		if (reg->addr == addr)
+			return reg;
+	if (!create || sim->nregs == SIM_MAX_REGS)
+		return NULL;
+	reg->addr = addr;
+	reg->val = 0;
+	sim->nregs++;
+	return reg;
+}
+
+static int sim_read(struct sim_target *sim, uint32_t addr, int len, char *out)
+{
+	struct sim_reg *reg;
+	uint32_t val;
+	int i;
+
+	if (addr < SIM_FLASH_SIZE && len <= SIM_FLASH_SIZE - addr)
+		memcpy(out, sim->flash + addr, len);
+	else if (addr >= SRAM_BASE && addr - SRAM_BASE <= SRAM_SIZE - len)
+		memcpy(out, sim->sram + (addr - SRAM_BASE), len);
+	else
+		for (i = 0; i < len; i += 4) {
+			if (addr + i == DHCSR)
+				val = DHCSR_S_REGRDY | DHCSR_C_DEBUGEN |
+					(sim->running? 0 :
+					 DHCSR_S_HALT | DHCSR_C_HALT);
+			else if (addr + i == DCRDR)
+				val = sim->dcrdr;
+			else {
+				reg = sim_reg(sim, addr + i, 0);
+				val = reg? reg->val : 0;
+			}
+			memcpy(out + i, &val, len - i < 4? len - i : 4);
+		}
+	return len;
+}
+
+static void sim_write(struct sim_target *sim, uint32_t addr, const char *data,
+		int len)
+{
+	struct sim_reg *reg;
+	uint32_t val;
+
+	if (addr >= SRAM_BASE && addr - SRAM_BASE <= SRAM_SIZE - len) {
+		memcpy(sim->sram + (addr - SRAM_BASE), data, len);
+		return;
+	}
+	if (len != 4)
+		return;
+	memcpy(&val, data, 4);
+	switch (addr) {
+	case DHCSR:
+		if ((val & 0xffff0000) != DHCSR_DBGKEY)
+			break;
+		if (val & DHCSR_C_HALT)
+			sim->running = 0;
+		else if (val & DHCSR_C_DEBUGEN)
+			sim->running = 1;
+		break;
+	case DCRSR:
+		if (val & DCRSR_REGWNR)
+			sim->coreg[val & 0x1f] = sim->dcrdr;
+		else
+			sim->dcrdr = sim->coreg[val & 0x1f];
+		break;
+	case DCRDR:
+		sim->dcrdr = val;
+		break;
+	default:
+		reg = sim_reg(sim, addr, 1);
+		if (reg)
+			reg->val = val;
+	}
+}
+
+static uint32_t sram_u32(const struct sim_target *sim, uint32_t addr)
+{
+	uint32_t val;
+
+	memcpy(&val, sim->sram + (addr - SRAM_BASE), 4);
+	return val;
+}
+
+/* the CRC stub of tm4c123stub.c: one pass over its ranges, then halt */
+static void sim_crc(struct sim_target *sim)
+{
+	uint32_t ctrl, addr, len, crc, count, i;
+	const uint8_t *data;
+	int k;
+
+	count = sram_u32(sim, STUB_CTRL + CRC_COUNT);
+	for (ctrl = STUB_CTRL + CRC_RANGE(0);
+			ctrl < STUB_CTRL + CRC_RANGE(count); ctrl += 12) {
+		addr = sram_u32(sim, ctrl);
+		len = sram_u32(sim, ctrl + 4);
+		if (addr < SIM_FLASH_SIZE && len <= SIM_FLASH_SIZE - addr)
+			data = sim->flash + addr;
+		else if (addr >= SRAM_BASE && addr - SRAM_BASE <= SRAM_SIZE &&
+				len <= SRAM_SIZE - (addr - SRAM_BASE))
+			data = sim->sram + (addr - SRAM_BASE);
+		else
+			break;
+		crc = 0xffffffff;
+		for (i = 0; i < len; i++) {
+			crc ^= data[i];
+			for (k = 0; k < 8; k++)
+				crc = (crc >> 1) ^ ((crc & 1)? 0xedb88320 : 0);
+		}
+		crc = ~crc;
+		memcpy(sim->sram + (ctrl + 8 - SRAM_BASE), &crc, 4);
+	}
+	sim->running = 0;
+}
+
+/*
+ * The FCRIS mask the loaded flash loader tests, decoded from the movw
+ * right before its "tst.w r0, r9", so that a wrong mask in the stub
+ * shows here as it would on the chip.
+ */
+static uint32_t loader_mask(const struct sim_target *sim)
+{
+	static const uint8_t tst[] = {0x10, 0xea, 0x09, 0x0f};
+	const uint8_t *code = sim->sram + (STUB_CODE - SRAM_BASE), *mw;
+	int i;
+
+	for (i = 4; i < STUB_CTRL - STUB_CODE - 4; i += 2)
+		if (memcmp(code + i, tst, 4) == 0)
+			break;
+	if (i >= STUB_CTRL - STUB_CODE - 4)
+		return LOADER_FCRIS_ERRORS;
+	mw = code + i - 4;
+	return (mw[0] & 0x0f) << 12 | (mw[1] & 0x04) << 9 |
+		(mw[3] & 0x70) << 4 | mw[2];
+}
+
+/*
+ * The only code the simulated core runs are the SRAM stubs of
+ * tm4c123stub.c, started at STUB_CODE. The loader programs every buffer
+ * the host marks ready and halts on its breakpoint when told to exit.
+ * The CRC stub is told apart by its first control word, a range count
+ * where the loader has its flash key.
+ */
+static void sim_run(struct sim_target *sim)
+{
+	uint32_t ctrl, key, state, addr, len, i, fcris, mask;
+	const uint8_t *data;
+	struct sim_reg *reg;
+	int n;
+
+	if (!sim->running || sim->coreg[COREG_PC] != STUB_CODE)
+		return;
+	if (sram_u32(sim, STUB_CTRL + CRC_COUNT) <= CRC_MAX_RANGES) {
+		sim_crc(sim);
+		return;
+	}
+	key = sram_u32(sim, STUB_CTRL + LOADER_KEY);
+	for (n = 0; n < 2; n++) {
+		ctrl = STUB_CTRL + LOADER_DESC(n);
+		if (sram_u32(sim, ctrl) != LOADER_READY)
+			continue;
+		addr = sram_u32(sim, ctrl + 4);
+		len = sram_u32(sim, ctrl + 8);
+		state = LOADER_ERROR;
+		if ((key == (FMC_WRKEY_A442 | FMC2_WRBUF) ||
+			key == (FMC_WRKEY_71D5 | FMC2_WRBUF)) &&
+			(addr % LOADER_BLOCK) == 0 && len <= LOADER_BUFSIZE &&
+			addr < SIM_FLASH_SIZE && len <= SIM_FLASH_SIZE - addr) {
+			data = sim->sram + (LOADER_BUF0 - SRAM_BASE) +
+				n * LOADER_BUFSIZE;
+			/* FCMISC is cleared once a buffer, FCRIS tested a block */
+			mask = loader_mask(sim);
+			fcris = 0;
+			state = LOADER_DONE;
+			for (i = 0; i < len; i++) {
+				if (~sim->flash[addr+i] & data[i])
+					fcris |= FCRIS_INVDRIS;
+				sim->flash[addr+i] &= data[i];
+				if ((i + 1) % LOADER_BLOCK)
+					continue;
+				fcris |= FCRIS_PRIS;
+				if (fcris & mask) {
+					state = LOADER_ERROR;
+					break;
+				}
+			}
+			reg = sim_reg(sim, FM_CTRL_BASE + FCRIS_OFFSET, 1);
+			if (reg)
+				reg->val = fcris;
+		}
+		memcpy(sim->sram + (ctrl - SRAM_BASE), &state, 4);
+	}
+	if (sram_u32(sim, STUB_CTRL + LOADER_EXIT))
+		sim->running = 0;
+}
+
+/*
+ * Answer one decoded packet. Binary data of X and vFlashWrite is taken
+ * as is, the escapes are already undone. Returns the reply length.
+ */
+int sim_handle(struct sim_target *sim, const char *pkt, int len, char *reply)
+{
+	static const char *version = "1.0 simcore\n";
+	const char *data;
+	char *end, cmd[64];
+	uint32_t addr, alen;
+	int i;
+
+	sim->stats.packets++;
+	sim_run(sim);
+	if (len >= 6 && memcmp(pkt, "qRcmd,", 6) == 0) {
+		icdi_hex2str(pkt + 6, len - 6, cmd, sizeof(cmd));
+		if (strcmp(cmd, "version") == 0) {
+			for (i = 0; version[i]; i++)
+				sprintf(reply + 2*i, "%02x", version[i]);
+			return 2*i;
+		}
+		/* the core runs out of reset until the next '?' */
+		if (strcmp(cmd, "debug hreset") == 0 ||
+			strcmp(cmd, "debug sreset") == 0 ||
+			strcmp(cmd, "debug creset") == 0) {
+			memset(sim->coreg, 0, sizeof(sim->coreg));
+			sim->running = 1;
+			if (strcmp(cmd, "debug hreset") == 0 &&
+					sim->drop_reset_ms > 0)
+				sim->dropped = 1;
+		}
+		return sprintf(reply, "OK");
+	}
+	if (len == 10 && memcmp(pkt, "qSupported", 10) == 0)
+		return sprintf(reply, "PacketSize=%x;qXfer:memory-map:read+%s",
+				sim->pktsize,
+				sim->ack_only? "" : ";QStartNoAckMode+");
+	if (len == 15 && memcmp(pkt, "QStartNoAckMode", 15) == 0) {
+		if (sim->ack_only)
+			return 0;
+		sim->noack = 1;
+		return sprintf(reply, "OK");
+	}
+	if (len == 1 && pkt[0] == '?') {
+		sim->running = 0;
+		return sprintf(reply, "S05");
+	}
+	if (len > 1 && (pkt[0] == 'x' || pkt[0] == 'X')) {
+		addr = strtoul(pkt + 1, &end, 16);
+		alen = strtoul(end + 1, &end, 16);
+		if (pkt[0] == 'x') {
+			if (alen > sim->read_max)
+				alen = sim->read_max;
+			memcpy(reply, "OK:", 3);
+			return 3 + sim_read(sim, addr, alen, reply + 3);
+		}
+		data = end + 1;
+		if (data + alen <= pkt + len)
+			sim_write(sim, addr, data, alen);
+		return sprintf(reply, "OK");
+	}
+	if (len > 12 && memcmp(pkt, "vFlashErase:", 12) == 0) {
+		addr = strtoul(pkt + 12, &end, 16);
+		alen = strtoul(end + 1, NULL, 16);
+		if (alen == 0) {
+			addr = 0;
+			alen = SIM_FLASH_SIZE;
+		}
+		if (addr < SIM_FLASH_SIZE && alen <= SIM_FLASH_SIZE - addr)
+			memset(sim->flash + addr, 0xff, alen);
+		return sprintf(reply, "OK");
+	}
+	if (len > 12 && memcmp(pkt, "vFlashWrite:", 12) == 0) {
+		addr = strtoul(pkt + 12, &end, 16);
+		data = end + 1;
+		alen = pkt + len - data;
+		if (addr < SIM_FLASH_SIZE && alen <= SIM_FLASH_SIZE - addr)
+			for (i = 0; i < alen; i++)
+				sim->flash[addr+i] &= data[i];
+		return sprintf(reply, "OK");
+	}
+	return 0;
+}
+
+static int write_all(int fd, const char *data, int len)
+{
+	int retlen, pos;
+
+	for (pos = 0; pos < len; pos += retlen) {
+		retlen = write(fd, data + pos, len - pos);
+		if (retlen == -1 && errno == EINTR)
+			retlen = 0;
+		else if (retlen == -1)
+			return -1;
+	}
+	return len;
+}
+
+/* '$', the reply with '$', '#', '}' and '*' escaped, '#' and the sum */
+int sim_frame(const char *reply, int len, char *wire)
+{
+	uint8_t sum;
+	int i, o;
+	char cc;
+
+	o = 0;
+	sum = 0;
+	wire[o++] = START;
+	for (i = 0; i < len; i++) {
+		cc = reply[i];
+		if (cc == START || cc == END || cc == ESCAPE || cc == STAR) {
+			wire[o++] = ESCAPE;
+			sum += ESCAPE;
+			cc ^= 0x20;
+		}
+		wire[o++] = cc;
+		sum += cc;
+	}
+	o += sprintf(wire + o, "%c%02x", END, sum);
+	return o;
+}
+
+static inline int sim_fault(struct sim_target *sim, int percent)
+{
+	return percent > 0 && rand_r(&sim->seed) % 100 < percent;
+}
+
+/* wait for the host to NAK a corrupted reply */
+static int sim_wait_nak(int fd)
+{
+	struct pollfd pfd;
+	char cc;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	while (poll(&pfd, 1, NAK_WAIT_MS) == 1) {
+		if (read(fd, &cc, 1) != 1)
+			return 0;
+		if (cc == '-')
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * Ack, answer after the latency and bandwidth delays, inject faults.
+ * The ack is a transfer of its own and pays the latency too. Without
+ * acks a corrupted reply is not followed by a good one, the host sends
+ * the request again.
+ */
+static int sim_answer(struct sim_target *sim, int fd, int plen, int wire_in)
+{
+	uint64_t delay;
+	int rlen, acks;
+	char cc;
+
+	acks = !sim->noack;
+	if (acks && sim_fault(sim, sim->faults.nak)) {
+		sim->stats.naks++;
+		return write_all(fd, "-", 1);
+	}
+	if (acks && sim_fault(sim, sim->faults.drop_ack))
+		sim->stats.acks_dropped++;
+	else if (acks) {
+		if (sim->latency_us)
+			usleep(sim->latency_us);
+		if (write_all(fd, "+", 1) == -1)
+			return -1;
+	}
+	rlen = sim_handle(sim, sim->pkt, plen, sim->reply);
+	rlen = sim_frame(sim->reply, rlen, sim->wire);
+	delay = sim->latency_us;
+	if (sim->bandwidth > 0)
+		delay += (uint64_t)(wire_in + rlen) * 1000000 / sim->bandwidth;
+	if (delay)
+		usleep(delay);
+	sim->stats.bytes_out += rlen;
+	if (sim_fault(sim, sim->faults.corrupt)) {
+		sim->stats.corrupted++;
+		cc = sim->wire[rlen-1];
+		sim->wire[rlen-1] = cc == '0'? '1' : '0';
+		if (write_all(fd, sim->wire, rlen) == -1)
+			return -1;
+		sim->wire[rlen-1] = cc;
+		if (!acks)
+			return 0;
+		sim_wait_nak(fd);
+	}
+	return write_all(fd, sim->wire, rlen);
+}
+
+/*
+ * Serve packets arriving on fd until it is closed. Every good packet is
+ * acknowledged and answered, a corrupted one NAKed. Returns 0 when the
+ * peer went away, -1 on an error.
+ */
+int sim_serve(struct sim_target *sim, int fd)
+{
+	const char *pos, *end, *hash, *start;
+	unsigned int csum;
+	int ilen, len, plen;
+	uint8_t sum;
+	char cc;
+
+	/* every client starts in acked mode */
+	sim->noack = 0;
+	ilen = 0;
+	for (;;) {
+		len = read(fd, sim->ibuf + ilen, SIM_BUFSIZE - ilen);
+		if (len == -1 && errno == EINTR) {
+			if (sim->stop)
+				return 0;
+			continue;
+		}
+		if (len == 0 || (len == -1 && errno == EIO))
+			return 0;
+		if (len == -1)
+			return -1;
+		sim->stats.bytes_in += len;
+		ilen += len;
+		pos = sim->ibuf;
+		end = sim->ibuf + ilen;
+		while (pos < end) {
+			if (*pos != START) {
+				pos++;
+				continue;
+			}
+			hash = memchr(pos, END, end - pos);
+			if (!hash || end - hash < END_LEN)
+				break;
+			start = pos;
+			sum = 0;
+			plen = 0;
+			for (pos++; pos < hash; pos++) {
+				cc = *pos;
+				sum += cc;
+				if (cc == ESCAPE && pos + 1 < hash) {
+					cc = *++pos ^ 0x20;
+					sum += *pos;
+				}
+				sim->pkt[plen++] = cc;
+			}
+			/* sim_handle parses numbers with strtoul */
+			sim->pkt[plen] = '\0';
+			pos = hash + END_LEN;
+			if (sscanf(hash + 1, "%2x", &csum) != 1 || csum != sum) {
+				if (write_all(fd, "-", 1) == -1)
+					return -1;
+				continue;
+			}
+			if (sim_answer(sim, fd, plen, pos - start) == -1)
+				return -1;
+			if (sim->dropped)
+				return 0;
+		}
+		ilen = end - pos;
+		memmove(sim->ibuf, pos, ilen);
+		if (ilen == SIM_BUFSIZE)
+			ilen = 0;
+	}
+}
@@ -0,0 +1,64 @@
+#ifndef SIMCORE_DSCAO__
+#define SIMCORE_DSCAO__
+#include <stdint.h>
+#include "icdi.h"
+#include "tm4c123x.h"
+
+/*
+ * A TM4C123GH6PM behind an ICDI adapter, as far as the tools can tell:
+ * flash, SRAM and a few system registers answered through the GDB
+ * remote protocol on a descriptor, usually the master side of a pty.
+ */
+#define SIM_FLASH_SIZE	(256*1024)
+#define SIM_MAX_REGS	64
+#define SIM_READ_MAX	4096
+
+struct sim_reg {
+	uint32_t addr;
+	uint32_t val;
+};
+
+/* faults injected per packet, in percent */
+struct sim_faults {
+	int drop_ack;		/* no '+' before the reply */
+	int nak;		/* '-' instead of an answer, to be resent */
+	int corrupt;		/* reply with a bad checksum first */
+};
+
+struct sim_stats {
+	unsigned long packets;
+	unsigned long acks_dropped;
+	unsigned long naks;
+	unsigned long corrupted;
+	unsigned long bytes_in, bytes_out;
+};
+
+struct sim_target {
+	int pktsize;		/* reported in qSupported */
+	int read_max;		/* largest x reply */
+	int latency_us;		/* added to every transfer to the host */
+	long bandwidth;		/* link bytes per second, 0 unlimited */
+	int ack_only;		/* refuse QStartNoAckMode */
+	int noack;		/* in no-ack mode since QStartNoAckMode */
+	int drop_reset_ms;	/* a chip reset drops the link this long */
+	int dropped;		/* it did, sim_serve() returned */
+	struct sim_faults faults;
+	unsigned int seed;
+	struct sim_stats stats;
+	volatile int stop;	/* set from a signal handler to end sim_serve */
+	int running;		/* core not halted */
+	uint32_t dcrdr;
+	uint32_t coreg[32];
+	int nregs;
+	struct sim_reg regs[SIM_MAX_REGS];
+	char *ibuf, *pkt, *reply, *wire;
+	uint8_t sram[SRAM_SIZE];
+	uint8_t flash[SIM_FLASH_SIZE];
+};
+
+struct sim_target *sim_alloc(void);
+void sim_free(struct sim_target *sim);
+int sim_handle(struct sim_target *sim, const char *pkt, int len, char *reply);
+int sim_frame(const char *reply, int len, char *wire);
+int sim_serve(struct sim_target *sim, int fd);
+#endif /* SIMCORE_DSCAO__ */
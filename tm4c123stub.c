@@ -0,0 +1,304 @@
+#include <stdio.h>
+#include <string.h>
+#include "icdi.h"
+#include "tm4c123x.h"
+#include "tm4c123stub.h"
+
+/* deadline for the loader to program one buffer */
+#define LOADER_DEADLINE_US	3000000
+/* deadline for the CRC stub, at well under a microsecond per byte */
+#define CRC_DEADLINE_US		5000000
+
+/*
+ * Flash loader, Thumb-2, assembled for STUB_CODE:
+ *
+ *	cpsid	i
+ *	ldr	r4, =STUB_CTRL
+ *	ldr	r5, =FM_CTRL_BASE
+ *	movs	r6, #0			@ buffer in turn
+ * next:
+ *	movs	r0, #12
+ *	mla	r7, r6, r0, r4
+ *	adds	r7, #8			@ r7: its descriptor
+ *	ldr	r3, =LOADER_BUF0
+ *	mov.w	r0, #LOADER_BUFSIZE
+ *	mla	r3, r6, r0, r3		@ r3: its data
+ * wait:
+ *	ldr	r0, [r4, #4]
+ *	cmp	r0, #0
+ *	bne	exit
+ *	ldr	r0, [r7]
+ *	cmp	r0, #1			@ LOADER_READY
+ *	bne	wait
+ *	ldr	r1, [r7, #4]		@ flash address
+ *	ldr	r2, [r7, #8]		@ length, multiple of 128
+ *	mvn	r0, #0
+ *	str	r0, [r5, #0x14]		@ clear FCMISC
+ * block:
+ *	cbz	r2, done
+ *	add	r8, r5, #0x100
+ *	movs	r0, #32
+ * copy:
+ *	ldr	r9, [r3], #4
+ *	str	r9, [r8], #4		@ fill FWB0..31
+ *	subs	r0, #1
+ *	bne	copy
+ *	str	r1, [r5]		@ FMA
+ *	ldr	r0, [r4]
+ *	str	r0, [r5, #0x20]		@ FMC2 = key | WRBUF
+ * poll:
+ *	ldr	r0, [r5, #0x20]
+ *	lsls	r0, r0, #31
+ *	bne	poll
+ *	ldr	r0, [r5, #0x0c]
+ *	movw	r9, #0x2e01		@ LOADER_FCRIS_ERRORS
+ *	tst	r0, r9
+ *	bne	fail
+ *	adds	r1, #128
+ *	subs	r2, #128
+ *	b	block
+ * fail:
+ *	movs	r0, #3			@ LOADER_ERROR
+ *	b	report
+ * done:
+ *	movs	r0, #2			@ LOADER_DONE
+ * report:
+ *	str	r0, [r7]
+ *	eor	r6, r6, #1
+ *	b	next
+ * exit:
+ *	bkpt	#0
+ *	b	exit
+ */
+static const uint8_t loader_code[] = {
+	0x72, 0xb6, 0x1c, 0x4c, 0x1c, 0x4d, 0x00, 0x26, 0x0c, 0x20, 0x06, 0xfb,
+	0x00, 0x47, 0x08, 0x37, 0x1a, 0x4b, 0x4f, 0xf4, 0x00, 0x50, 0x06, 0xfb,
+	0x00, 0x33, 0x60, 0x68, 0x00, 0x28, 0x27, 0xd1, 0x38, 0x68, 0x01, 0x28,
+	0xf9, 0xd1, 0x79, 0x68, 0xba, 0x68, 0x6f, 0xf0, 0x00, 0x00, 0x68, 0x61,
+	0xca, 0xb1, 0x05, 0xf5, 0x80, 0x78, 0x20, 0x20, 0x53, 0xf8, 0x04, 0x9b,
+	0x48, 0xf8, 0x04, 0x9b, 0x01, 0x38, 0xf9, 0xd1, 0x29, 0x60, 0x20, 0x68,
+	0x28, 0x62, 0x28, 0x6a, 0xc0, 0x07, 0xfc, 0xd1, 0xe8, 0x68, 0x42, 0xf6,
+	0x01, 0x69, 0x10, 0xea, 0x09, 0x0f, 0x02, 0xd1, 0x80, 0x31, 0x80, 0x3a,
+	0xe6, 0xe7, 0x03, 0x20, 0x00, 0xe0, 0x02, 0x20, 0x38, 0x60, 0x86, 0xf0,
+	0x01, 0x06, 0xcb, 0xe7, 0x00, 0xbe, 0xfd, 0xe7, 0x00, 0x01, 0x00, 0x20,
+	0x00, 0xd0, 0x0f, 0x40, 0x00, 0x04, 0x00, 0x20
+};
+
+/*
+ * CRC-32 stub, Thumb-2, assembled for STUB_CODE:
+ *
+ *	cpsid	i
+ *	ldr	r4, =STUB_CTRL
+ *	ldr	r5, =CRC_TABLE
+ *	ldr	r6, =0xedb88320
+ *	movs	r0, #0
+ * mktab:
+ *	mov	r1, r0
+ *	movs	r2, #8
+ * bit:
+ *	lsrs	r1, r1, #1
+ *	it	cs
+ *	eorcs	r1, r1, r6
+ *	subs	r2, #1
+ *	bne	bit
+ *	str	r1, [r5, r0, lsl #2]	@ table entry of byte r0
+ *	adds	r0, #1
+ *	cmp	r0, #256
+ *	bne	mktab
+ *	ldr	r7, [r4]		@ ranges
+ *	adds	r3, r4, #4		@ r3: the first one
+ * range:
+ *	cbz	r7, exit
+ *	ldr	r1, [r3]		@ address
+ *	ldr	r2, [r3, #4]		@ length
+ *	mvn	r0, #0
+ * byte:
+ *	cbz	r2, store
+ *	ldrb	r6, [r1], #1
+ *	eors	r6, r0
+ *	uxtb	r6, r6
+ *	ldr	r6, [r5, r6, lsl #2]
+ *	eor	r0, r6, r0, lsr #8
+ *	subs	r2, #1
+ *	b	byte
+ * store:
+ *	mvns	r0, r0
+ *	str	r0, [r3, #8]
+ *	adds	r3, #12
+ *	subs	r7, #1
+ *	b	range
+ * exit:
+ *	bkpt	#0
+ *	b	exit
+ */
+static const uint8_t crc_code[] = {
+	0x72, 0xb6, 0x15, 0x4c, 0x15, 0x4d, 0x16, 0x4e, 0x00, 0x20, 0x01, 0x46,
+	0x08, 0x22, 0x49, 0x08, 0x28, 0xbf, 0x71, 0x40, 0x01, 0x3a, 0xfa, 0xd1,
+	0x45, 0xf8, 0x20, 0x10, 0x01, 0x30, 0xb0, 0xf5, 0x80, 0x7f, 0xf2, 0xd1,
+	0x27, 0x68, 0x23, 0x1d, 0x9f, 0xb1, 0x19, 0x68, 0x5a, 0x68, 0x6f, 0xf0,
+	0x00, 0x00, 0x4a, 0xb1, 0x11, 0xf8, 0x01, 0x6b, 0x46, 0x40, 0xf6, 0xb2,
+	0x55, 0xf8, 0x26, 0x60, 0x86, 0xea, 0x10, 0x20, 0x01, 0x3a, 0xf4, 0xe7,
+	0xc0, 0x43, 0x98, 0x60, 0x0c, 0x33, 0x01, 0x3f, 0xea, 0xe7, 0x00, 0xbe,
+	0xfd, 0xe7, 0x00, 0x00, 0x00, 0x01, 0x00, 0x20, 0x00, 0x10, 0x00, 0x20,
+	0x20, 0x83, 0xb8, 0xed
+};
+
+/*
+ * Load code at STUB_CODE and its control block at STUB_CTRL into the
+ * halted core, then start the code with interrupts masked.
+ */
+int stub_start(struct icdibuf *buf, const uint8_t *code, int len,
+		const char *ctrl, int clen)
+{
+	if (!tm4c123_debug_ready(buf)) {
+		fprintf(stderr, "Target not halted, cannot load stub\n");
+		return 0;
+	}
+	if (!icdi_writebin(buf, STUB_CODE, (const char *)code, len) ||
+		!icdi_writebin(buf, STUB_CTRL, ctrl, clen)) {
+		fprintf(stderr, "Cannot load stub into SRAM\n");
+		return 0;
+	}
+	if (!tm4c123_write_coreg(buf, COREG_SPECIAL, 1) ||
+		!tm4c123_write_coreg(buf, COREG_XPSR, XPSR_THUMB) ||
+		!tm4c123_write_coreg(buf, COREG_SP, STUB_STACK) ||
+		!tm4c123_write_coreg(buf, COREG_PC, STUB_CODE)) {
+		fprintf(stderr, "Cannot set up core registers\n");
+		return 0;
+	}
+	if (!tm4c123_resume(buf)) {
+		fprintf(stderr, "Cannot start stub\n");
+		return 0;
+	}
+	return 1;
+}
+
+/* wait until the loader is done with buffer n */
+static int loader_wait(struct icdibuf *buf, int n)
+{
+	uint32_t state;
+	uint64_t start;
+
+	start = icdi_now_us();
+	do {
+		if (!icdi_readu32(buf, STUB_CTRL + LOADER_DESC(n), &state))
+			return 0;
+		if (state != LOADER_READY)
+			return state != LOADER_ERROR;
+	} while (icdi_now_us() - start < LOADER_DEADLINE_US);
+	fprintf(stderr, "Flash loader timed out\n");
+	return 0;
+}
+
+/*
+ * Program len bytes of already erased flash at addr through the SRAM
+ * loader. The host copies each chunk into one buffer while the loader
+ * programs the other, so the link is busy all the time. Leaves the core
+ * halted at the loader's breakpoint.
+ */
+int stub_flash(struct icdibuf *buf, uint32_t addr, const char *data, int len)
+{
+	uint32_t ctrl[8], bootcfg, desc[2];
+	char *chunk;
+	int pos, cklen, blen, n, ok;
+
+	if ((addr % LOADER_BLOCK) != 0) {
+		fprintf(stderr, "Address is not divisible by %d\n",
+			LOADER_BLOCK);
+		return 0;
+	}
+	if (!icdi_readu32(buf, SCSP_BASE+BOOTCFG_OFFSET, &bootcfg)) {
+		fprintf(stderr, "Cannot read BOOTCFG\n");
+		return 0;
+	}
+	memset(ctrl, 0, sizeof(ctrl));
+	ctrl[LOADER_KEY/4] = ((bootcfg & BOOTCFG_KEY)? FMC_WRKEY_A442 :
+			FMC_WRKEY_71D5) | FMC2_WRBUF;
+	if (!stub_start(buf, loader_code, sizeof(loader_code),
+				(const char *)ctrl, sizeof(ctrl)))
+		return 0;
+
+	chunk = malloc(LOADER_BUFSIZE);
+	if (!chunk) {
+		fprintf(stderr, "Out of Memory!\n");
+		return 0;
+	}
+	ok = 1;
+	for (pos = 0, n = 0; pos < len && ok; pos += cklen, n ^= 1) {
+		cklen = len - pos > LOADER_BUFSIZE? LOADER_BUFSIZE : len - pos;
+		blen = (cklen + LOADER_BLOCK - 1) / LOADER_BLOCK * LOADER_BLOCK;
+		memcpy(chunk, data + pos, cklen);
+		/* programming 0xff leaves erased flash untouched */
+		memset(chunk + cklen, 0xff, blen - cklen);
+		if (pos >= 2*LOADER_BUFSIZE && !loader_wait(buf, n)) {
+			fprintf(stderr, "Flash loader failed below %08X\n",
+				addr + pos);
+			ok = 0;
+			break;
+		}
+		desc[0] = addr + pos;
+		desc[1] = blen;
+		ok = icdi_writebin(buf, LOADER_BUF0 + n*LOADER_BUFSIZE, chunk,
+				blen) &&
+			icdi_writebin(buf, STUB_CTRL + LOADER_DESC(n) + 4,
+				(const char *)desc, sizeof(desc)) &&
+			icdi_writeu32(buf, STUB_CTRL + LOADER_DESC(n),
+				LOADER_READY);
+		if (!ok)
+			fprintf(stderr, "Cannot feed flash loader at %08X\n",
+				addr + pos);
+	}
+	free(chunk);
+	for (n = 0; n < 2 && ok; n++)
+		if (!loader_wait(buf, n)) {
+			fprintf(stderr, "Flash loader failed\n");
+			ok = 0;
+		}
+
+	if (!icdi_writeu32(buf, STUB_CTRL + LOADER_EXIT, 1) ||
+			!tm4c123_wait_halt(buf, LOADER_DEADLINE_US)) {
+		fprintf(stderr, "Flash loader did not stop\n");
+		ok = 0;
+	}
+	return ok;
+}
+
+/*
+ * Have the core compute the CRC-32 of n ranges of its memory, at most
+ * CRC_MAX_RANGES per run of the stub, so only the results cross the
+ * link. Leaves the core halted at the stub's breakpoint.
+ */
+int stub_crc32(struct icdibuf *buf, struct stub_range *ranges, int n)
+{
+	char *ctrl;
+	uint32_t count;
+	int pos, k;
+
+	ctrl = malloc(CRC_RANGE(CRC_MAX_RANGES));
+	if (!ctrl) {
+		fprintf(stderr, "Out of Memory!\n");
+		return 0;
+	}
+	for (pos = 0; pos < n; pos += k) {
+		k = n - pos > CRC_MAX_RANGES? CRC_MAX_RANGES : n - pos;
+		count = k;
+		memcpy(ctrl + CRC_COUNT, &count, 4);
+		memcpy(ctrl + CRC_RANGE(0), ranges + pos, k * sizeof(*ranges));
+		if (!stub_start(buf, crc_code, sizeof(crc_code), ctrl,
+					CRC_RANGE(k)))
+			break;
+		if (!tm4c123_wait_halt(buf, CRC_DEADLINE_US)) {
+			fprintf(stderr, "CRC stub did not stop\n");
+			break;
+		}
+		if (icdi_readbin(buf, STUB_CTRL + CRC_RANGE(0),
+				k * sizeof(*ranges), ctrl) !=
+				(int)(k * sizeof(*ranges))) {
+			fprintf(stderr, "Cannot read the CRC results\n");
+			break;
+		}
+		memcpy(ranges + pos, ctrl, k * sizeof(*ranges));
+	}
+	free(ctrl);
+	return pos >= n;
+}
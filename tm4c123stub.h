@@ -0,0 +1,53 @@
+#ifndef TM4C123STUB_DSCAO__
+#define TM4C123STUB_DSCAO__
+#include "icdi.h"
+#include "tm4c123x.h"
+/*
+ * Routines run from TM4C123x SRAM. The code sits at the start of SRAM,
+ * its control block right after it and the stack at the top.
+ */
+#define STUB_CODE	SRAM_BASE
+#define STUB_CTRL	(SRAM_BASE + 0x100)
+#define STUB_STACK	(SRAM_BASE + SRAM_SIZE)
+
+/*
+ * Flash loader: two SRAM buffers the host fills in turn while the stub
+ * programs the other one through the flash write buffer.
+ */
+#define LOADER_BUF0	(SRAM_BASE + 0x400)
+#define LOADER_BUFSIZE	0x2000
+#define LOADER_BLOCK	(FWB_WORDS*4)
+/* FCRIS bits that fail a block, checked after every one */
+#define LOADER_FCRIS_ERRORS	(FCRIS_ARIS | FCRIS_VOLTRIS | FCRIS_INVDRIS | \
+				 FCRIS_ERRIS | FCRIS_PROGRIS)
+
+/* control block of the loader, all words */
+#define LOADER_KEY	0x00	/* FMC2 key | WRBUF */
+#define LOADER_EXIT	0x04	/* non-zero: stop with a breakpoint */
+#define LOADER_DESC(n)	(0x08 + (n)*12)	/* state, flash address, length */
+
+enum loader_state {
+	LOADER_EMPTY, LOADER_READY, LOADER_DONE, LOADER_ERROR
+};
+
+/*
+ * CRC-32 stub: stores the CRC-32 of every range of its control block in
+ * the range's last word, then stops with a breakpoint. The byte table
+ * it builds first sits at CRC_TABLE.
+ */
+#define CRC_COUNT	0x00	/* ranges that follow */
+#define CRC_RANGE(n)	(0x04 + (n)*12)	/* address, length, CRC-32 */
+#define CRC_MAX_RANGES	256
+#define CRC_TABLE	(SRAM_BASE + 0x1000)
+
+struct stub_range {
+	uint32_t addr;
+	uint32_t len;
+	uint32_t crc;
+};
+
+int stub_start(struct icdibuf *buf, const uint8_t *code, int len,
+		const char *ctrl, int clen);
+int stub_flash(struct icdibuf *buf, uint32_t addr, const char *data, int len);
+int stub_crc32(struct icdibuf *buf, struct stub_range *ranges, int n);
+#endif /* TM4C123STUB_DSCAO__ */
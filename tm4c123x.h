@@ -1,52 +1,208 @@
 #ifndef TM4C123X_DSCAO__
 #define TM4C123X_DSCAO__
+#include <stdio.h>
 #include <time.h>
 #include "icdi.h"
 /*
  * Memory Addresses of TM4C123x control (system and periperal)
  */
 #define FM_CTRL_BASE	0x400fd000
+#define FMA_OFFSET	0x000
+#define FMD_OFFSET	0x004
+#define FMC_OFFSET	0x008
+#define FCRIS_OFFSET	0x00c
+#define FCMISC_OFFSET	0x014
+#define FMC2_OFFSET	0x020
+#define FWB_OFFSET	0x100
 #define FSIZE_OFFSET	0x0fc0
+#define FMC_WRKEY_A442	0xa4420000
+#define FMC_WRKEY_71D5	0x71d50000
+#define FMC2_WRBUF	(1<<0)
+#define FCRIS_ARIS	(1<<0)	/* access violation */
+#define FCRIS_PRIS	(1<<1)	/* programming done, not an error */
+#define FCRIS_VOLTRIS	(1<<9)
+#define FCRIS_INVDRIS	(1<<10)	/* a 0 bit programmed back to 1 */
+#define FCRIS_ERRIS	(1<<11)
+#define FCRIS_PROGRIS	(1<<13)
+#define FWB_WORDS	32
+
+#define SRAM_BASE	0x20000000
+#define SRAM_SIZE	0x8000
 
 #define SCSP_BASE	0x400fe000
 #define DID0_OFFSET	0x0
 #define DID1_OFFSET	0x4
+#define PBORCTL_OFFSET	0x030
+#define RIS_OFFSET	0x050
+#define IMC_OFFSET	0x054
+#define MISC_OFFSET	0x058
+#define RESC_OFFSET	0x05c
 #define RCC_OFFSET	0x060
+#define GPIOHBCTL_OFFSET	0x06c
+#define RCC2_OFFSET	0x070
+#define MOSCCTL_OFFSET	0x07c
+#define DSLPCLKCFG_OFFSET	0x144
+#define SYSPROP_OFFSET	0x14c
+#define PLLSTAT_OFFSET	0x168
 #define RM_CTRL_OFFSET	0x0f0
+#define BOOTCFG_OFFSET	0x1d0
+#define BOOTCFG_KEY	(1<<4)
 
 #define SCSS_BASE	0xe000e000
+#define SCSS_ACTLR_OFFSET	0x008
 #define SCSS_STCTRL_OFFSET	0x010
+#define SCSS_STRELOAD_OFFSET	0x014
+#define SCSS_STCURRENT_OFFSET	0x018
 #define SCSS_EN0_OFFSET	0x100
 #define SCSS_EN1_OFFSET	0x104
 #define SCSS_EN2_OFFSET	0x108
 #define SCSS_EN3_OFFSET	0x10c
+#define SCSS_PEND0_OFFSET	0x200
+#define SCSS_ACTIVE0_OFFSET	0x300
 #define SCSS_PRI0_OFFSET	0x400
+#define SCSS_CPUID_OFFSET	0xd00
+#define SCSS_INTCTRL_OFFSET	0xd04
+#define SCSS_VTABLE_OFFSET	0xd08
+#define SCSS_APINT_OFFSET	0xd0c
+#define SCSS_SYSCTRL_OFFSET	0xd10
+#define SCSS_CFGCTRL_OFFSET	0xd14
+#define SCSS_SYSPRI1_OFFSET	0xd18
+#define SCSS_SYSPRI2_OFFSET	0xd1c
+#define SCSS_SYSPRI3_OFFSET	0xd20
+#define SCSS_SYSHNDCTRL_OFFSET	0xd24
+#define SCSS_FAULTSTAT_OFFSET	0xd28
+#define SCSS_HFAULTSTAT_OFFSET	0xd2c
+#define SCSS_DFSR_OFFSET	0xd30
+#define SCSS_MMADDR_OFFSET	0xd34
+#define SCSS_FAULTADDR_OFFSET	0xd38
+#define SCSS_CPAC_OFFSET	0xd88
+#define SCSS_FPCC_OFFSET	0xf34
+#define SCSS_FPCA_OFFSET	0xf38
+#define NVIC_REGS	5	/* EN, PEND, ACTIVE registers for 139 IRQs */
+#define NVIC_PRI_REGS	35
 
 #define DHCSR		0xe000edf0
 #define DHCSR_S_LOCKUP	(1<<19)
 #define DHCSR_S_SLEEP	(1<<18)
 #define DHCSR_S_HALT	(1<<17)
 #define DHCSR_S_REGRDY	(1<<16)
+#define DHCSR_DBGKEY	0xa05f0000
+#define DHCSR_C_MASKINTS	(1<<3)
+#define DHCSR_C_HALT	(1<<1)
+#define DHCSR_C_DEBUGEN	(1<<0)
+#define DCRSR		0xe000edf4
+#define DCRSR_REGWNR	(1<<16)
+#define DCRDR		0xe000edf8
+
+/* DCRSR register selectors */
+#define COREG_SP	13
+#define COREG_PC	15	/* debug return address */
+#define COREG_XPSR	16
+#define COREG_SPECIAL	20	/* CONTROL, FAULTMASK, BASEPRI, PRIMASK */
+#define XPSR_THUMB	(1<<24)
 
 #define FP_CTRL		0xe0002000
 
-static inline int tm4c123_debug_ready(struct icdibuf *buf)
+/* deadline and poll intervals of the wait for the core to halt */
+#define READY_DEADLINE_US	1000000
+#define READY_POLL_MIN_US	100
+#define READY_POLL_MAX_US	20000
+
+/*
+ * Poll DHCSR until the core is halted with its registers ready, or the
+ * deadline expires. The first poll is immediate and the interval then
+ * doubles from READY_POLL_MIN_US up to READY_POLL_MAX_US, so a target
+ * that is already halted or halts quickly costs no sleep at all.
+ */
+static inline int tm4c123_wait_halt(struct icdibuf *buf, uint64_t deadline_us)
 {
 	uint32_t dhcsr;
-	int count;
+	uint64_t start, now;
+	int ready, polls;
+	long interval;
 	struct timespec sl;
 
-	sl.tv_sec = 0;
-	sl.tv_nsec = 100000000;
-	count = 0;
+	start = icdi_now_us();
+	interval = READY_POLL_MIN_US;
+	polls = 0;
 	do {
 		dhcsr = 0;
 		icdi_readu32(buf, DHCSR, &dhcsr);
-		if ((dhcsr & DHCSR_S_HALT) && (dhcsr & DHCSR_S_REGRDY))
+		polls++;
+		ready = (dhcsr & DHCSR_S_HALT) && (dhcsr & DHCSR_S_REGRDY);
+		now = icdi_now_us();
+		if (ready || now - start >= deadline_us)
 			break;
+		if (interval > deadline_us - (now - start))
+			interval = deadline_us - (now - start);
+		sl.tv_sec = 0;
+		sl.tv_nsec = interval * 1000;
 		nanosleep(&sl, NULL);
-		count++;
-	} while (count < 10);
-	return count < 10;
+		interval *= 2;
+		if (interval > READY_POLL_MAX_US)
+			interval = READY_POLL_MAX_US;
+	} while (1);
+
+	buf->halted = ready;
+	buf->wstat.waits++;
+	buf->wstat.polls += polls;
+	buf->wstat.last_polls = polls;
+	buf->wstat.last_usecs = now - start;
+	buf->wstat.usecs += now - start;
+	if (now - start > buf->wstat.max_usecs)
+		buf->wstat.max_usecs = now - start;
+	return ready;
+}
+
+/*
+ * Make sure the core is halted. Skipped when the previous operation
+ * already proved it: buf->halted is cleared by any failed operation and
+ * by debug commands that may reset or resume the core.
+ */
+static inline int tm4c123_debug_ready(struct icdibuf *buf)
+{
+	if (buf->halted) {
+		buf->wstat.skips++;
+		return 1;
+	}
+	return tm4c123_wait_halt(buf, READY_DEADLINE_US);
 };
+
+/* write a core register of the halted core through DCRDR/DCRSR */
+static inline int tm4c123_write_coreg(struct icdibuf *buf, int reg,
+		uint32_t val)
+{
+	uint32_t dhcsr;
+	int count;
+
+	if (!icdi_writeu32(buf, DCRDR, val) ||
+		!icdi_writeu32(buf, DCRSR, DCRSR_REGWNR | reg))
+		return 0;
+	for (count = 0; count < 10; count++) {
+		if (!icdi_readu32(buf, DHCSR, &dhcsr))
+			return 0;
+		if (dhcsr & DHCSR_S_REGRDY)
+			return 1;
+	}
+	return 0;
+}
+
+/* let the halted core run, with interrupts masked */
+static inline int tm4c123_resume(struct icdibuf *buf)
+{
+	buf->halted = 0;
+	return icdi_writeu32(buf, DHCSR, DHCSR_DBGKEY | DHCSR_C_MASKINTS |
+			DHCSR_C_DEBUGEN);
+}
+
+static inline void tm4c123_wait_report(const struct icdibuf *buf,
+		const char *tag)
+{
+	const struct icdi_waitstat *ws = &buf->wstat;
+
+	printf("%sReady waits: %u (%u skipped), polls: %u, total %lums, " \
+		"longest %lums\n", tag, ws->waits, ws->skips, ws->polls,
+		(unsigned long)(ws->usecs/1000),
+		(unsigned long)(ws->max_usecs/1000));
+}
 #endif /* TM4C123X_DSCAO__ */
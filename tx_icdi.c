@@ -3,28 +3,261 @@
 #include <errno.h>
 #include <unistd.h>
 #include <assert.h>
-#include "miscutils.h"
+#include <getopt.h>
 #include "icdi.h"
 #include "tm4c123x.h"
 
+/* registers read for the chip summary, sorted by address */
+enum info_regs {
+	INFO_FSIZE, INFO_DID0, INFO_DID1, INFO_RM_CTRL,
+	INFO_STCTRL, INFO_EN0, INFO_PRI0, INFO_REGS
+};
+
+static const uint32_t info_addrs[INFO_REGS] = {
+	[INFO_FSIZE] = FM_CTRL_BASE+FSIZE_OFFSET,
+	[INFO_DID0] = SCSP_BASE+DID0_OFFSET,
+	[INFO_DID1] = SCSP_BASE+DID1_OFFSET,
+	[INFO_RM_CTRL] = SCSP_BASE+RM_CTRL_OFFSET,
+	[INFO_STCTRL] = SCSS_BASE+SCSS_STCTRL_OFFSET,
+	[INFO_EN0] = SCSS_BASE+SCSS_EN0_OFFSET,
+	[INFO_PRI0] = SCSS_BASE+SCSS_PRI0_OFFSET,
+};
+
+/*
+ * Snapshot of the system control, NVIC, SysTick and SCB registers for
+ * fault triage. Blocks of registers are listed by address so that
+ * icdi_readv() fetches each contiguous run with one packet.
+ */
+enum snap_decode {
+	SNAP_HEX,	/* value only */
+	SNAP_BITS,	/* names of the set bits */
+	SNAP_IRQS,	/* one bit per interrupt */
+	SNAP_PRI,	/* four 3-bit priorities per register */
+	SNAP_VECT,	/* INTCTRL active and pending vectors */
+};
+
+struct snap_bit {
+	int bit;
+	const char *name;
+};
+
+struct snap_block {
+	const char *name;
+	uint32_t addr;
+	int count;
+	enum snap_decode decode;
+	const struct snap_bit *bits;
+};
+
+static const struct snap_bit resc_bits[] = {
+	{0, "EXT"}, {1, "POR"}, {2, "BOR"}, {3, "WDT0"}, {4, "SW"},
+	{5, "WDT1"}, {16, "MOSCFAIL"}, {-1, NULL}
+};
+static const struct snap_bit stctrl_bits[] = {
+	{0, "ENABLE"}, {1, "INTEN"}, {2, "CLK_SRC"}, {16, "COUNT"},
+	{-1, NULL}
+};
+static const struct snap_bit shcsr_bits[] = {
+	{0, "MEMA"}, {1, "BUSA"}, {3, "USGA"}, {7, "SVCA"}, {8, "MON"},
+	{10, "PNDSV"}, {11, "TICK"}, {12, "USAGEP"}, {13, "MEMP"},
+	{14, "BUSP"}, {15, "SVC"}, {16, "MEM"}, {17, "BUS"}, {18, "USAGE"},
+	{-1, NULL}
+};
+static const struct snap_bit cfsr_bits[] = {
+	{0, "IERR"}, {1, "DERR"}, {3, "MUSTKE"}, {4, "MSTKE"}, {5, "MLSPERR"},
+	{7, "MMARV"}, {8, "IBUS"}, {9, "PRECISE"}, {10, "IMPRE"},
+	{11, "BUSTKE"}, {12, "BSTKE"}, {13, "BLSPERR"}, {15, "BFARV"},
+	{16, "UNDEF"}, {17, "INVSTAT"}, {18, "INVPC"}, {19, "NOCP"},
+	{24, "UNALIGN"}, {25, "DIV0"}, {-1, NULL}
+};
+static const struct snap_bit hfsr_bits[] = {
+	{1, "VECT"}, {30, "FORCED"}, {31, "DBG"}, {-1, NULL}
+};
+static const struct snap_bit dfsr_bits[] = {
+	{0, "HALTED"}, {1, "BKPT"}, {2, "DWTTRAP"}, {3, "VCATCH"},
+	{4, "EXTERNAL"}, {-1, NULL}
+};
+
+#define CFSR_MMARV	(1<<7)
+#define CFSR_BFARV	(1<<15)
+
+static const struct snap_block snap_blocks[] = {
+	{"DID0", SCSP_BASE+DID0_OFFSET, 1, SNAP_HEX, NULL},
+	{"DID1", SCSP_BASE+DID1_OFFSET, 1, SNAP_HEX, NULL},
+	{"PBORCTL", SCSP_BASE+PBORCTL_OFFSET, 1, SNAP_HEX, NULL},
+	{"RIS", SCSP_BASE+RIS_OFFSET, 1, SNAP_HEX, NULL},
+	{"IMC", SCSP_BASE+IMC_OFFSET, 1, SNAP_HEX, NULL},
+	{"MISC", SCSP_BASE+MISC_OFFSET, 1, SNAP_HEX, NULL},
+	{"RESC", SCSP_BASE+RESC_OFFSET, 1, SNAP_BITS, resc_bits},
+	{"RCC", SCSP_BASE+RCC_OFFSET, 1, SNAP_HEX, NULL},
+	{"GPIOHBCTL", SCSP_BASE+GPIOHBCTL_OFFSET, 1, SNAP_HEX, NULL},
+	{"RCC2", SCSP_BASE+RCC2_OFFSET, 1, SNAP_HEX, NULL},
+	{"MOSCCTL", SCSP_BASE+MOSCCTL_OFFSET, 1, SNAP_HEX, NULL},
+	{"RM_CTRL", SCSP_BASE+RM_CTRL_OFFSET, 1, SNAP_HEX, NULL},
+	{"DSLPCLKCFG", SCSP_BASE+DSLPCLKCFG_OFFSET, 1, SNAP_HEX, NULL},
+	{"SYSPROP", SCSP_BASE+SYSPROP_OFFSET, 1, SNAP_HEX, NULL},
+	{"PLLSTAT", SCSP_BASE+PLLSTAT_OFFSET, 1, SNAP_HEX, NULL},
+	{"ACTLR", SCSS_BASE+SCSS_ACTLR_OFFSET, 1, SNAP_HEX, NULL},
+	{"STCTRL", SCSS_BASE+SCSS_STCTRL_OFFSET, 1, SNAP_BITS, stctrl_bits},
+	{"STRELOAD", SCSS_BASE+SCSS_STRELOAD_OFFSET, 1, SNAP_HEX, NULL},
+	{"STCURRENT", SCSS_BASE+SCSS_STCURRENT_OFFSET, 1, SNAP_HEX, NULL},
+	{"EN", SCSS_BASE+SCSS_EN0_OFFSET, NVIC_REGS, SNAP_IRQS, NULL},
+	{"PEND", SCSS_BASE+SCSS_PEND0_OFFSET, NVIC_REGS, SNAP_IRQS, NULL},
+	{"ACTIVE", SCSS_BASE+SCSS_ACTIVE0_OFFSET, NVIC_REGS, SNAP_IRQS, NULL},
+	{"PRI", SCSS_BASE+SCSS_PRI0_OFFSET, NVIC_PRI_REGS, SNAP_PRI, NULL},
+	{"CPUID", SCSS_BASE+SCSS_CPUID_OFFSET, 1, SNAP_HEX, NULL},
+	{"INTCTRL", SCSS_BASE+SCSS_INTCTRL_OFFSET, 1, SNAP_VECT, NULL},
+	{"VTABLE", SCSS_BASE+SCSS_VTABLE_OFFSET, 1, SNAP_HEX, NULL},
+	{"APINT", SCSS_BASE+SCSS_APINT_OFFSET, 1, SNAP_HEX, NULL},
+	{"SYSCTRL", SCSS_BASE+SCSS_SYSCTRL_OFFSET, 1, SNAP_HEX, NULL},
+	{"CFGCTRL", SCSS_BASE+SCSS_CFGCTRL_OFFSET, 1, SNAP_HEX, NULL},
+	{"SYSPRI1", SCSS_BASE+SCSS_SYSPRI1_OFFSET, 1, SNAP_HEX, NULL},
+	{"SYSPRI2", SCSS_BASE+SCSS_SYSPRI2_OFFSET, 1, SNAP_HEX, NULL},
+	{"SYSPRI3", SCSS_BASE+SCSS_SYSPRI3_OFFSET, 1, SNAP_HEX, NULL},
+	{"SYSHNDCTRL", SCSS_BASE+SCSS_SYSHNDCTRL_OFFSET, 1, SNAP_BITS,
+		shcsr_bits},
+	{"FAULTSTAT", SCSS_BASE+SCSS_FAULTSTAT_OFFSET, 1, SNAP_BITS, cfsr_bits},
+	{"HFAULTSTAT", SCSS_BASE+SCSS_HFAULTSTAT_OFFSET, 1, SNAP_BITS,
+		hfsr_bits},
+	{"DFSR", SCSS_BASE+SCSS_DFSR_OFFSET, 1, SNAP_BITS, dfsr_bits},
+	{"MMADDR", SCSS_BASE+SCSS_MMADDR_OFFSET, 1, SNAP_HEX, NULL},
+	{"FAULTADDR", SCSS_BASE+SCSS_FAULTADDR_OFFSET, 1, SNAP_HEX, NULL},
+	{"CPAC", SCSS_BASE+SCSS_CPAC_OFFSET, 1, SNAP_HEX, NULL},
+	{"DHCSR", DHCSR, 1, SNAP_HEX, NULL},
+	{"FPCC", SCSS_BASE+SCSS_FPCC_OFFSET, 1, SNAP_HEX, NULL},
+	{"FPCA", SCSS_BASE+SCSS_FPCA_OFFSET, 1, SNAP_HEX, NULL},
+};
+#define SNAP_BLOCKS	(sizeof(snap_blocks)/sizeof(snap_blocks[0]))
+#define SNAP_REGS_MAX	128
+
+static void snap_decode(FILE *out, const struct snap_block *blk, int idx,
+		uint32_t val)
+{
+	const struct snap_bit *bit;
+	int i;
+
+	switch (blk->decode) {
+	case SNAP_BITS:
+		for (bit = blk->bits; bit->name; bit++)
+			if (val & (1u << bit->bit))
+				fprintf(out, " %s", bit->name);
+		break;
+	case SNAP_IRQS:
+		for (i = 0; i < 32; i++)
+			if (val & (1u << i))
+				fprintf(out, " %d", idx*32 + i);
+		break;
+	case SNAP_PRI:
+		for (i = 0; i < 4; i++)
+			if ((val >> (8*i + 5)) & 7)
+				fprintf(out, " %d=%u", idx*4 + i,
+					(val >> (8*i + 5)) & 7);
+		break;
+	case SNAP_VECT:
+		fprintf(out, " VECACT=%u VECPEND=%u", val & 0xff,
+			(val >> 12) & 0xff);
+		break;
+	default:
+		break;
+	}
+}
+
+/*
+ * Read all snapshot registers and write them as a decoded report, one
+ * register per line: name, address, value and the decoded fields.
+ */
+static int snapshot(struct icdibuf *buf, FILE *out)
+{
+	uint32_t addrs[SNAP_REGS_MAX], vals[SNAP_REGS_MAX];
+	uint32_t cfsr, mmaddr, faultaddr;
+	const struct snap_block *blk;
+	int i, k, n, cnt, nread, packets;
+	char name[32];
+
+	cnt = 0;
+	packets = 0;
+	for (i = 0; i < SNAP_BLOCKS; i++)
+		for (k = 0; k < snap_blocks[i].count; k++) {
+			assert(cnt < SNAP_REGS_MAX);
+			addrs[cnt] = snap_blocks[i].addr + 4*k;
+			if (cnt == 0 || addrs[cnt] != addrs[cnt-1] + 4)
+				packets++;
+			cnt++;
+		}
+	nread = icdi_readv(buf, addrs, vals, cnt);
+	if (nread < cnt)
+		fprintf(stderr, "Snapshot stopped at %08X\n", addrs[nread]);
+
+	fprintf(out, "# %d registers in %d reads\n", cnt, packets);
+	cfsr = mmaddr = faultaddr = 0;
+	for (i = 0, n = 0; i < SNAP_BLOCKS && n < nread; i++) {
+		blk = snap_blocks + i;
+		for (k = 0; k < blk->count && n < nread; k++, n++) {
+			if (blk->count > 1)
+				snprintf(name, sizeof(name), "%s%d", blk->name,
+					k);
+			else
+				snprintf(name, sizeof(name), "%s", blk->name);
+			fprintf(out, "%-12s %08X %08X", name, addrs[n],
+				vals[n]);
+			snap_decode(out, blk, k, vals[n]);
+			fprintf(out, "\n");
+			if (addrs[n] == SCSS_BASE+SCSS_FAULTSTAT_OFFSET)
+				cfsr = vals[n];
+			else if (addrs[n] == SCSS_BASE+SCSS_MMADDR_OFFSET)
+				mmaddr = vals[n];
+			else if (addrs[n] == SCSS_BASE+SCSS_FAULTADDR_OFFSET)
+				faultaddr = vals[n];
+		}
+	}
+	if (cfsr & CFSR_MMARV)
+		fprintf(out, "Memory management fault at %08X\n", mmaddr);
+	if (cfsr & CFSR_BFARV)
+		fprintf(out, "Bus fault at %08X\n", faultaddr);
+	return nread == cnt;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [--snapshot] [--output report] port\n",
+		prog);
+}
+
 int main(int argc, char *argv[])
 {
+	static const struct option lopts[] = {
+		{.name = "snapshot", .has_arg = no_argument, .flag = NULL, .val = 's'},
+		{.name = "output", .has_arg = required_argument, .flag = NULL, .val = 'o'},
+		{.name = NULL, .has_arg = 0, .flag = 0, .val = 0}
+	};
 	struct icdibuf *buf;
 	char options[128];
-	uint32_t val, did0, did1;
-	int retv;
-	uint32_t flashsiz, en0, pri0, stctrl;
+	uint32_t vals[INFO_REGS], flashsiz;
+	const char *report;
+	FILE *out;
+	int retv, optc, snap, nread;
 
-	if (!instance_start(lock)) {
-		fprintf(stderr, "ICDI port is being locked.\n");
-		return 100;
+	snap = 0;
+	report = NULL;
+	while ((optc = getopt_long(argc, argv, "so:", lopts, NULL)) != -1) {
+		switch(optc) {
+		case 's':
+			snap = 1;
+			break;
+		case 'o':
+			report = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return 4;
+		}
 	}
-	if (argc < 2) {
+	if (optind >= argc) {
 		fprintf(stderr, "The ICDI port name must be specified.\n");
 		return 8;
 	}
 
-	buf = icdi_init(argv[1], FLASH_ERASE_SIZE);
+	buf = icdi_init(argv[optind], FLASH_ERASE_SIZE);
 	if (buf == NULL)
 		return 1000;
 
@@ -46,37 +279,52 @@ int main(int argc, char *argv[])
 		goto exit_10;
 	}
 
-	if (!icdi_readu32(buf, SCSP_BASE+RM_CTRL_OFFSET, &val)) {
+	if (snap) {
+		out = report? fopen(report, "w") : stdout;
+		if (!out) {
+			fprintf(stderr, "Cannot open file: %s->%s\n", report,
+				strerror(errno));
+			retv = 24;
+			goto exit_10;
+		}
+		if (!snapshot(buf, out))
+			retv = 28;
+		if (out != stdout)
+			fclose(out);
+		icdi_qRcmd(buf, "debug disable");
+		goto exit_10;
+	}
+
+	nread = icdi_readv(buf, info_addrs, vals, INFO_REGS);
+	if (nread <= INFO_FSIZE) {
+		fprintf(stderr, "Cannot get flash memory size.\n");
+		retv = 16;
+		goto exit_10;
+	} else if (nread <= INFO_DID1) {
+		fprintf(stderr, "Cannot read DID0/DID1.\n");
+		retv = 12;
+		goto exit_10;
+	} else if (nread <= INFO_RM_CTRL) {
 		fprintf(stderr, "Cannot read RM_CTRL: %#08x\n",
 			SCSP_BASE+RM_CTRL_OFFSET);
 		retv = 4;
 		goto exit_10;
 	}
-	if (val & 1) {
+	if (vals[INFO_RM_CTRL] & 1) {
 		fprintf(stderr, "Internal ROM is mapped at address 0x0\n");
 		retv = 8;
 		goto exit_10;
 	}
-	if (!icdi_readu32(buf, SCSP_BASE+DID0_OFFSET, &did0) ||
-		!icdi_readu32(buf, SCSP_BASE+DID1_OFFSET, &did1)) {
-		fprintf(stderr, "Cannot read DID0/DID1.\n");
-		retv = 12;
-		goto exit_10;
-	}
-	
-	if (((did0 >> 16) & 0x0ff) == 0x05)
+
+	if (((vals[INFO_DID0] >> 16) & 0x0ff) == 0x05)
 		printf("TM4C123x Chip, ");
 	else
 		printf("Unsupported Chip\n");
-	if (((did1 >> 16) & 0x0ff) == 0x0A1)
+	if (((vals[INFO_DID1] >> 16) & 0x0ff) == 0x0A1)
 		printf("TM4C123GH6PM microcontroller.\n");
-	printf("DID0: %08X, DID1: %08X\n", did0, did1);
+	printf("DID0: %08X, DID1: %08X\n", vals[INFO_DID0], vals[INFO_DID1]);
 
-	if (!icdi_readu32(buf, FM_CTRL_BASE+FSIZE_OFFSET, &flashsiz)) {
-		fprintf(stderr, "Cannot get flash memory size.\n");
-		retv = 16;
-		goto exit_10;
-	}
+	flashsiz = vals[INFO_FSIZE];
 	if (flashsiz == 0x7f)
 		flashsiz = 256*1024;
 	else {
@@ -85,23 +333,23 @@ int main(int argc, char *argv[])
 		goto exit_10;
 	}
 	printf("Flash Size: %dKiB\n", flashsiz/1024);
-	if (!icdi_readu32(buf, SCSS_BASE+SCSS_EN0_OFFSET, &en0))
+	if (nread <= INFO_EN0)
 		fprintf(stderr, "Cannot read Interrupt enable reg 0.\n");
 	else
-		printf("Interrupt Enable Register 0: %08X\n", en0);
-	if (!icdi_readu32(buf, SCSS_BASE+SCSS_PRI0_OFFSET, &pri0))
+		printf("Interrupt Enable Register 0: %08X\n", vals[INFO_EN0]);
+	if (nread <= INFO_PRI0)
 		fprintf(stderr, "Cannot read Interrupt Priority Reg 0.\n");
 	else
-		printf("Interrupt Priority Register 0: %08X\n", pri0);
+		printf("Interrupt Priority Register 0: %08X\n",
+			vals[INFO_PRI0]);
 
-	if (!icdi_readu32(buf, SCSS_BASE+SCSS_STCTRL_OFFSET, &stctrl))
+	if (nread <= INFO_STCTRL)
 		fprintf(stderr, "Cannot read SysTick Control Register.\n");
 	else
-		printf("SysTick Control Register: %08X\n", pri0);
+		printf("SysTick Control Register: %08X\n", vals[INFO_STCTRL]);
 
 	icdi_qRcmd(buf, "debug disable");
 exit_10:
 	icdi_exit(buf);
-	instance_exit(lock);
 	return retv;
 }